@@ -96,23 +96,30 @@
  * ram_stealmem can be used before ram_getsize is called to allocate
  * memory that cannot be freed later. This is intended for use early
  * in bootup before VM initialization is complete.
+ *
+ * ram_getlastpaddr returns the same upper bound as ram_getsize but
+ * leaves it in place; it too is only good before ram_getsize.
  */
 
 void ram_bootstrap(void);
 paddr_t ram_stealmem(unsigned long npages);
 void ram_getsize(paddr_t *lo, paddr_t *hi);
+paddr_t ram_getlastpaddr(void);
 
 /*
  * TLB shootdown bits.
  *
  * We'll take up to 16 invalidations before just flushing the whole TLB.
+ *
+ * A shootdown names one page of one address space. The receiving CPU
+ * only acts on it if its TLB currently holds that address space.
  */
 
+struct addrspace;
+
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	struct addrspace *ts_as;	/* address space the page belongs to */
+	vaddr_t ts_vaddr;		/* page to invalidate */
 };
 
 #define TLBSHOOTDOWN_MAX 16
@@ -202,6 +202,23 @@ mips_trap(struct trapframe *tf)
 		}
 
 		curthread->t_in_interrupt = old_in;
+
+		/*
+		 * If another thread of our process is waiting for us
+		 * to go away (see proc_singlethread), do so now
+		 * rather than going back to user mode. This is what
+		 * catches threads that are spinning in userland.
+		 *
+		 * The processor still has interrupts off, but we're
+		 * about to sleep like any other thread, so first bring
+		 * it into line with the recorded state (spl 0) the same
+		 * way as for syscalls and faults below.
+		 */
+		if (!iskern && curproc->p_exiting) {
+			spl = splhigh();
+			splx(spl);
+			proc_threadexit(0);
+		}
 		goto done2;
 	}
 
@@ -322,6 +339,11 @@ mips_trap(struct trapframe *tf)
 	panic("I can't handle this... I think I'll just die now...\n");
 
  done:
+	/* Same check as above, for the way out of syscalls and faults. */
+	if (!iskern && curproc->p_exiting) {
+		proc_threadexit(0);
+	}
+
 	/*
 	 * Turn interrupts off on the processor, without affecting the
 	 * stored interrupt state.
@@ -369,6 +391,7 @@ mips_trap(struct trapframe *tf)
  * outside the mips port, but should be called from one of the
  * following places:
  *    - enter_new_process, for use by exec and equivalent.
+ *    - enter_new_thread, for use by thread_create.
  *    - enter_forked_process, in syscall.c, for use by fork.
  */
 void
@@ -443,3 +466,28 @@ enter_new_process(int argc, userptr_t argv, userptr_t env,
 
 	mips_usermode(&tf);
 }
+
+/*
+ * enter_new_thread: go to user mode in a new thread of an existing
+ * process.
+ *
+ * Like enter_new_process, but the thread starts with the single
+ * argument ARG, on the user stack STACK, at ENTRY. It also needs the
+ * process's global pointer GP, which crt0 only loads in the first
+ * thread.
+ */
+void
+enter_new_thread(userptr_t arg, vaddr_t stack, vaddr_t entry, vaddr_t gp)
+{
+	struct trapframe tf;
+
+	bzero(&tf, sizeof(tf));
+
+	tf.tf_status = CST_IRQMASK | CST_IEp | CST_KUp;
+	tf.tf_epc = entry;
+	tf.tf_a0 = (vaddr_t)arg;
+	tf.tf_sp = stack;
+	tf.tf_gp = gp;
+
+	mips_usermode(&tf);
+}
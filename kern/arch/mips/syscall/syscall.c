@@ -37,6 +37,7 @@
 #include <current.h>
 #include <copyinout.h>
 #include <syscall.h>
+#include "opt-dumbvm.h"
 
 
 /*
@@ -113,6 +114,23 @@ syscall(struct trapframe *tf)
 				 (userptr_t)tf->tf_a1);
 		break;
 
+	    case SYS_nanosleep:
+		err = sys_nanosleep((const_userptr_t)tf->tf_a0,
+				    (userptr_t)tf->tf_a1);
+		break;
+
+	    case SYS_setaffinity:
+		err = sys_setaffinity(tf->tf_a0);
+		break;
+
+	    case SYS_getaffinity:
+		err = sys_getaffinity((userptr_t)tf->tf_a0);
+		break;
+
+	    case SYS_schedstat:
+		err = sys_schedstat(tf->tf_a0, (userptr_t)tf->tf_a1);
+		break;
+
 
 	    /* process calls */
 
@@ -120,12 +138,25 @@ syscall(struct trapframe *tf)
 		err = sys_fork(tf, &retval);
 		break;
 
+	    case SYS_vfork:
+		err = sys_vfork(tf, &retval);
+		break;
+
 	    case SYS_execv:
 		err = sys_execv(
 			(userptr_t)tf->tf_a0,
 			(userptr_t)tf->tf_a1);
 		break;
 
+	    case SYS_spawn:
+		err = sys_spawn(
+			(userptr_t)tf->tf_a0,
+			(userptr_t)tf->tf_a1,
+			(userptr_t)tf->tf_a2,
+			tf->tf_a3,
+			&retval);
+		break;
+
 	    case SYS__exit:
 		sys__exit(tf->tf_a0);
 		panic("Returning from exit\n");
@@ -143,6 +174,61 @@ syscall(struct trapframe *tf)
 		break;
 
 
+	    /* thread calls */
+
+	    case SYS___thread_create:
+		err = sys___thread_create(
+			(userptr_t)tf->tf_a0,
+			(userptr_t)tf->tf_a1,
+			(userptr_t)tf->tf_a2,
+			tf->tf_gp,
+			&retval);
+		break;
+
+	    case SYS_thread_exit:
+		sys_thread_exit(tf->tf_a0);
+		panic("Returning from thread_exit\n");
+
+	    case SYS_thread_join:
+		err = sys_thread_join(tf->tf_a0, (userptr_t)tf->tf_a1);
+		break;
+
+	    case SYS_futex:
+		err = sys_futex(
+			(userptr_t)tf->tf_a0,
+			tf->tf_a1,
+			tf->tf_a2,
+			&retval);
+		break;
+
+
+	    /* memory hint calls */
+
+#if !OPT_DUMBVM
+	    case SYS_madvise:
+		err = sys_madvise(
+			(userptr_t)tf->tf_a0,
+			tf->tf_a1,
+			tf->tf_a2);
+		break;
+
+	    case SYS_mincore:
+		err = sys_mincore(
+			(userptr_t)tf->tf_a0,
+			tf->tf_a1,
+			(userptr_t)tf->tf_a2);
+		break;
+
+	    case SYS_mlock:
+		err = sys_mlock((userptr_t)tf->tf_a0, tf->tf_a1);
+		break;
+
+	    case SYS_munlock:
+		err = sys_munlock((userptr_t)tf->tf_a0, tf->tf_a1);
+		break;
+#endif
+
+
 	    /* file calls */
 
 	    case SYS_open:
@@ -242,6 +242,15 @@ as_destroy(struct addrspace *as)
 	kfree(as);
 }
 
+/*
+ * Not worth deferring; there are only three chunks to free.
+ */
+void
+as_destroy_later(struct addrspace *as)
+{
+	as_destroy(as);
+}
+
 void
 as_activate(void)
 {
@@ -400,3 +409,37 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	*ret = new;
 	return 0;
 }
+
+/*
+ * dumbvm never moves or frees a process's memory, so there's nothing
+ * to hold on to.
+ */
+int
+as_getpaddr(struct addrspace *as, vaddr_t vaddr, paddr_t *ret)
+{
+	vaddr_t vtop1, vtop2, stackbase;
+
+	vtop1 = as->as_vbase1 + as->as_npages1 * PAGE_SIZE;
+	vtop2 = as->as_vbase2 + as->as_npages2 * PAGE_SIZE;
+	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
+
+	if (vaddr >= as->as_vbase1 && vaddr < vtop1) {
+		*ret = (vaddr - as->as_vbase1) + as->as_pbase1;
+	}
+	else if (vaddr >= as->as_vbase2 && vaddr < vtop2) {
+		*ret = (vaddr - as->as_vbase2) + as->as_pbase2;
+	}
+	else if (vaddr >= stackbase && vaddr < USERSTACK) {
+		*ret = (vaddr - stackbase) + as->as_stackpbase;
+	}
+	else {
+		return EFAULT;
+	}
+	return 0;
+}
+
+void
+as_putpaddr(struct addrspace *as)
+{
+	(void)as;
+}
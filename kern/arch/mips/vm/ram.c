@@ -109,6 +109,20 @@ ram_stealmem(unsigned long npages)
 	return paddr;
 }
 
+/*
+ * Return one past the highest physical address, without claiming the
+ * memory the way ram_getsize does. This is for code that wants to
+ * size per-page tables before the VM system is up.
+ *
+ * This function should not be called once the VM system is initialized.
+ */
+paddr_t
+ram_getlastpaddr(void)
+{
+	KASSERT(lastpaddr != 0);
+	return lastpaddr;
+}
+
 /*
  * This function is intended to be called by the VM system when it
  * initializes in order to find out what memory it has available to
@@ -74,6 +74,29 @@ mips_timer_set(uint32_t count)
 		:: "r" (count));
 }
 
+/*
+ * Read the on-chip timer's cycle count. On System/161, writing
+ * c0_compare resets c0_count, so this is the number of cycles since
+ * the timer was last set.
+ */
+static
+uint32_t
+mips_timer_get(void)
+{
+	uint32_t count;
+
+	/* $9 == c0_count */
+	__asm volatile(
+		".set push;"		/* save assembler mode */
+		".set mips32;"		/* allow MIPS32 registers */
+		"mfc0 %0, $9;"		/* do it */
+		".set pop"		/* restore assembler mode */
+		: "=r" (count));
+	return count;
+}
+
+#define CYCLES_PER_HARDCLOCK (CPU_FREQUENCY / HZ)
+
 /*
  * LAMEbus data for the system. (We have only one LAMEbus per system.)
  * This does not need to be locked, because it's constant once
@@ -114,7 +137,24 @@ mainbus_bootstrap(void)
 	/*
 	 * Configure the MIPS on-chip timer to interrupt HZ times a second.
 	 */
-	mips_timer_set(CPU_FREQUENCY / HZ);
+	mips_timer_set(CYCLES_PER_HARDCLOCK);
+}
+
+/*
+ * Tickless support: stretch or check the on-chip timer period.
+ */
+void
+mainbus_settimer(unsigned hardclocks)
+{
+	KASSERT(hardclocks > 0);
+	KASSERT(hardclocks <= 0xffffffff / CYCLES_PER_HARDCLOCK);
+	mips_timer_set(hardclocks * CYCLES_PER_HARDCLOCK);
+}
+
+unsigned
+mainbus_timer_elapsed(void)
+{
+	return mips_timer_get() / CYCLES_PER_HARDCLOCK;
 }
 
 /*
@@ -285,7 +325,7 @@ mainbus_interrupt(struct trapframe *tf)
 	}
 	else if (cause & MIPS_TIMER_BIT) {
 		/* Reset the timer (this clears the interrupt) */
-		mips_timer_set(CPU_FREQUENCY / HZ);
+		mips_timer_set(CYCLES_PER_HARDCLOCK);
 		/* and call hardclock */
 		hardclock();
 	}
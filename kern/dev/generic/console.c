@@ -368,11 +368,11 @@ config_con(struct con_softc *cs, int unit)
 	}
 	KASSERT(the_console==NULL);
 
-	rsem = sem_create("console read", 0);
+	rsem = sem_create_fifo("console read", 0);
 	if (rsem == NULL) {
 		return ENOMEM;
 	}
-	wsem = sem_create("console write", 1);
+	wsem = sem_create_fifo("console write", 1);
 	if (wsem == NULL) {
 		sem_destroy(rsem);
 		return ENOMEM;
@@ -301,7 +301,7 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
 	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
+	lh->lh_clear = sem_create_fifo("lhd-clear", 1);
 	if (lh->lh_clear == NULL) {
 		return ENOMEM;
 	}
@@ -37,6 +37,7 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <array.h>
+#include <synch.h>
 #include <bitmap.h>
 #include <uio.h>
 #include <vfs.h>
@@ -149,11 +150,13 @@ sfs_sync(struct fs *fs)
 	sfs = fs->fs_data;
 
 	/* Go over the array of loaded vnodes, syncing as we go. */
+	rwlock_acquire_read(sfs->sfs_vnlock);
 	num = vnodearray_num(sfs->sfs_vnodes);
 	for (i=0; i<num; i++) {
 		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
 		VOP_FSYNC(v);
 	}
+	rwlock_release_read(sfs->sfs_vnlock);
 
 	/* If the free block map needs to be written, write it. */
 	if (sfs->sfs_freemapdirty) {
@@ -222,6 +225,7 @@ sfs_unmount(struct fs *fs)
 	KASSERT(sfs->sfs_freemapdirty == false);
 
 	/* Once we start nuking stuff we can't fail. */
+	rwlock_destroy(sfs->sfs_vnlock);
 	vnodearray_destroy(sfs->sfs_vnodes);
 	bitmap_destroy(sfs->sfs_freemap);
 
@@ -358,6 +362,16 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 		return result;
 	}
 
+	/* Lock for the vnode table */
+	sfs->sfs_vnlock = rwlock_create("sfs_vnodes");
+	if (sfs->sfs_vnlock == NULL) {
+		bitmap_destroy(sfs->sfs_freemap);
+		vnodearray_destroy(sfs->sfs_vnodes);
+		kfree(sfs);
+		vfs_biglock_release();
+		return ENOMEM;
+	}
+
 	/* Set up abstract fs calls */
 	sfs->sfs_absfs.fs_data = sfs;
 	sfs->sfs_absfs.fs_ops = &sfs_fsops;
@@ -35,6 +35,7 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <lib.h>
+#include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
 #include "sfsprivate.h"
@@ -75,19 +76,12 @@ sfs_reclaim(struct vnode *v)
 	vfs_biglock_acquire();
 
 	/*
-	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * Do the disk I/O first, without the table lock, so that
+	 * lookups of other files on the volume don't wait behind it.
+	 * If someone picks the vnode up again meanwhile, syncing it
+	 * did no harm, and neither did truncating it: with no links
+	 * left, nobody can be after its contents.
 	 */
-	if (v->vn_refcount != 1) {
-
-		/* consume the reference VOP_DECREF gave us */
-		KASSERT(v->vn_refcount>1);
-		v->vn_refcount--;
-
-		vfs_biglock_release();
-		return EBUSY;
-	}
 
 	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount==0) {
@@ -105,6 +99,23 @@ sfs_reclaim(struct vnode *v)
 		return result;
 	}
 
+	/*
+	 * Make sure someone else hasn't picked up the vnode since the
+	 * decision was made to reclaim it. Holding the table lock
+	 * exclusively keeps sfs_loadvnode from finding it meanwhile.
+	 */
+	rwlock_acquire_write(sfs->sfs_vnlock);
+	if (v->vn_refcount != 1) {
+
+		/* consume the reference VOP_DECREF gave us */
+		KASSERT(v->vn_refcount>1);
+		v->vn_refcount--;
+
+		rwlock_release_write(sfs->sfs_vnlock);
+		vfs_biglock_release();
+		return EBUSY;
+	}
+
 	/* If there are no on-disk references, discard the inode */
 	if (sv->sv_i.sfi_linkcount==0) {
 		sfs_bfree(sfs, sv->sv_ino);
@@ -126,6 +137,7 @@ sfs_reclaim(struct vnode *v)
 		      sv->sv_ino);
 	}
 	vnodearray_remove(sfs->sfs_vnodes, ix);
+	rwlock_release_write(sfs->sfs_vnlock);
 
 	vnode_cleanup(&sv->sv_v);
 
@@ -139,20 +151,17 @@ sfs_reclaim(struct vnode *v)
 }
 
 /*
- * Function to load a inode into memory as a vnode, or dig up one
- * that's already resident.
+ * Look for a resident vnode for inode INO, and take a reference to it
+ * if it's there. The caller holds sfs_vnlock, either way.
  */
-int
-sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
-		 struct sfs_vnode **ret)
+static
+struct sfs_vnode *
+sfs_findvnode(struct sfs_fs *sfs, uint32_t ino)
 {
 	struct vnode *v;
 	struct sfs_vnode *sv;
-	const struct vnode_ops *ops;
 	unsigned i, num;
-	int result;
 
-	/* Look in the vnodes table */
 	num = vnodearray_num(sfs->sfs_vnodes);
 
 	/* Linear search. Is this too slow? You decide. */
@@ -167,16 +176,35 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		}
 
 		if (sv->sv_ino==ino) {
-			/* Found */
-
-			/* forcetype is only allowed when creating objects */
-			KASSERT(forcetype==SFS_TYPE_INVAL);
-
 			VOP_INCREF(&sv->sv_v);
-			*ret = sv;
-			return 0;
+			return sv;
 		}
 	}
+	return NULL;
+}
+
+/*
+ * Function to load a inode into memory as a vnode, or dig up one
+ * that's already resident.
+ */
+int
+sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
+		 struct sfs_vnode **ret)
+{
+	struct sfs_vnode *sv, *sv2;
+	const struct vnode_ops *ops;
+	int result;
+
+	/* Look in the vnodes table; lookups can share it */
+	rwlock_acquire_read(sfs->sfs_vnlock);
+	sv = sfs_findvnode(sfs, ino);
+	rwlock_release_read(sfs->sfs_vnlock);
+	if (sv != NULL) {
+		/* forcetype is only allowed when creating objects */
+		KASSERT(forcetype==SFS_TYPE_INVAL);
+		*ret = sv;
+		return 0;
+	}
 
 	/* Didn't have it loaded; load it */
 
@@ -238,8 +266,22 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Set the other fields in our vnode structure */
 	sv->sv_ino = ino;
 
-	/* Add it to our table */
+	/*
+	 * Add it to our table, unless someone else loaded it while we
+	 * weren't holding the lock; then use theirs.
+	 */
+	rwlock_acquire_write(sfs->sfs_vnlock);
+	sv2 = sfs_findvnode(sfs, ino);
+	if (sv2 != NULL) {
+		rwlock_release_write(sfs->sfs_vnlock);
+		KASSERT(forcetype==SFS_TYPE_INVAL);
+		vnode_cleanup(&sv->sv_v);
+		kfree(sv);
+		*ret = sv2;
+		return 0;
+	}
 	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
+	rwlock_release_write(sfs->sfs_vnlock);
 	if (result) {
 		vnode_cleanup(&sv->sv_v);
 		kfree(sv);
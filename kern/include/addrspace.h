@@ -36,6 +36,7 @@
 
 
 #include <vm.h>
+#include <workqueue.h>
 #include "opt-dumbvm.h"
 
 #define PAGE_TABLE_ONE_SIZE  1024
@@ -55,6 +56,8 @@ struct page_table_entry {
 	paddr_t pbase;
 	int is_dirty;
 	int is_valid;
+	int is_locked;		/* locked by mlock(); DONTNEED leaves it */
+	int is_loaded;		/* holds data loaded from the executable */
 	int index;
 	int offset;
 	struct page_table_entry* next;
@@ -66,6 +69,7 @@ struct region {
 	int readable;
 	int writeable;
 	int executable;
+	int advice;		/* MADV_NORMAL, MADV_RANDOM or MADV_SEQUENTIAL */
 	struct region* next;
 };
 
@@ -81,9 +85,14 @@ struct addrspace {
 #else
         /* Put stuff here for your VM system */
         struct page_table_entry **page_directory;
+        struct rwlock *as_regionlock;	/* protects the region list */
+        struct lock *as_ptlock;		/* protects page table shape */
         int num_regions;
         struct region* first_region;
         struct region** readonly_preparation;
+        int as_loading;		/* between as_prepare/complete_load */
+        uint32_t as_cpus;	/* CPUs whose TLB may hold our entries */
+        struct work as_work;	/* for as_destroy_later */
 #endif
 };
 
@@ -97,6 +106,36 @@ struct page_table_entry* destroy_page_table_entry(struct page_table_entry* head,
 struct page_table_entry* page_walk(vaddr_t vaddr, struct addrspace* as, int create_flag);
 struct region* retrieve_region(struct addrspace* as, vaddr_t faultaddress);
 
+/*
+ * Memory hint helpers (madvise/mincore/mlock):
+ *
+ *    as_advise   - apply an MADV_* hint to the pages [vaddr, vaddr+len).
+ *    as_mincore  - fill VEC with MINCORE_* bits for NPAGES pages from VADDR.
+ *    as_lock     - fault in and pin (LOCK set) or unpin the given pages.
+ *    as_prefault - fault in up to NPAGES pages from VADDR that are not yet
+ *                  resident, stopping at the end of the region.
+ *
+ * VADDR must be page-aligned; the range must lie within defined regions.
+ */
+int as_advise(struct addrspace *as, vaddr_t vaddr, size_t len, int advice);
+int as_mincore(struct addrspace *as, vaddr_t vaddr, size_t npages,
+	       unsigned char *vec);
+int as_lock(struct addrspace *as, vaddr_t vaddr, size_t len, int lock);
+int as_prefault(struct addrspace *as, vaddr_t vaddr, size_t npages);
+
+/*
+ * Physical lookup (for futexes):
+ *
+ *    as_getpaddr - find the physical address backing user address
+ *                  VADDR, faulting the page in if need be. On success
+ *                  the frame stays put until as_putpaddr is called.
+ *    as_putpaddr - let go of the frame from as_getpaddr.
+ *
+ * These are in dumbvm.c as well.
+ */
+int as_getpaddr(struct addrspace *as, vaddr_t vaddr, paddr_t *ret);
+void as_putpaddr(struct addrspace *as);
+
 
 /*
  * Functions in addrspace.c:
@@ -122,6 +161,11 @@ struct region* retrieve_region(struct addrspace* as, vaddr_t faultaddress);
  *    as_destroy - dispose of an address space. You may need to change
  *                the way this works if implementing user-level threads.
  *
+ *    as_destroy_later - as_destroy, but possibly on a work queue so the
+ *                caller needn't wait for it. Nothing may use the
+ *                address space afterwards. Only a few are deferred
+ *                at a time; beyond that it's done on the spot.
+ *
  *    as_define_region - set up a region of memory within the address
  *                space.
  *
@@ -144,6 +188,7 @@ int               as_copy(struct addrspace *src, struct addrspace **ret);
 void              as_activate(void);
 void              as_deactivate(void);
 void              as_destroy(struct addrspace *);
+void              as_destroy_later(struct addrspace *);
 
 int               as_define_region(struct addrspace *as,
                                    vaddr_t vaddr, size_t sz,
@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _CALLOUT_H_
+#define _CALLOUT_H_
+
+/*
+ * Callouts: functions to be called after a given number of hardclocks.
+ *
+ * Each cpu has its own timer wheel, advanced by hardclock(). A callout
+ * goes on the wheel of the cpu that schedules it and runs there, in
+ * the timer interrupt, so the function may not sleep; it may wake
+ * things up, though.
+ *
+ *    callout_init     - set up a callout to call FUNC(ARG).
+ *    callout_schedule - arrange for it to run TICKS hardclocks from now
+ *                       (at least one). If it was already pending, it
+ *                       is moved.
+ *    callout_stop     - cancel it. Returns true if it was pending and
+ *                       now won't run. If it's running on another cpu,
+ *                       waits for it to finish first, so once this
+ *                       returns the callout may be freed (unless it
+ *                       is called from the callout itself).
+ *
+ * The caller is responsible for not scheduling and stopping the same
+ * callout at the same time from different threads.
+ */
+
+struct cpu;		/* from <cpu.h> */
+struct callwheel;	/* Private to callout.c */
+
+struct callout {
+	struct callout *co_next;	/* Link on wheel slot */
+	struct callout **co_prevp;	/* Pointer to link to us */
+	uint32_t co_expire;		/* Wheel time to run at */
+	bool co_pending;		/* On a wheel slot */
+	struct callwheel *co_wheel;	/* Wheel pending or running on */
+	void (*co_func)(void *);
+	void *co_arg;
+};
+
+void callout_init(struct callout *co, void (*func)(void *), void *arg);
+void callout_schedule(struct callout *co, unsigned ticks);
+bool callout_stop(struct callout *co);
+
+/*
+ * Interface for the clock and thread code.
+ *
+ *    callwheel_create   - make a wheel for a new cpu.
+ *    callout_hardclock  - advance the current cpu's wheel to the cpu's
+ *                         c_hardclocks count, running whatever comes
+ *                         due.
+ *    callout_nexttick   - return the number of hardclocks until the
+ *                         current cpu's wheel needs attention, for
+ *                         tickless operation.
+ */
+struct callwheel *callwheel_create(void);
+void callout_hardclock(void);
+unsigned callout_nexttick(void);
+
+/*
+ * Interface for testing: a wheel that isn't attached to a cpu and is
+ * run by hand.
+ *
+ *    callwheel_settime  - set an empty wheel's clock to NOW.
+ *    callwheel_schedule - like callout_schedule, but on wheel CW.
+ *    callwheel_advance  - run wheel CW forward TICKS hardclocks,
+ *                         running whatever comes due (in the calling
+ *                         thread).
+ *    callwheel_destroy  - free an empty wheel.
+ */
+void callwheel_settime(struct callwheel *cw, uint32_t now);
+void callwheel_schedule(struct callwheel *cw, struct callout *co,
+			unsigned ticks);
+void callwheel_advance(struct callwheel *cw, unsigned ticks);
+void callwheel_destroy(struct callwheel *cw);
+
+/*
+ * Sleep for TICKS hardclocks.
+ */
+void clock_sleepticks(unsigned ticks);
+
+
+#endif /* _CALLOUT_H_ */
@@ -48,6 +48,28 @@
 void hardclock_bootstrap(void);
 void hardclock(void);
 
+/*
+ * clock_ticks counts hardclocks on CPU 0 since boot. It's a cheap
+ * system-wide timestamp for measuring intervals; it wraps, so only
+ * differences are meaningful.
+ */
+extern volatile uint32_t clock_ticks;
+
+/*
+ * Tickless operation (options tickless).
+ *
+ * hardclock_stretch asks for the current cpu's next timer interrupt
+ * to come after TICKS hardclocks instead of one, for use when it's
+ * idle or has only one thread to run. hardclock_restore puts the
+ * periodic tick back early, when there's work to share out, and
+ * accounts for the hardclocks that went by in the meantime. Both
+ * are called with interrupts off. CPU 0 keeps its periodic tick, so
+ * clock_ticks stays current; this only helps the secondary cpus, and
+ * on a uniprocessor the option does nothing.
+ */
+void hardclock_stretch(unsigned ticks);
+void hardclock_restore(void);
+
 /*
  * timerclock() is called on one CPU once a second to allow simple
  * timed operations. (This is a fairly simpleminded interface.)
@@ -33,6 +33,7 @@
 
 #include <spinlock.h>
 #include <threadlist.h>
+#include <kern/schedstat.h>
 #include <machine/vm.h>  /* for TLBSHOOTDOWN_MAX */
 
 
@@ -59,8 +60,13 @@ struct cpu {
 	 */
 	struct thread *c_curthread;	/* Current thread on cpu */
 	struct threadlist c_zombies;	/* List of exited threads */
+	struct threadlist c_threadpool;	/* Dead threads kept for reuse */
+	struct threadlist c_sendaway;	/* Yielded threads not allowed here */
+	struct thread *c_idlethread;	/* Runs while c_sendaway is handled */
 	unsigned c_hardclocks;		/* Counter of hardclock() calls */
 	unsigned c_spinlocks;		/* Counter of spinlocks held */
+	uint32_t c_stealrand;		/* Random state for work stealing */
+	unsigned c_asbacklog;		/* Address spaces on c_workqueue */
 
 	/*
 	 * Accessed by other cpus.
@@ -69,6 +75,10 @@ struct cpu {
 	bool c_isidle;			/* True if this cpu is idle */
 	struct threadlist c_runqueue;	/* Run queue for this cpu */
 	struct spinlock c_runqueue_lock;
+	unsigned c_tickperiod;		/* Hardclocks per timer interrupt */
+	struct schedstat c_schedstat;	/* Switch counts and latencies */
+	struct callwheel *c_callwheel;	/* Callouts (has its own lock) */
+	struct workqueue *c_workqueue;	/* Deferred work (has its own lock) */
 
 	/*
 	 * Accessed by other cpus.
@@ -87,6 +97,7 @@ struct cpu {
 	uint32_t c_ipi_pending;		/* One bit for each IPI number */
 	struct tlbshootdown c_shootdown[TLBSHOOTDOWN_MAX];
 	int c_numshootdown;
+	volatile unsigned c_shootdown_gen; /* Bumped after each batch done */
 	struct spinlock c_ipi_lock;
 };
 
@@ -153,6 +164,10 @@ void cpu_halt(void);
  * ipi_send sends an IPI to one CPU.
  * ipi_broadcast sends an IPI to all CPUs except the current one.
  * ipi_tlbshootdown is like ipi_send but carries TLB shootdown data.
+ * ipi_tlbshootdown_mask queues a batch of NUM shootdowns on each CPU
+ * in CPUMASK (one bit per c_number) other than the current one, sends
+ * each of them a single IPI, and waits until all have processed it.
+ * It must be called with interrupts enabled and no spinlocks held.
  *
  * interprocessor_interrupt is called on the target CPU when an IPI is
  * received.
@@ -167,6 +182,8 @@ void cpu_halt(void);
 void ipi_send(struct cpu *target, int code);
 void ipi_broadcast(int code);
 void ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping);
+void ipi_tlbshootdown_mask(uint32_t cpumask,
+			   const struct tlbshootdown *mappings, unsigned num);
 
 void interprocessor_interrupt(void);
 
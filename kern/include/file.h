@@ -68,11 +68,12 @@ int file_close(int fd);
 
 /*
  * filetable struct
- * just an array of open files.  nice and simple.  doesn't require
- * synchronization, because a table can only be owned by a single process (on
- * inheritance in fork, the table is copied).
+ * just an array of open files.  nice and simple.  a table is only ever owned
+ * by a single process (on inheritance in fork, the table is copied), but the
+ * threads of that process share it, so ft_lock protects the slots.
  */
 struct filetable {
+	struct lock *ft_lock;
 	struct openfile *ft_openfiles[OPEN_MAX];
 };
 
@@ -82,6 +83,7 @@ int filetable_init(const char *inpath, const char *outpath,
 int filetable_copy(struct filetable **copy);
 int filetable_placefile(struct openfile *file, int *fd);
 int filetable_findfile(int fd, struct openfile **file);
+void filetable_putfile(struct openfile *file);
 int filetable_dup2file(int oldfd, int newfd);
 void filetable_destroy(struct filetable *ft);
 
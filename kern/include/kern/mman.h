@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Codes for madvise(). These are shared between the kernel and libc
+ * (where they appear in <unistd.h>).
+ *
+ * MADV_NORMAL, MADV_RANDOM and MADV_SEQUENTIAL are sticky and describe
+ * the expected access pattern of a range; MADV_WILLNEED and
+ * MADV_DONTNEED are one-shot requests acted on immediately.
+ *
+ * MADV_DONTNEED only frees anonymous pages (the stack, and BSS the
+ * loader never touched). If the range holds any page that is locked
+ * or that was loaded from the executable, it fails with EINVAL and
+ * frees nothing.
+ */
+
+#define MADV_NORMAL       0      /* No special treatment */
+#define MADV_RANDOM       1      /* Expect random access; no readahead */
+#define MADV_SEQUENTIAL   2      /* Expect sequential access; read ahead */
+#define MADV_WILLNEED     3      /* Will need these pages; fault them in */
+#define MADV_DONTNEED     4      /* Done with these pages; free them */
+
+/*
+ * Bits in the vector returned by mincore().
+ */
+#define MINCORE_INCORE    0x1    /* Page is resident */
+#define MINCORE_LOCKED    0x2    /* Page is locked in memory */
+
+
+#endif /* _KERN_MMAN_H_ */
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _KERN_SCHEDSTAT_H_
+#define _KERN_SCHEDSTAT_H_
+
+/*
+ * Scheduler statistics, kept per cpu and per thread. Shared between
+ * the kernel and libc (where it appears in <unistd.h>).
+ *
+ * A switch is involuntary if the thread was preempted by the timer,
+ * and voluntary otherwise (it slept, yielded, or exited). Migrations
+ * count threads moved onto the cpu, or the times the thread was
+ * moved. Idle time is in hardclocks and is only kept per cpu.
+ *
+ * ss_latency is a histogram of run queue latency, the time from when
+ * a thread is made runnable until it runs, in hardclocks: bucket 0
+ * counts waits of less than one, and bucket N (N > 0) waits of 2^(N-1)
+ * up to 2^N, except the last bucket also takes everything longer.
+ */
+#define SCHEDSTAT_BUCKETS 8
+
+struct schedstat {
+	unsigned ss_vswitches;		/* voluntary switches */
+	unsigned ss_ivswitches;		/* involuntary switches */
+	unsigned ss_migrations;		/* moves between cpus */
+	unsigned ss_idleticks;		/* hardclocks spent idle */
+	unsigned ss_latency[SCHEDSTAT_BUCKETS];
+};
+
+/* For schedstat(): the calling thread rather than a cpu number */
+#define SCHEDSTAT_SELF    (-1)
+
+
+#endif /* _KERN_SCHEDSTAT_H_ */
@@ -59,10 +59,10 @@
 #define SYS_mmap         8
 #define SYS_munmap       9
 #define SYS_mprotect     10
-//#define SYS_madvise    11
-//#define SYS_mincore    12
-//#define SYS_mlock      13
-//#define SYS_munlock    14
+#define SYS_madvise      11
+#define SYS_mincore      12
+#define SYS_mlock        13
+#define SYS_munlock      14
 //#define SYS_munlockall 15
 //#define SYS_minherit   16
 //                              (security/credentials)
@@ -196,6 +196,15 @@
 #define SYS_sync         118
 #define SYS_reboot       119
 //#define SYS___sysctl   120
+//                              (local additions)
+#define SYS_spawn        121
+#define SYS_setaffinity  122
+#define SYS_getaffinity  123
+#define SYS_schedstat    124
+#define SYS___thread_create 125
+#define SYS_thread_exit  126
+#define SYS_thread_join  127
+#define SYS_futex        128
 
 /*CALLEND*/
 
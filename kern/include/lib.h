@@ -120,17 +120,27 @@ uint32_t random(void);
 
 /*
  * Kernel heap memory allocation. Like malloc/free.
- * If out of memory, kmalloc returns NULL.
+ * If out of memory, kmalloc returns NULL. kheap_bootstrap sizes the
+ * heap's tables and must be called before the first kmalloc.
  *
  * kheap_nextgeneration, dump, and dumpall do nothing unless heap
- * labeling (for leak detection) in kmalloc.c (q.v.) is enabled.
+ * labeling (for leak detection) in kmalloc.c (q.v.) is enabled, and
+ * kheap_profile does nothing unless heap profiling is.
+ *
+ * kheap_profile_pages and kheap_profile_unpages put whole pages got
+ * straight from alloc_kpages (objcache slabs, say) in the heap
+ * profile, charged to SITE; unpages must come before free_kpages.
  */
+void kheap_bootstrap(void);
 void *kmalloc(size_t size);
 void kfree(void *ptr);
 void kheap_printstats(void);
 void kheap_nextgeneration(void);
 void kheap_dump(void);
 void kheap_dumpall(void);
+void kheap_profile(void);
+void kheap_profile_pages(vaddr_t va, unsigned npages, vaddr_t site);
+void kheap_profile_unpages(vaddr_t va);
 
 /*
  * C string functions.
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _LOCKSTAT_H_
+#define _LOCKSTAT_H_
+
+/*
+ * Lock contention statistics.
+ *
+ * With the lockstat option, spinlock_acquire, lock_acquire, P and
+ * cv_wait keep counts per lock name: acquisitions, how many of those
+ * found the lock already taken, total and longest wait, and (for
+ * spinlocks and locks) total hold time. Locks with the same name are
+ * counted together, so e.g. every "pidinfo cv" shares one entry.
+ * Only named spinlocks are counted; see spinlock_setname.
+ *
+ * Collection is off until turned on from the kernel menu, both to
+ * keep the cost down and because the timestamps come from gettime(),
+ * which doesn't work until the clock device has attached.
+ */
+
+#include "opt-lockstat.h"
+
+/* Kinds of lock, for telling same-named locks of different kinds apart */
+#define LOCKSTAT_SPIN	0
+#define LOCKSTAT_LOCK	1
+#define LOCKSTAT_SEM	2
+#define LOCKSTAT_CV	3
+
+#if OPT_LOCKSTAT
+
+struct lockstat;	/* Private to lockstat.c */
+
+extern volatile bool lockstat_enabled;
+
+/*
+ * Interface for the lock code.
+ *
+ *    lockstat_now     - current time in nanoseconds.
+ *    lockstat_acquire - count an acquisition of the lock of kind KIND
+ *                       named NAME, which waited WAIT ns. *LSP caches
+ *                       the entry for NAME; it starts out NULL.
+ *    lockstat_hold    - add HOLD ns of hold time to an entry that
+ *                       lockstat_acquire has filled in.
+ */
+uint64_t lockstat_now(void);
+void lockstat_acquire(struct lockstat **lsp, unsigned kind, const char *name,
+		      bool contended, uint64_t wait);
+void lockstat_hold(struct lockstat *ls, uint64_t hold);
+
+/*
+ * Menu interface: start or stop collecting, zero the counts, and
+ * print the locks with the most waiting.
+ */
+void lockstat_enable(bool on);
+void lockstat_reset(void);
+void lockstat_print(void);
+
+#endif /* OPT_LOCKSTAT */
+
+
+#endif /* _LOCKSTAT_H_ */
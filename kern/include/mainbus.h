@@ -55,6 +55,15 @@ size_t mainbus_ramsize(void);
 /* Switch on an inter-processor interrupt. (Low-level.) */
 void mainbus_send_ipi(struct cpu *target);
 
+/*
+ * Program the current cpu's clock to interrupt after HARDCLOCKS
+ * hardclock periods instead of after one, and find out how many
+ * periods have gone by since it was last programmed. (The clock goes
+ * back to one period on its own each time it interrupts.)
+ */
+void mainbus_settimer(unsigned hardclocks);
+unsigned mainbus_timer_elapsed(void);
+
 /*
  * The various ways to shut down the system. (These are very low-level
  * and should generally not be called directly - md_poweroff, for
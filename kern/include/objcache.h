@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _OBJCACHE_H_
+#define _OBJCACHE_H_
+
+/*
+ * Typed object caches.
+ *
+ * An object cache hands out fixed-size objects of one type, carved
+ * out of whole pages ("slabs"), so allocating one is a freelist pop
+ * instead of a trip through kmalloc's size classes.
+ *
+ * If a constructor is given, every object is constructed once when
+ * its slab is created and destructed only when the slab is given
+ * back; objects must be freed in their constructed state. This lets
+ * expensive setup (creating a lock, say) be kept across reuse. The
+ * constructor returns 0 or an error code; if it fails the slab isn't
+ * created and objcache_alloc returns NULL.
+ *
+ * Caches are defined statically with OBJCACHE_INITIALIZER and need no
+ * bootstrap call:
+ *
+ *    static struct objcache foo_cache =
+ *        OBJCACHE_INITIALIZER("foo", sizeof(struct foo), NULL, NULL);
+ *
+ * Objects must be smaller than about a quarter of a page.
+ */
+
+#include <spinlock.h>
+
+struct objslab;		/* Private to objcache.c */
+
+struct objcache {
+	const char *oc_name;		/* Name, for stats */
+	size_t oc_size;			/* Object size */
+	int (*oc_ctor)(void *obj);	/* Constructor, or NULL */
+	void (*oc_dtor)(void *obj);	/* Destructor, or NULL */
+
+	struct spinlock oc_lock;	/* Protects everything below */
+	struct objslab *oc_slabs;	/* Slabs with free objects */
+	unsigned oc_nslabs;		/* Number of slabs */
+	unsigned oc_nempty;		/* Number of completely free slabs */
+	unsigned oc_inuse;		/* Objects allocated */
+	unsigned long oc_allocs;	/* Total objcache_alloc calls */
+	unsigned long oc_frees;		/* Total objcache_free calls */
+	unsigned long oc_slaballocs;	/* Total slabs created */
+
+	struct objcache *oc_next;	/* On the list of all caches */
+	bool oc_listed;			/* True once on that list */
+};
+
+#define OBJCACHE_INITIALIZER(name, size, ctor, dtor) {	\
+	.oc_name = (name),				\
+	.oc_size = (size),				\
+	.oc_ctor = (ctor),				\
+	.oc_dtor = (dtor),				\
+	.oc_lock = SPINLOCK_INITIALIZER_NAMED(name),	\
+	.oc_slabs = NULL,				\
+	.oc_next = NULL,				\
+	.oc_listed = false,				\
+}
+
+/*
+ * Operations.
+ *
+ *    objcache_alloc - get an object, or NULL if out of memory.
+ *    objcache_free  - return an object to the cache it came from.
+ *    objcache_printstats - print usage of all caches.
+ */
+void *objcache_alloc(struct objcache *oc);
+void objcache_free(struct objcache *oc, void *obj);
+void objcache_printstats(void);
+
+
+#endif /* _OBJCACHE_H_ */
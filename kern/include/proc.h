@@ -43,6 +43,25 @@
 struct addrspace;
 struct vnode;
 
+/*
+ * A user thread made by thread_create, as thread_join sees it: its
+ * id and, once it has exited, its exit status. The record stays in
+ * p_uthreads until the thread is joined or the process goes away.
+ */
+struct uthread {
+	int ut_tid;			/* Thread id */
+	bool ut_exited;			/* Has called thread_exit */
+	bool ut_joining;		/* Someone's in thread_join for it */
+	int ut_status;			/* Status passed to thread_exit */
+};
+
+#ifndef PROCINLINE
+#define PROCINLINE INLINE
+#endif
+
+DECLARRAY(uthread);
+DEFARRAY(uthread, PROCINLINE);
+
 /*
  * Process structure.
  */
@@ -52,8 +71,17 @@ struct proc {
 	struct threadarray p_threads;	/* Threads in this process */
 	pid_t p_pid;			/* Process ID */
 
+	/* User threads (protected by p_lock) */
+	struct uthreadarray p_uthreads;	/* Threads made by thread_create */
+	struct cv *p_threadcv;		/* A thread has exited */
+	int p_nexttid;			/* Next thread id to hand out */
+	bool p_exiting;			/* Other threads should exit now */
+	bool p_exitpending;		/* One of them called exit... */
+	int p_exitstatus;		/* ...with this status */
+
 	/* VM */
 	struct addrspace *p_addrspace;	/* virtual address space */
+	struct semaphore *p_vforkwait;	/* parent sleeps here if we vfork'd */
 
 	/* VFS */
 	struct vnode *p_cwd;		/* current working directory */
@@ -74,6 +102,15 @@ int proc_create_runprogram(const char *name, struct proc **ret);
 /* Create a fresh process for use by fork() */
 int proc_fork(struct proc **ret);
 
+/* Create a process for vfork() that borrows the current address space */
+int proc_vfork(struct semaphore *wait, struct proc **ret);
+
+/* Create a process for spawn(), with no address space */
+int proc_spawn(struct proc **ret);
+
+/* Hand a borrowed address space back to the vfork parent */
+void proc_vforkrelease(struct proc *proc);
+
 /* Undo proc_fork if nothing's run in the new process yet. */
 void proc_unfork(struct proc *proc);
 
@@ -89,6 +126,39 @@ void proc_destroy(struct proc *proc);
  */
 void proc_exit(int status);
 
+/*
+ * User threads.
+ *
+ * proc_newtid allocates a thread id (and a struct uthread) for a new
+ * thread of the current process; proc_freetid gives it back if the
+ * thread couldn't be made after all. proc_threadjoin waits for a
+ * thread to exit and collects its status; it fails with ESRCH if there
+ * is no such thread (or it's already been joined), EINVAL for the
+ * current thread or one someone else is joining, and EINTR if the
+ * process starts exiting meanwhile.
+ *
+ * proc_threadexit makes the current thread exit, or the whole process
+ * (with _MKWAIT_EXIT(STATUS)) if it's the last one.
+ *
+ * proc_singlethread makes the current thread the only one in its
+ * process, by setting p_exiting and waiting for the others to see it
+ * and exit (they check on their way back to user mode). It's for exit
+ * and exec. It returns false if some other thread was already doing
+ * that, in which case the caller should exit.
+ *
+ * Exit takes precedence over exec. An exiting caller passes its exit
+ * status in EXITSTATUS (exec passes NULL); if it loses, the status is
+ * left behind for the winner. After a successful exec singlethread,
+ * proc_exitpending returns true, with the status, if that happened;
+ * the exec should then exit instead.
+ */
+int proc_newtid(int *ret);
+void proc_freetid(int tid);
+int proc_threadjoin(int tid, int *status);
+__DEAD void proc_threadexit(int status);
+bool proc_singlethread(const int *exitstatus);
+bool proc_exitpending(int *status);
+
 /* Attach a thread to a process. Must not already have a process. */
 int proc_addthread(struct proc *proc, struct thread *t);
 
@@ -36,6 +36,8 @@
  */
 
 #include <cdefs.h>
+#include "opt-lockstat.h"
+#include "opt-ticketlock.h"
 
 /* Inlining support - for making sure an out-of-line copy gets built */
 #ifndef SPINLOCK_INLINE
@@ -50,25 +52,61 @@
  *
  * Note that spinlocks are held by CPUs, not by threads.
  *
+ * Normally a spinlock is a test-and-set word, and a CPU that finds it
+ * taken backs off exponentially before trying again. With the
+ * ticketlock option it's a ticket lock instead: splk_lock hands out
+ * tickets and splk_serving says whose turn it is, so CPUs get the
+ * lock in the order they asked and each waiter only reads until its
+ * number comes up, backing off in proportion to its place in line.
+ *
  * This structure is made public so spinlocks do not have to be
  * malloc'd; however, code that uses spinlocks should not look inside
  * the structure directly but always use the spinlock API functions.
  */
 struct spinlock {
 	volatile spinlock_data_t splk_lock; /* Memory word where we spin. */
+#if OPT_TICKETLOCK
+	volatile spinlock_data_t splk_serving; /* Ticket now served. */
+#endif
 	struct cpu *splk_holder;	    /* CPU holding this lock. */
+#if OPT_LOCKSTAT
+	const char *splk_name;		    /* Name for lockstat, or NULL. */
+	struct lockstat *splk_stat;	    /* lockstat entry for the name. */
+	uint64_t splk_stamp;		    /* When acquired, if counting. */
+#endif
 };
 
 /*
- * Initializer for cases where a spinlock needs to be static or global.
+ * Initializers for cases where a spinlock needs to be static or
+ * global. The name is only used for lock statistics.
  */
-#define SPINLOCK_INITIALIZER	{ SPINLOCK_DATA_INITIALIZER, NULL }
+#if OPT_LOCKSTAT
+#define SPINLOCK_NAME_INITIALIZER(name) .splk_name = (name),
+#else
+#define SPINLOCK_NAME_INITIALIZER(name)
+#endif
+#if OPT_TICKETLOCK
+#define SPINLOCK_SERVING_INITIALIZER \
+	.splk_serving = SPINLOCK_DATA_INITIALIZER,
+#else
+#define SPINLOCK_SERVING_INITIALIZER
+#endif
+#define SPINLOCK_INITIALIZER_NAMED(name) {		\
+	.splk_lock = SPINLOCK_DATA_INITIALIZER,		\
+	SPINLOCK_SERVING_INITIALIZER			\
+	.splk_holder = NULL,				\
+	SPINLOCK_NAME_INITIALIZER(name)			\
+}
+#define SPINLOCK_INITIALIZER	SPINLOCK_INITIALIZER_NAMED(NULL)
 
 /*
  * Spinlock functions.
  *
  * init		Initialize the contents of a spinlock.
  * cleanup	Opposite of init. Lock must be unlocked.
+ * setname	Give the lock a name for lock statistics; only named
+ *		spinlocks are counted. The string must last as long as
+ *		the lock does.
  *
  * acquire	Get the lock, spinning as necessary. Also disables interrupts.
  * release	Release the lock. May re-enable interrupts.
@@ -78,6 +116,7 @@ struct spinlock {
 
 void spinlock_init(struct spinlock *lk);
 void spinlock_cleanup(struct spinlock *lk);
+void spinlock_setname(struct spinlock *lk, const char *name);
 
 void spinlock_acquire(struct spinlock *lk);
 void spinlock_release(struct spinlock *lk);
@@ -36,10 +36,17 @@
 
 
 #include <spinlock.h>
+#include "opt-lockstat.h"
 
 /*
  * Dijkstra-style semaphore.
  *
+ * An ordinary semaphore makes no promise about which thread gets it: V
+ * wakes a waiter, but anyone calling P before that waiter runs can
+ * take the count first. One made with sem_create_fifo hands off
+ * instead: while threads are waiting, V passes the count directly to
+ * the one that has waited longest, and later arrivals queue behind.
+ *
  * The name field is for easier debugging. A copy of the name is made
  * internally.
  */
@@ -48,9 +55,15 @@ struct semaphore {
 	struct wchan *sem_wchan;
 	struct spinlock sem_lock;
         volatile unsigned sem_count;
+	bool sem_fifo;			/* hand off in FIFO order */
+	unsigned sem_handoffs;		/* counts passed to woken waiters */
+#if OPT_LOCKSTAT
+	struct lockstat *sem_stat;
+#endif
 };
 
 struct semaphore *sem_create(const char *name, unsigned initial_count);
+struct semaphore *sem_create_fifo(const char *name, unsigned initial_count);
 void sem_destroy(struct semaphore *);
 
 /*
@@ -71,12 +84,21 @@ void V(struct semaphore *);
  *
  * The name field is for easier debugging. A copy of the name is
  * (should be) made internally.
+ *
+ * Locks are adaptive: a thread that finds the lock held by a thread
+ * running on another cpu spins for a while (up to lock_maxspin
+ * iterations) in the expectation that it'll be released soon, and
+ * only goes to sleep if it isn't, or if the holder isn't running.
  */
 struct lock {
         char *lk_name;
 	struct wchan *lk_wchan;
 	struct spinlock lk_lock;
 	struct thread *volatile lk_holder;
+#if OPT_LOCKSTAT
+	struct lockstat *lk_stat;
+	uint64_t lk_stamp;		/* When acquired, if counting */
+#endif
 };
 
 struct lock *lock_create(const char *name);
@@ -97,6 +119,56 @@ void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 void lock_destroy(struct lock *);
 
+extern unsigned lock_maxspin;
+
+
+/*
+ * Reader-writer lock.
+ *
+ * Any number of readers may hold the lock at once, or one writer.
+ * Writers have preference: once a writer is waiting, new readers
+ * wait behind it, so a steady stream of lookups can't starve updates.
+ * A consequence is that read locks are not recursive; a thread that
+ * already holds a read lock and asks for another can deadlock against
+ * a waiting writer.
+ *
+ * The name field is for easier debugging. A copy of the name is made
+ * internally.
+ */
+struct rwlock {
+	char *rwl_name;
+	struct wchan *rwl_readwchan;	/* readers waiting */
+	struct wchan *rwl_writewchan;	/* writers waiting */
+	struct spinlock rwl_lock;
+	unsigned rwl_readers;		/* number of readers holding it */
+	unsigned rwl_writerswaiting;	/* number of writers asleep */
+	struct thread *rwl_writer;	/* writer holding it, if any */
+};
+
+struct rwlock *rwlock_create(const char *name);
+void rwlock_destroy(struct rwlock *);
+
+/*
+ * Operations:
+ *    rwlock_acquire_read     - Get the lock shared.
+ *    rwlock_release_read     - Drop a shared hold.
+ *    rwlock_acquire_write    - Get the lock exclusively.
+ *    rwlock_release_write    - Drop the exclusive hold.
+ *    rwlock_tryacquire_read  - Get the lock shared if that can be done
+ *                              without sleeping; returns true if so.
+ *    rwlock_tryacquire_write - Likewise, exclusively.
+ *    rwlock_do_i_hold_write  - Return true if the current thread holds
+ *                              the lock exclusively. (Readers aren't
+ *                              tracked individually.)
+ */
+void rwlock_acquire_read(struct rwlock *);
+void rwlock_release_read(struct rwlock *);
+void rwlock_acquire_write(struct rwlock *);
+void rwlock_release_write(struct rwlock *);
+bool rwlock_tryacquire_read(struct rwlock *);
+bool rwlock_tryacquire_write(struct rwlock *);
+bool rwlock_do_i_hold_write(struct rwlock *);
+
 
 /*
  * Condition variable.
@@ -116,6 +188,9 @@ struct cv {
         char *cv_name;
 	struct wchan *cv_wchan;
 	struct spinlock cv_wchanlock;
+#if OPT_LOCKSTAT
+	struct lockstat *cv_stat;
+#endif
 };
 
 struct cv *cv_create(const char *name);
@@ -125,16 +200,27 @@ void cv_destroy(struct cv *);
  * Operations:
  *    cv_wait      - Release the supplied lock, go to sleep, and, after
  *                   waking up again, re-acquire the lock.
+ *    cv_timedwait - Like cv_wait, but give up after TICKS hardclocks.
+ *                   Returns ETIMEDOUT if it gave up, 0 if it was
+ *                   signalled first. As usual, callers must recheck
+ *                   their condition.
  *    cv_signal    - Wake up one thread that's sleeping on this CV.
  *    cv_broadcast - Wake up all threads sleeping on this CV.
  *
- * For all three operations, the current thread must hold the lock passed
+ * For all these operations, the current thread must hold the lock passed
  * in. Note that under normal circumstances the same lock should be used
  * on all operations with any particular CV.
  *
+ * cv_signal and cv_broadcast use wait morphing: since the caller holds
+ * the lock, a thread woken from the CV would only get as far as
+ * lock_acquire before sleeping again, so instead it's moved straight
+ * onto the lock's wait channel. Waiters then run one at a time as the
+ * lock is released, rather than all waking at once to fight over it.
+ *
  * These operations must be atomic. You get to write them.
  */
 void cv_wait(struct cv *cv, struct lock *lock);
+int cv_timedwait(struct cv *cv, struct lock *lock, unsigned ticks);
 void cv_signal(struct cv *cv, struct lock *lock);
 void cv_broadcast(struct cv *cv, struct lock *lock);
 
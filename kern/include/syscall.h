@@ -51,9 +51,9 @@ void enter_forked_process(struct trapframe *tf);
 __DEAD void enter_new_process(int argc, userptr_t argv, userptr_t env,
 		       vaddr_t stackptr, vaddr_t entrypoint);
 
-/* Helpers for exec. */
-void execv_bootstrap(void);
-void execv_shutdown(void);  // XXX remove
+/* Enter user mode in a new thread. Does not return. */
+__DEAD void enter_new_thread(userptr_t arg, vaddr_t stackptr,
+			     vaddr_t entrypoint, vaddr_t gp);
 
 
 /*
@@ -65,13 +65,32 @@ void execv_shutdown(void);  // XXX remove
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys_nanosleep(const_userptr_t req, userptr_t rem);
+
+int sys_setaffinity(uint32_t mask);
+int sys_getaffinity(userptr_t mask);
+int sys_schedstat(int which, userptr_t ss);
 
 int sys_fork(struct trapframe *tf, pid_t *retval);
+int sys_vfork(struct trapframe *tf, pid_t *retval);
 int sys_execv(userptr_t prog, userptr_t args);
+int sys_spawn(userptr_t prog, userptr_t args, userptr_t actions, int nactions,
+	      pid_t *retval);
 __DEAD void sys__exit(int code);
 int sys_waitpid(pid_t pid, userptr_t returncode, int flags, pid_t *retval);
 int sys_getpid(pid_t *retval);
 
+int sys___thread_create(userptr_t entry, userptr_t arg, userptr_t stack,
+			vaddr_t gp, int *retval);
+__DEAD void sys_thread_exit(int status);
+int sys_thread_join(int tid, userptr_t status);
+int sys_futex(userptr_t addr, int op, int val, int *retval);
+
+int sys_madvise(userptr_t addr, size_t len, int advice);
+int sys_mincore(userptr_t addr, size_t len, userptr_t vec);
+int sys_mlock(userptr_t addr, size_t len);
+int sys_munlock(userptr_t addr, size_t len);
+
 int sys_open(userptr_t filename, int flags, int mode, int *retval);
 int sys_dup2(int oldfd, int newfd, int *retval);
 int sys_close(int fd);
@@ -42,6 +42,7 @@
 
 /* For testing the wait implementation. */
 int waittest(int, char **);
+int pidtest(int, char **);
 
 /* data structure tests */
 int arraytest(int, char **);
@@ -55,6 +56,10 @@ int threadtest3(int, char **);
 int semtest(int, char **);
 int locktest(int, char **);
 int cvtest(int, char **);
+int rwlocktest(int, char **);
+int fifosemtest(int, char **);
+int morphtest(int, char **);
+int spinlocktest(int, char **);
 
 /* filesystem tests */
 int fstest(int, char **);
@@ -69,6 +74,9 @@ int printfile(int, char **);
 int malloctest(int, char **);
 int mallocstress(int, char **);
 int malloctest3(int, char **);
+int objcachetest(int, char **);
+int callouttest(int, char **);
+int workqueuetest(int, char **);
 int nettest(int, char **);
 
 /* Routine for running a user-level program. */
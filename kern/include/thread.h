@@ -39,6 +39,7 @@
 #include <array.h>
 #include <spinlock.h>
 #include <threadlist.h>
+#include <kern/schedstat.h>
 
 struct cpu;
 
@@ -81,9 +82,20 @@ struct thread {
 	struct threadlistnode t_listnode; /* Link for run/sleep/zombie lists */
 	void *t_stack;			/* Kernel-level stack */
 	struct switchframe *t_context;	/* Saved register context (on stack) */
-	struct cpu *t_cpu;		/* CPU thread runs on */
+	struct cpu *t_cpu;		/* CPU thread runs (or last ran) on */
 	struct proc *t_proc;		/* Process thread belongs to */
 
+	/*
+	 * Scheduler state (see schedule() in thread.c).
+	 */
+	unsigned t_priority;		/* Queue level; 0 is highest */
+	unsigned t_ticks;		/* Hardclocks used at this level */
+	uint32_t t_readysince;		/* clock_ticks when last queued */
+	uint32_t t_lastran;		/* clock_ticks when last switched out */
+	uint32_t t_madeready;		/* clock_ticks when made runnable */
+	uint32_t t_cpumask;		/* CPUs allowed, one bit per c_number */
+	struct schedstat t_schedstat;	/* Switch counts and latencies */
+
 	/*
 	 * Interrupt state fields.
 	 *
@@ -105,6 +117,8 @@ struct thread {
 	 * Public fields
 	 */
 
+	int t_tid;			/* User thread id (0 if none) */
+
 	/* add more here as needed */
 };
 
@@ -157,16 +171,65 @@ __DEAD void thread_exit(void);
  */
 void thread_yield(void);
 
+/*
+ * Charge the current thread for TICKS hardclocks. Returns true if it has
+ * used up its quantum or a higher-priority thread is waiting, in
+ * which case the caller should yield. Called from the timer interrupt.
+ */
+bool thread_tick(unsigned ticks);
+
 /*
  * Reshuffle the run queue. Called from the timer interrupt.
  */
 void schedule(void);
 
+/*
+ * Scheduler tunables, settable from the kernel menu.
+ *
+ * The scheduler is a multi-level feedback queue with MLFQ_LEVELS
+ * levels. A thread at level L gets a quantum of mlfq_quantum << L
+ * hardclocks and drops a level when it uses it up. Waking up from
+ * sleep raises a thread mlfq_wakeboost levels, and a thread that has
+ * sat on the run queue for mlfq_agingticks is raised one level.
+ */
+#define MLFQ_LEVELS 4
+
+extern unsigned mlfq_quantum;
+extern unsigned mlfq_wakeboost;
+extern unsigned mlfq_agingticks;
+
 /*
  * Potentially migrate ready threads to other CPUs. Called from the
  * timer interrupt.
  */
 void thread_consider_migration(void);
 
+/*
+ * CPU affinity. A thread may only be scheduled on the CPUs whose bits
+ * (1 << c_number) are set in its t_cpumask; new threads inherit the
+ * mask of the thread that forked them, and the first threads may run
+ * anywhere (THREAD_ANYCPU).
+ *
+ * thread_setaffinity restricts the current thread to MASK, ignoring
+ * bits for CPUs that don't exist; it fails with EINVAL if that leaves
+ * nothing. If the current CPU is no longer allowed, the thread has
+ * moved off it by the time thread_setaffinity returns.
+ */
+#define THREAD_ANYCPU 0xffffffff
+
+int thread_setaffinity(uint32_t mask);
+
+/*
+ * Scheduler statistics (see <kern/schedstat.h>).
+ *
+ * thread_getschedstat copies out the counters for cpu number WHICH,
+ * or for the current thread if WHICH is SCHEDSTAT_SELF; it fails with
+ * EINVAL if there's no such cpu. schedstat_print prints all cpus',
+ * and schedstat_reset clears them.
+ */
+int thread_getschedstat(int which, struct schedstat *ss);
+void schedstat_print(void);
+void schedstat_reset(void);
+
 
 #endif /* _THREAD_H_ */
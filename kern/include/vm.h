@@ -56,9 +56,21 @@ paddr_t getppages(unsigned long npages);
 vaddr_t alloc_kpages(int npages);
 void free_kpages(vaddr_t addr);
 
+/* Drop any mapping for VADDR from the current CPU's TLB */
+void vm_tlbinvalidate(vaddr_t vaddr);
+
 /* TLB shootdown handling called from interprocessor_interrupt */
 void vm_tlbshootdown_all(void);
 void vm_tlbshootdown(const struct tlbshootdown *);
 
+/* Track which CPUs hold TLB entries for an address space */
+void vm_tlbactivate(struct addrspace *as);
+void vm_tlbdeactivate(struct addrspace *as);
+void vm_tlbforget(struct addrspace *as);
+
+/* Invalidate up to TLBSHOOTDOWN_MAX pages of AS on every CPU using it */
+void vm_tlbshootdown_batch(struct addrspace *as, const vaddr_t *vaddrs,
+			   unsigned num);
+
 
 #endif /* _VM_H_ */
@@ -36,6 +36,7 @@
 
 
 struct spinlock; /* in spinlock.h */
+struct thread; /* in thread.h */
 struct wchan; /* Opaque */
 
 /*
@@ -72,9 +73,28 @@ void wchan_sleep(struct wchan *wc, struct spinlock *lk);
  *
  * The current implementation is FIFO but this is not promised by the
  * interface.
+ *
+ * wchan_wakeone returns true if there was a thread to wake.
  */
-void wchan_wakeone(struct wchan *wc, struct spinlock *lk);
+bool wchan_wakeone(struct wchan *wc, struct spinlock *lk);
 void wchan_wakeall(struct wchan *wc, struct spinlock *lk);
 
+/*
+ * Wake thread T if it is sleeping on the wait channel, and return
+ * whether it was. The associated spinlock should be locked.
+ */
+bool wchan_wakethread(struct wchan *wc, struct thread *t,
+		      struct spinlock *lk);
+
+/*
+ * Move one thread, or all threads, sleeping on wait channel FROM to
+ * the end of wait channel TO without waking them; they sleep on until
+ * woken from TO. Both associated spinlocks should be locked.
+ */
+void wchan_moveone(struct wchan *from, struct spinlock *fromlk,
+		   struct wchan *to, struct spinlock *tolk);
+void wchan_moveall(struct wchan *from, struct spinlock *fromlk,
+		   struct wchan *to, struct spinlock *tolk);
+
 
 #endif /* _WCHAN_H_ */
@@ -0,0 +1,89 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _WORKQUEUE_H_
+#define _WORKQUEUE_H_
+
+/*
+ * Work queues: functions to be called later, in a thread.
+ *
+ * Each cpu has a queue of work served by its own kernel worker
+ * thread, so unlike a callout, work may sleep. Use it to get slow
+ * cleanup out of the way of whoever is waiting for the caller.
+ *
+ *    work_init     - set up a work item to call FUNC(ARG).
+ *    work_queue    - queue it on the current cpu. Returns false (and
+ *                    does nothing) if it was already queued. Can be
+ *                    called from interrupt handlers.
+ *    work_schedule - queue it TICKS hardclocks from now, via a
+ *                    callout. If it was already waiting to be queued,
+ *                    the wait is restarted.
+ *    work_cancel   - take it off its queue (or stop the callout).
+ *                    Returns true if it was waiting and now won't
+ *                    run. If it's running, waits for it to finish
+ *                    first, unless called from FUNC itself.
+ *
+ * FUNC may free the work item; the worker doesn't look at it again
+ * once FUNC has been called.
+ *
+ * As with callouts, the caller is responsible for not queueing and
+ * cancelling the same work at the same time from different threads.
+ */
+
+#include <callout.h>
+
+struct workqueue;	/* Private to workqueue.c */
+
+struct work {
+	struct work *w_next;		/* Link on queue */
+	struct workqueue *w_queue;	/* Queue last put on */
+	bool w_pending;			/* On w_queue */
+	struct callout w_callout;	/* For work_schedule */
+	void (*w_func)(void *);
+	void *w_arg;
+};
+
+void work_init(struct work *w, void (*func)(void *), void *arg);
+bool work_queue(struct work *w);
+void work_schedule(struct work *w, unsigned ticks);
+bool work_cancel(struct work *w);
+
+/*
+ * Interface for the thread code.
+ *
+ *    workqueue_create - make a queue for a new cpu.
+ *    workqueue_start  - start the worker thread for cpu number CPUNUM's
+ *                       queue, once all the cpus are up. Work queued
+ *                       before this just waits.
+ */
+struct workqueue *workqueue_create(void);
+void workqueue_start(struct workqueue *wq, unsigned cpunum);
+
+
+#endif /* _WORKQUEUE_H_ */
@@ -47,6 +47,7 @@
 #include <vfs.h>
 #include <device.h>
 #include <pid.h>
+#include <futex.h>
 #include <syscall.h>
 #include <test.h>
 #include <version.h>
@@ -109,9 +110,11 @@ boot(void)
 
 	/* Early initialization. */
 	ram_bootstrap();
+	kheap_bootstrap();
 	proc_bootstrap();
 	thread_bootstrap();
 	pid_bootstrap();
+	futex_bootstrap();
 	hardclock_bootstrap();
 	vfs_bootstrap();
 	kheap_nextgeneration();
@@ -129,7 +132,6 @@ boot(void)
 	/* Late phase of initialization. */
 	vm_bootstrap();
 	kprintf_bootstrap();
-	execv_bootstrap();
 	thread_start_cpus();
 
 	/* Default bootfs - but ignore failure, in case emu0 doesn't exist */
@@ -41,10 +41,13 @@
 #include <vfs.h>
 #include <sfs.h>
 #include <pid.h>
+#include <objcache.h>
+#include <lockstat.h>
 #include <syscall.h>
 #include <test.h>
 #include "opt-sfs.h"
 #include "opt-net.h"
+#include "opt-lockstat.h"
 
 /*
  * In-kernel menu and command dispatcher.
@@ -243,6 +246,50 @@ cmd_sync(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * Command for showing or setting the scheduler tunables.
+ */
+static
+int
+cmd_mlfq(int nargs, char **args)
+{
+	static const struct {
+		const char *name;
+		unsigned *val;
+		int min;
+	} tunables[] = {
+		{ "quantum",   &mlfq_quantum,    1 },
+		{ "wakeboost", &mlfq_wakeboost,  0 },
+		{ "aging",     &mlfq_agingticks, 1 },
+	};
+	const unsigned ntunables = sizeof(tunables) / sizeof(tunables[0]);
+	unsigned i;
+	int val;
+
+	if (nargs == 1) {
+		kprintf("%u levels\n", MLFQ_LEVELS);
+		for (i=0; i<ntunables; i++) {
+			kprintf("%-10s %u\n", tunables[i].name,
+				*tunables[i].val);
+		}
+		return 0;
+	}
+	if (nargs == 3) {
+		for (i=0; i<ntunables; i++) {
+			if (!strcmp(args[1], tunables[i].name)) {
+				val = atoi(args[2]);
+				if (val < tunables[i].min) {
+					break;
+				}
+				*tunables[i].val = val;
+				return 0;
+			}
+		}
+	}
+	kprintf("Usage: mlfq [quantum|wakeboost|aging value]\n");
+	return EINVAL;
+}
+
 /*
  * Command for doing an intentional panic.
  */
@@ -380,6 +427,18 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_objcachestats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	objcache_printstats();
+
+	return 0;
+}
+
 static
 int
 cmd_kheapgeneration(int nargs, char **args)
@@ -409,6 +468,60 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_kheapprofile(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	kheap_profile();
+
+	return 0;
+}
+
+static
+int
+cmd_schedstat(int nargs, char **args)
+{
+	if (nargs == 1) {
+		schedstat_print();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		schedstat_reset();
+	}
+	else {
+		kprintf("Usage: schedstat [reset]\n");
+	}
+
+	return 0;
+}
+
+#if OPT_LOCKSTAT
+static
+int
+cmd_lockstat(int nargs, char **args)
+{
+	if (nargs == 1) {
+		lockstat_print();
+	}
+	else if (nargs == 2 && !strcmp(args[1], "on")) {
+		lockstat_enable(true);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "off")) {
+		lockstat_enable(false);
+	}
+	else if (nargs == 2 && !strcmp(args[1], "reset")) {
+		lockstat_reset();
+	}
+	else {
+		kprintf("Usage: lockstat [on|off|reset]\n");
+	}
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -448,6 +561,7 @@ static const char *opsmenu[] = {
 	"[cd]      Change directory          ",
 	"[pwd]     Print current directory   ",
 	"[sync]    Sync filesystems          ",
+	"[mlfq]    Scheduler tunables        ",
 	"[panic]   Intentional panic         ",
 	"[q]       Quit and shut down        ",
 	NULL
@@ -471,6 +585,9 @@ static const char *testmenu[] = {
 	"[km1] Kernel malloc test            ",
 	"[km2] kmalloc stress test           ",
 	"[km3] Large kmalloc test            ",
+	"[oc1] Object cache test             ",
+	"[co1] Callout test                  ",
+	"[wq1] Work queue test               ",
 	"[tt1] Thread test 1                 ",
 	"[tt2] Thread test 2                 ",
 	"[tt3] Thread test 3                 ",
@@ -480,7 +597,12 @@ static const char *testmenu[] = {
 	"[sy1] Semaphore test                ",
 	"[sy2] Lock test                     ",
 	"[sy3] CV test                       ",
+	"[sy4] Rwlock test                   ",
+	"[sy5] FIFO semaphore test           ",
+	"[sy6] CV wait morphing test         ",
+	"[sy7] Spinlock test                 ",
 	"[wt]  waitpid test                  ",	
+	"[pid] Pid allocator test            ",
 	"[fs1] Filesystem test               ",
 	"[fs2] FS read stress                ",
 	"[fs3] FS write stress               ",
@@ -509,6 +631,12 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+	"[khprof] Kernel heap profile        ",
+	"[oc] Object cache stats             ",
+	"[schedstat] Scheduler stats         ",
+#if OPT_LOCKSTAT
+	"[lockstat] Lock contention stats    ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -549,6 +677,7 @@ static struct {
 	{ "cd",		cmd_chdir },
 	{ "pwd",	cmd_pwd },
 	{ "sync",	cmd_sync },
+	{ "mlfq",	cmd_mlfq },
 	{ "panic",	cmd_panic },
 	{ "q",		cmd_quit },
 	{ "exit",	cmd_quit },
@@ -558,6 +687,12 @@ static struct {
 	{ "kh",         cmd_kheapstats },
 	{ "khgen",      cmd_kheapgeneration },
 	{ "khdump",     cmd_kheapdump },
+	{ "khprof",     cmd_kheapprofile },
+	{ "oc",         cmd_objcachestats },
+	{ "schedstat",  cmd_schedstat },
+#if OPT_LOCKSTAT
+	{ "lockstat",   cmd_lockstat },
+#endif
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -566,6 +701,9 @@ static struct {
 	{ "km1",	malloctest },
 	{ "km2",	mallocstress },
 	{ "km3",	malloctest3 },
+	{ "oc1",	objcachetest },
+	{ "co1",	callouttest },
+	{ "wq1",	workqueuetest },
 #if OPT_NET
 	{ "net",	nettest },
 #endif
@@ -577,10 +715,15 @@ static struct {
 	/* synchronization assignment tests */
 	{ "sy2",	locktest },
 	{ "sy3",	cvtest },
+	{ "sy4",	rwlocktest },
+	{ "sy5",	fifosemtest },
+	{ "sy6",	morphtest },
+	{ "sy7",	spinlocktest },
 
 	/* system call assignment tests */
 	/* For testing the wait implementation. */
 	{ "wt",		waittest },
+	{ "pid",	pidtest },
 
 	/* file system assignment tests */
 	{ "fs1",	fstest },
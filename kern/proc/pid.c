@@ -38,45 +38,126 @@
 #include <lib.h>
 #include <array.h>
 #include <clock.h>
+#include <membar.h>
+#include <spinlock.h>
 #include <thread.h>
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
 #include <pid.h>
+#include <objcache.h>
 
 /*
  * Structure for holding exit data of a thread.
  *
  * If pi_ppid is INVALID_PID, the parent has gone away and will not be
- * waiting. If pi_ppid is INVALID_PID and pi_exited is true, the
- * structure can be freed.
+ * waiting.
+ *
+ * A pidinfo is reference counted. The process itself holds one
+ * reference until it exits, the parent holds another until it reaps
+ * or disowns the child, and every lookup holds one until pi_put.
+ * When the count reaches zero the pid is removed from the table and
+ * released. pi_refs is covered by the table stripe lock for the pid
+ * (see below); everything else by pi_lock, except pi_sibling, which
+ * belongs to the parent's child list and goes with the parent's
+ * pi_lock.
  */
 struct pidinfo {
 	pid_t pi_pid;			// process id of this thread
 	pid_t pi_ppid;			// process id of parent thread
-	volatile bool pi_exited;	// true if thread has exited
+	bool pi_exited;			// true if thread has exited
 	int pi_exitstatus;		// status (only valid if exited)
+	unsigned pi_refs;		// reference count
+	struct lock *pi_lock;		// lock for the fields below
 	struct cv *pi_cv;		// use to wait for thread exit
+	struct pidinfo *pi_children;	// list of our children
+	struct pidinfo *pi_sibling;	// next in our parent's list
 };
 
 
 /*
  * Global pid and exit data.
  *
- * The process table is an el-cheapo hash table. It's indexed by
- * (pid % PROCS_MAX), and only allows one process per slot. If a
- * new pid allocation would cause a hash collision, we just don't
- * use that pid.
+ * Free pids are tracked in a bitmap, one bit per pid, with pids that
+ * can't be handed out (below PID_MIN or above PID_MAX) permanently
+ * marked. Allocation scans it a word at a time starting from nextpid,
+ * so pids are reused as late as possible. pidmaplock covers the
+ * bitmap, nextpid and nprocs and is only held for the scan.
+ *
+ * The process table is a two-level radix table indexed directly by
+ * pid, so every pid in range is usable. The second-level chunks are
+ * allocated on first use (under pidchunklock) and never freed, which
+ * means readers can follow the top-level pointer without locking it.
+ * The slots are covered by an array of spinlocks striped by pid, so
+ * lookups of different pids (and consecutively allocated pids) don't
+ * contend. A lookup takes a reference under the stripe lock; after
+ * that the pidinfo stays put until pi_put even if it's dropped from
+ * the table meanwhile.
+ *
+ * No code path holds two pi_locks at once, and the spinlocks are
+ * leaves, so there is no lock ordering to speak of.
  */
-static struct lock *pidlock;		// lock for global exit data
-static struct pidinfo *pidinfo[PROCS_MAX]; // actual pid info
+#define PIDCHUNK_SHIFT	8
+#define PIDCHUNK_SIZE	(1 << PIDCHUNK_SHIFT)
+#define PIDCHUNK_MASK	(PIDCHUNK_SIZE - 1)
+#define NPIDCHUNKS	((PID_MAX + PIDCHUNK_SIZE) / PIDCHUNK_SIZE)
+
+#define PIDMAP_BITS	32
+#define PIDMAP_WORDS	((PID_MAX + PIDMAP_BITS) / PIDMAP_BITS)
+#define PIDMAP_FULL	0xffffffff
+
+#define PIDSTRIPES	32
+
+static struct spinlock pidmaplock;	// lock for the pid bitmap
+static uint32_t pidmap[PIDMAP_WORDS];	// allocated pids
 static pid_t nextpid;			// next candidate pid
 static int nprocs;			// number of allocated pids
 
+static struct lock *pidchunklock;	// lock for adding chunks
+static struct pidinfo **pidchunks[NPIDCHUNKS]; // actual pid info
+static struct spinlock pidstripes[PIDSTRIPES]; // locks for the slots
+
+#define PIDSTRIPE(pid) (&pidstripes[(pid) % PIDSTRIPES])
+
+
+/*
+ * pidinfos are cached with their lock and cv already created.
+ */
+static
+int
+pidinfo_ctor(void *obj)
+{
+	struct pidinfo *pi = obj;
+
+	pi->pi_lock = lock_create("pidinfo lock");
+	if (pi->pi_lock == NULL) {
+		return ENOMEM;
+	}
+	pi->pi_cv = cv_create("pidinfo cv");
+	if (pi->pi_cv == NULL) {
+		lock_destroy(pi->pi_lock);
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static
+void
+pidinfo_dtor(void *obj)
+{
+	struct pidinfo *pi = obj;
+
+	cv_destroy(pi->pi_cv);
+	lock_destroy(pi->pi_lock);
+}
 
+static struct objcache pidinfo_cache =
+	OBJCACHE_INITIALIZER("pidinfo", sizeof(struct pidinfo),
+			     pidinfo_ctor, pidinfo_dtor);
 
 /*
- * Create a pidinfo structure for the specified pid.
+ * Create a pidinfo structure for the specified pid. It starts with a
+ * reference for the process and, if there is one, for the parent.
  */
 static
 struct pidinfo *
@@ -86,21 +167,18 @@ pidinfo_create(pid_t pid, pid_t ppid)
 
 	KASSERT(pid != INVALID_PID);
 
-	pi = kmalloc(sizeof(struct pidinfo));
+	pi = objcache_alloc(&pidinfo_cache);
 	if (pi==NULL) {
 		return NULL;
 	}
 
-	pi->pi_cv = cv_create("pidinfo cv");
-	if (pi->pi_cv == NULL) {
-		kfree(pi);
-		return NULL;
-	}
-
 	pi->pi_pid = pid;
 	pi->pi_ppid = ppid;
 	pi->pi_exited = false;
 	pi->pi_exitstatus = 0xbeef;  /* Recognizably invalid value */
+	pi->pi_refs = (ppid == INVALID_PID) ? 1 : 2;
+	pi->pi_children = NULL;
+	pi->pi_sibling = NULL;
 
 	return pi;
 }
@@ -114,8 +192,104 @@ pidinfo_destroy(struct pidinfo *pi)
 {
 	KASSERT(pi->pi_exited == true);
 	KASSERT(pi->pi_ppid == INVALID_PID);
-	cv_destroy(pi->pi_cv);
-	kfree(pi);
+	KASSERT(pi->pi_refs == 0);
+	KASSERT(pi->pi_children == NULL);
+	objcache_free(&pidinfo_cache, pi);
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * pidmap_alloc: find a free pid at or after nextpid, wrapping around,
+ * and mark it. The caller has already checked nprocs, so one exists.
+ */
+static
+pid_t
+pidmap_alloc(void)
+{
+	unsigned word, bit, i;
+	pid_t pid;
+
+	KASSERT(spinlock_do_i_hold(&pidmaplock));
+
+	word = nextpid / PIDMAP_BITS;
+	bit = nextpid % PIDMAP_BITS;
+
+	/* one extra pass picks up the low bits of the first word */
+	for (i=0; i<=PIDMAP_WORDS; i++) {
+		if (pidmap[word] != PIDMAP_FULL) {
+			for (; bit < PIDMAP_BITS; bit++) {
+				if ((pidmap[word] & (1U << bit)) == 0) {
+					pidmap[word] |= 1U << bit;
+					pid = word * PIDMAP_BITS + bit;
+					KASSERT(pid >= PID_MIN);
+					KASSERT(pid <= PID_MAX);
+					nextpid = pid + 1;
+					if (nextpid > PID_MAX) {
+						nextpid = PID_MIN;
+					}
+					return pid;
+				}
+			}
+		}
+		bit = 0;
+		word = (word + 1) % PIDMAP_WORDS;
+	}
+	panic("pidmap_alloc: no free pid with nprocs=%d\n", nprocs);
+}
+
+/*
+ * pidmap_free: release a pid.
+ */
+static
+void
+pidmap_free(pid_t pid)
+{
+	unsigned word, bit;
+
+	KASSERT(pid >= PID_MIN && pid <= PID_MAX);
+
+	word = pid / PIDMAP_BITS;
+	bit = pid % PIDMAP_BITS;
+
+	spinlock_acquire(&pidmaplock);
+	KASSERT((pidmap[word] & (1U << bit)) != 0);
+	pidmap[word] &= ~(1U << bit);
+	nprocs--;
+	spinlock_release(&pidmaplock);
+}
+
+/*
+ * pidchunk_get: get the table chunk for a pid, allocating it if it
+ * isn't there yet. Chunks are zeroed before they're published, and
+ * never go away afterwards.
+ */
+static
+struct pidinfo **
+pidchunk_get(pid_t pid)
+{
+	struct pidinfo **chunk;
+	unsigned i;
+
+	chunk = pidchunks[pid >> PIDCHUNK_SHIFT];
+	if (chunk != NULL) {
+		return chunk;
+	}
+
+	lock_acquire(pidchunklock);
+	chunk = pidchunks[pid >> PIDCHUNK_SHIFT];
+	if (chunk == NULL) {
+		chunk = kmalloc(PIDCHUNK_SIZE * sizeof(chunk[0]));
+		if (chunk != NULL) {
+			for (i=0; i<PIDCHUNK_SIZE; i++) {
+				chunk[i] = NULL;
+			}
+			membar_store_store();
+			pidchunks[pid >> PIDCHUNK_SHIFT] = chunk;
+		}
+	}
+	lock_release(pidchunklock);
+	return chunk;
 }
 
 ////////////////////////////////////////////////////////////
@@ -126,20 +300,34 @@ pidinfo_destroy(struct pidinfo *pi)
 void
 pid_bootstrap(void)
 {
+	struct pidinfo **chunk;
+	pid_t pid;
 	int i;
 
-	pidlock = lock_create("pidlock");
-	if (pidlock == NULL) {
-		panic("Out of memory creating pid lock\n");
+	spinlock_init(&pidmaplock);
+	for (i=0; i<PIDSTRIPES; i++) {
+		spinlock_init(&pidstripes[i]);
+	}
+	pidchunklock = lock_create("pidchunklock");
+	if (pidchunklock == NULL) {
+		panic("Out of memory creating pid chunk lock\n");
 	}
 
-	/* not really necessary - should start zeroed */
-	for (i=0; i<PROCS_MAX; i++) {
-		pidinfo[i] = NULL;
+	/* Mark the pids that can't be allocated, including KERNEL_PID */
+	for (pid=0; pid<PID_MIN; pid++) {
+		pidmap[pid / PIDMAP_BITS] |= 1U << (pid % PIDMAP_BITS);
+	}
+	for (pid=PID_MAX+1; pid<PIDMAP_WORDS*PIDMAP_BITS; pid++) {
+		pidmap[pid / PIDMAP_BITS] |= 1U << (pid % PIDMAP_BITS);
 	}
 
-	pidinfo[KERNEL_PID] = pidinfo_create(KERNEL_PID, INVALID_PID);
-	if (pidinfo[KERNEL_PID]==NULL) {
+	chunk = pidchunk_get(KERNEL_PID);
+	if (chunk == NULL) {
+		panic("Out of memory creating pid table\n");
+	}
+	chunk[KERNEL_PID & PIDCHUNK_MASK] =
+		pidinfo_create(KERNEL_PID, INVALID_PID);
+	if (chunk[KERNEL_PID & PIDCHUNK_MASK]==NULL) {
 		panic("Out of memory creating kernel pid data\n");
 	}
 
@@ -148,132 +336,157 @@ pid_bootstrap(void)
 }
 
 /*
- * pi_get: look up a pidinfo in the process table.
+ * pi_get: look up a pidinfo in the process table and take a reference
+ * to it. Returns NULL if there is no such pid.
  */
 static
 struct pidinfo *
 pi_get(pid_t pid)
 {
+	struct pidinfo **chunk;
 	struct pidinfo *pi;
 
-	KASSERT(pid>=0);
 	KASSERT(pid != INVALID_PID);
-	KASSERT(lock_do_i_hold(pidlock));
 
-	pi = pidinfo[pid % PROCS_MAX];
-	if (pi==NULL) {
+	if (pid < 0 || pid > PID_MAX) {
 		return NULL;
 	}
-	if (pi->pi_pid != pid) {
+
+	chunk = pidchunks[pid >> PIDCHUNK_SHIFT];
+	if (chunk == NULL) {
 		return NULL;
 	}
+	membar_load_load();
+
+	spinlock_acquire(PIDSTRIPE(pid));
+	pi = chunk[pid & PIDCHUNK_MASK];
+	if (pi != NULL) {
+		KASSERT(pi->pi_pid == pid);
+		KASSERT(pi->pi_refs > 0);
+		pi->pi_refs++;
+	}
+	spinlock_release(PIDSTRIPE(pid));
+
 	return pi;
 }
 
 /*
- * pi_put: insert a new pidinfo in the process table. The right slot
- * must be empty.
+ * pi_install: insert a new pidinfo in the process table. The chunk
+ * must exist and the slot must be empty.
  */
 static
 void
-pi_put(pid_t pid, struct pidinfo *pi)
+pi_install(struct pidinfo **chunk, struct pidinfo *pi)
 {
-	KASSERT(lock_do_i_hold(pidlock));
-
-	KASSERT(pid != INVALID_PID);
+	pid_t pid = pi->pi_pid;
 
-	KASSERT(pidinfo[pid % PROCS_MAX] == NULL);
-	pidinfo[pid % PROCS_MAX] = pi;
-	nprocs++;
+	spinlock_acquire(PIDSTRIPE(pid));
+	KASSERT(chunk[pid & PIDCHUNK_MASK] == NULL);
+	chunk[pid & PIDCHUNK_MASK] = pi;
+	spinlock_release(PIDSTRIPE(pid));
 }
 
 /*
- * pi_drop: remove a pidinfo structure from the process table and free
- * it. It should reflect a process that has already exited and been
- * waited for.
+ * pi_put: drop a reference to a pidinfo. When the last one goes, the
+ * pidinfo is removed from the process table, freed, and its pid
+ * becomes available again. It should reflect a process that has
+ * already exited and been waited for (or disowned).
  */
 static
 void
-pi_drop(pid_t pid)
+pi_put(struct pidinfo *pi)
 {
-	struct pidinfo *pi;
-
-	KASSERT(lock_do_i_hold(pidlock));
-
-	pi = pidinfo[pid % PROCS_MAX];
-	KASSERT(pi != NULL);
-	KASSERT(pi->pi_pid == pid);
+	struct pidinfo **chunk;
+	pid_t pid = pi->pi_pid;
+	bool last;
+
+	chunk = pidchunks[pid >> PIDCHUNK_SHIFT];
+	KASSERT(chunk != NULL);
+
+	spinlock_acquire(PIDSTRIPE(pid));
+	KASSERT(chunk[pid & PIDCHUNK_MASK] == pi);
+	KASSERT(pi->pi_refs > 0);
+	pi->pi_refs--;
+	last = (pi->pi_refs == 0);
+	if (last) {
+		chunk[pid & PIDCHUNK_MASK] = NULL;
+	}
+	spinlock_release(PIDSTRIPE(pid));
 
-	pidinfo_destroy(pi);
-	pidinfo[pid % PROCS_MAX] = NULL;
-	nprocs--;
+	if (last) {
+		pidinfo_destroy(pi);
+		pidmap_free(pid);
+	}
 }
 
-////////////////////////////////////////////////////////////
-
 /*
- * Helper function for pid_alloc.
+ * pi_unlink: remove a child from the current process's child list.
  */
 static
 void
-inc_nextpid(void)
+pi_unlink(struct pidinfo *child)
 {
-	KASSERT(lock_do_i_hold(pidlock));
+	struct pidinfo *us, **pp;
 
-	nextpid++;
-	if (nextpid > PID_MAX) {
-		nextpid = PID_MIN;
+	us = pi_get(curproc->p_pid);
+	KASSERT(us != NULL);
+
+	lock_acquire(us->pi_lock);
+	for (pp = &us->pi_children; *pp != child; pp = &(*pp)->pi_sibling) {
+		KASSERT(*pp != NULL);
 	}
+	*pp = child->pi_sibling;
+	child->pi_sibling = NULL;
+	lock_release(us->pi_lock);
+
+	pi_put(us);
 }
 
+////////////////////////////////////////////////////////////
+
 /*
  * pid_alloc: allocate a process id.
  */
 int
 pid_alloc(pid_t *retval)
 {
-	struct pidinfo *pi;
+	struct pidinfo **chunk;
+	struct pidinfo *pi, *us;
 	pid_t pid;
-	int count;
 
 	KASSERT(curproc->p_pid != INVALID_PID);
 
-	/* lock the table */
-	lock_acquire(pidlock);
-
+	spinlock_acquire(&pidmaplock);
 	if (nprocs == PROCS_MAX) {
-		lock_release(pidlock);
+		spinlock_release(&pidmaplock);
 		return EAGAIN;
 	}
+	pid = pidmap_alloc();
+	nprocs++;
+	spinlock_release(&pidmaplock);
 
-	/*
-	 * The above test guarantees that this loop terminates, unless
-	 * our nprocs count is off. Even so, assert we aren't looping
-	 * forever.
-	 */
-	count = 0;
-	while (pidinfo[nextpid % PROCS_MAX] != NULL) {
-
-		/* avoid various boundary cases by allowing extra loops */
-		KASSERT(count < PROCS_MAX*2+5);
-		count++;
-
-		inc_nextpid();
+	chunk = pidchunk_get(pid);
+	if (chunk == NULL) {
+		pidmap_free(pid);
+		return ENOMEM;
 	}
 
-	pid = nextpid;
-
 	pi = pidinfo_create(pid, curproc->p_pid);
 	if (pi==NULL) {
-		lock_release(pidlock);
+		pidmap_free(pid);
 		return ENOMEM;
 	}
 
-	pi_put(pid, pi);
+	pi_install(chunk, pi);
 
-	inc_nextpid();
-
-	lock_release(pidlock);
+	/* Put it on our child list */
+	us = pi_get(curproc->p_pid);
+	KASSERT(us != NULL);
+	lock_acquire(us->pi_lock);
+	pi->pi_sibling = us->pi_children;
+	us->pi_children = pi;
+	lock_release(us->pi_lock);
+	pi_put(us);
 
 	*retval = pid;
 	return 0;
@@ -290,10 +503,10 @@ pid_unalloc(pid_t theirpid)
 
 	KASSERT(theirpid >= PID_MIN && theirpid <= PID_MAX);
 
-	lock_acquire(pidlock);
-
 	them = pi_get(theirpid);
 	KASSERT(them != NULL);
+
+	lock_acquire(them->pi_lock);
 	KASSERT(them->pi_exited == false);
 	KASSERT(them->pi_ppid == curproc->p_pid);
 
@@ -301,10 +514,14 @@ pid_unalloc(pid_t theirpid)
 	them->pi_exitstatus = 0xdead;
 	them->pi_exited = true;
 	them->pi_ppid = INVALID_PID;
+	lock_release(them->pi_lock);
 
-	pi_drop(theirpid);
+	pi_unlink(them);
 
-	lock_release(pidlock);
+	/* our lookup, our interest as parent, and the child's own */
+	pi_put(them);
+	pi_put(them);
+	pi_put(them);
 }
 
 /*
@@ -318,18 +535,19 @@ pid_disown(pid_t theirpid)
 
 	KASSERT(theirpid >= PID_MIN && theirpid <= PID_MAX);
 
-	lock_acquire(pidlock);
-
 	them = pi_get(theirpid);
 	KASSERT(them != NULL);
-	KASSERT(them->pi_ppid==curproc->p_pid);
 
+	lock_acquire(them->pi_lock);
+	KASSERT(them->pi_ppid==curproc->p_pid);
 	them->pi_ppid = INVALID_PID;
-	if (them->pi_exited) {
-		pi_drop(them->pi_pid);
-	}
+	lock_release(them->pi_lock);
 
-	lock_release(pidlock);
+	pi_unlink(them);
+
+	/* our lookup, and our interest as parent */
+	pi_put(them);
+	pi_put(them);
 }
 
 /*
@@ -343,42 +561,43 @@ pid_disown(pid_t theirpid)
 void
 pid_setexitstatus(int status)
 {
-	struct pidinfo *us;
-	int i;
+	struct pidinfo *us, *kid, *next;
 
-	lock_acquire(pidlock);
 	KASSERT(curproc->p_pid != INVALID_PID);
 
+	us = pi_get(curproc->p_pid);
+	KASSERT(us != NULL);
+
 	/* First, disown all children */
-	for (i=0; i<PROCS_MAX; i++) {
-		if (pidinfo[i]==NULL) {
-			continue;
-		}
-		if (pidinfo[i]->pi_ppid == curproc->p_pid) {
-			pidinfo[i]->pi_ppid = INVALID_PID;
-			if (pidinfo[i]->pi_exited) {
-				pi_drop(pidinfo[i]->pi_pid);
-			}
-		}
+	lock_acquire(us->pi_lock);
+	kid = us->pi_children;
+	us->pi_children = NULL;
+	lock_release(us->pi_lock);
+
+	for (; kid != NULL; kid = next) {
+		next = kid->pi_sibling;
+		kid->pi_sibling = NULL;
+
+		lock_acquire(kid->pi_lock);
+		KASSERT(kid->pi_ppid == curproc->p_pid);
+		kid->pi_ppid = INVALID_PID;
+		lock_release(kid->pi_lock);
+
+		pi_put(kid);
 	}
 
 	/* Now, wake up our parent */
-	us = pi_get(curproc->p_pid);
-	KASSERT(us != NULL);
-
+	lock_acquire(us->pi_lock);
 	us->pi_exitstatus = status;
 	us->pi_exited = true;
-
-	if (us->pi_ppid == INVALID_PID) {
-		/* no parent */
-		pi_drop(curproc->p_pid);
-	}
-	else {
-		cv_broadcast(us->pi_cv, pidlock);
-	}
+	cv_broadcast(us->pi_cv, us->pi_lock);
+	lock_release(us->pi_lock);
 
 	curproc->p_pid = INVALID_PID;
-	lock_release(pidlock);
+
+	/* our lookup, and our own reference */
+	pi_put(us);
+	pi_put(us);
 }
 
 /*
@@ -415,32 +634,41 @@ pid_wait(pid_t theirpid, int *status, int flags, pid_t *ret)
 		return EINVAL;
 	}
 
-	lock_acquire(pidlock);
-
 	them = pi_get(theirpid);
 	if (them==NULL) {
-		lock_release(pidlock);
 		return ESRCH;
 	}
 
-	KASSERT(them->pi_pid==theirpid);
+	lock_acquire(them->pi_lock);
 
 	/* Only allow waiting for own children. */
 	if (them->pi_ppid != curproc->p_pid) {
-		lock_release(pidlock);
+		lock_release(them->pi_lock);
+		pi_put(them);
 		return EPERM;
 	}
 
 	if (them->pi_exited == false) {
 		if (flags == WNOHANG) {
-			lock_release(pidlock);
+			lock_release(them->pi_lock);
+			pi_put(them);
 			KASSERT(ret != NULL);
 			*ret = 0;
 			return 0;
 		}
-		/* don't need to loop on this */
-		cv_wait(them->pi_cv, pidlock);
-		KASSERT(them->pi_exited == true);
+		while (them->pi_exited == false) {
+			cv_wait(them->pi_cv, them->pi_lock);
+		}
+	}
+
+	/*
+	 * Another of our threads may have been waiting too and gotten
+	 * there first, in which case the child is already gone.
+	 */
+	if (them->pi_ppid != curproc->p_pid) {
+		lock_release(them->pi_lock);
+		pi_put(them);
+		return ESRCH;
 	}
 
 	if (status != NULL) {
@@ -457,9 +685,13 @@ pid_wait(pid_t theirpid, int *status, int flags, pid_t *ret)
 		*ret = theirpid;
 	}
 
-	them->pi_ppid = 0;
-	pi_drop(them->pi_pid);
+	them->pi_ppid = INVALID_PID;
+	lock_release(them->pi_lock);
+
+	pi_unlink(them);
 
-	lock_release(pidlock);
+	/* our lookup, and our interest as parent */
+	pi_put(them);
+	pi_put(them);
 	return 0;
 }
@@ -38,12 +38,16 @@
  * things they point to. Rearrange this (and/or change it to be a
  * regular lock) as needed.
  *
- * Unless you're implementing multithreaded user processes, the only
- * process that will have more than one thread is the kernel process.
+ * User processes get more threads with thread_create (see
+ * thread_syscalls.c). The bookkeeping for those, and for tearing a
+ * multithreaded process down again, is at the bottom of this file.
  */
 
+#define PROCINLINE
+
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/wait.h>
 #include <spl.h>
 #include <proc.h>
 #include <current.h>
@@ -51,6 +55,7 @@
 #include <vnode.h>
 #include <pid.h>
 #include <file.h>
+#include <futex.h>
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
@@ -86,8 +91,25 @@ proc_create(const char *name)
 
 	proc->p_pid = INVALID_PID;
 
+	/* User threads */
+	uthreadarray_init(&proc->p_uthreads);
+	proc->p_threadcv = cv_create("p_threadcv");
+	if (proc->p_threadcv == NULL) {
+		uthreadarray_cleanup(&proc->p_uthreads);
+		threadarray_cleanup(&proc->p_threads);
+		lock_destroy(proc->p_lock);
+		kfree(proc->p_name);
+		kfree(proc);
+		return NULL;
+	}
+	proc->p_nexttid = 1;
+	proc->p_exiting = false;
+	proc->p_exitpending = false;
+	proc->p_exitstatus = 0;
+
 	/* VM fields */
 	proc->p_addrspace = NULL;
+	proc->p_vforkwait = NULL;
 
 	/* VFS fields */
 	proc->p_cwd = NULL;
@@ -133,6 +155,19 @@ proc_destroy(struct proc *proc)
 	}
 
 	/* VM fields */
+	if (proc->p_vforkwait != NULL) {
+		/*
+		 * The address space is our parent's; give it back
+		 * instead of destroying it.
+		 */
+		if (proc == curproc) {
+			proc_setas(NULL);
+		}
+		else {
+			proc->p_addrspace = NULL;
+		}
+		proc_vforkrelease(proc);
+	}
 	if (proc->p_addrspace) {
 		/*
 		 * If p is the current process, remove it safely from
@@ -177,11 +212,20 @@ proc_destroy(struct proc *proc)
 			as = proc->p_addrspace;
 			proc->p_addrspace = NULL;
 		}
-		as_destroy(as);
+		/* Don't make exit (and so waitpid) wait for this. */
+		as_destroy_later(as);
 	}
 
 	KASSERT(proc->p_pid == INVALID_PID);
 	threadarray_cleanup(&proc->p_threads);
+
+	/* User threads nobody joined */
+	while (uthreadarray_num(&proc->p_uthreads) > 0) {
+		kfree(uthreadarray_get(&proc->p_uthreads, 0));
+		uthreadarray_remove(&proc->p_uthreads, 0);
+	}
+	uthreadarray_cleanup(&proc->p_uthreads);
+	cv_destroy(proc->p_threadcv);
 	/* spinlock_cleanup(&proc->p_lock); */
         
         lock_destroy(proc->p_lock);
@@ -221,9 +265,17 @@ proc_bootstrap(void)
 	/* spinlock_init(&proc->p_lock); */
 	kproc->p_pid = KERNEL_PID;
 
+	/* User threads (never any) */
+	uthreadarray_init(&kproc->p_uthreads);
+	kproc->p_threadcv = NULL;
+	kproc->p_nexttid = 1;
+	kproc->p_exiting = false;
+	kproc->p_exitpending = false;
+	kproc->p_exitstatus = 0;
 
 	/* VM fields */
 	kproc->p_addrspace = NULL;
+	kproc->p_vforkwait = NULL;
 
 	/* VFS fields */
 	kproc->p_cwd = NULL;
@@ -278,15 +330,15 @@ proc_create_runprogram(const char *name, struct proc **ret)
 /*
  * Clone the current process.
  *
- * The new thread is given a copy of the caller's file handles if RET
- * is not null. (If RET is null, what we're creating is a kernel-only
- * thread and it doesn't need an address space or file handles.)
- * However, the new thread always inherits its current working
- * directory from the caller. The new thread is given no address space
- * (the caller decides that).
+ * The new process is given a copy of the caller's file handles and
+ * inherits its current working directory. If VFORKWAIT is not null,
+ * it borrows the caller's address space and signals VFORKWAIT when it
+ * gives it back by exec'ing or exiting. Otherwise it gets a copy of
+ * the caller's address space if COPYVM is set, and none if not.
  */
+static
 int
-proc_fork(struct proc **ret)
+proc_clone(bool copyvm, struct semaphore *vforkwait, struct proc **ret)
 {
 	struct proc *proc;
 	struct addrspace *as;
@@ -316,7 +368,11 @@ proc_fork(struct proc **ret)
 
 	/* VM fields */
 	as = proc_getas();
-	if (as != NULL) {
+	if (vforkwait != NULL) {
+		proc->p_addrspace = as;
+		proc->p_vforkwait = vforkwait;
+	}
+	else if (copyvm && as != NULL) {
 		result = as_copy(as, &proc->p_addrspace);
 		if (result) {
 			pid_unalloc(proc->p_pid);
@@ -331,7 +387,12 @@ proc_fork(struct proc **ret)
 	if (tbl != NULL) {
 		result = filetable_copy(&proc->p_filetable);
 		if (result) {
-			as_destroy(proc->p_addrspace);
+			if (vforkwait != NULL) {
+				proc->p_vforkwait = NULL;
+			}
+			else if (proc->p_addrspace != NULL) {
+				as_destroy(proc->p_addrspace);
+			}
 			proc->p_addrspace = NULL;
 			pid_unalloc(proc->p_pid);
 			proc->p_pid = INVALID_PID;
@@ -352,6 +413,56 @@ proc_fork(struct proc **ret)
 	return 0;
 }
 
+/*
+ * Create a fresh proc for use by fork(), with its own copy of the
+ * caller's address space.
+ */
+int
+proc_fork(struct proc **ret)
+{
+	return proc_clone(true, NULL, ret);
+}
+
+/*
+ * Create a fresh proc for use by vfork(). It shares the caller's
+ * address space, so the caller must wait on WAIT before returning to
+ * userlevel.
+ */
+int
+proc_vfork(struct semaphore *wait, struct proc **ret)
+{
+	KASSERT(wait != NULL);
+	return proc_clone(false, wait, ret);
+}
+
+/*
+ * Create a fresh proc for use by spawn(). It gets the caller's file
+ * handles and directory but no address space; the new thread loads
+ * one from scratch.
+ */
+int
+proc_spawn(struct proc **ret)
+{
+	return proc_clone(false, NULL, ret);
+}
+
+/*
+ * Called when a vfork'd process stops using its parent's address
+ * space, on successful exec or at exit. The caller must already have
+ * unhooked the address space from PROC.
+ */
+void
+proc_vforkrelease(struct proc *proc)
+{
+	struct semaphore *wait;
+
+	KASSERT(proc->p_vforkwait != NULL);
+
+	wait = proc->p_vforkwait;
+	proc->p_vforkwait = NULL;
+	V(wait);
+}
+
 /*
  * Undo proc_fork if nothing's run in the new process yet.
  */
@@ -374,6 +485,15 @@ proc_exit(int status)
 	/* The kernel isn't supposed to exit. */
 	KASSERT(proc != kproc);
 
+	/* Get rid of our other threads first. */
+	if (!proc_singlethread(&status)) {
+		/*
+		 * Another thread is already doing that; defer to it.
+		 * If it's exec'ing, it'll exit with our status instead.
+		 */
+		proc_threadexit(0);
+	}
+
 	/* Set exit status and wake up anyone waiting for us. */
 	pid_setexitstatus(status);
 
@@ -434,31 +554,23 @@ proc_addthread(struct proc *proc, struct thread *t)
 }
 
 /*
- * Remove a thread from its process. Either the thread or the process
- * might or might not be current.
- *
- * Turn off interrupts on the local cpu while changing t_proc, in
- * case it's current, to protect against the as_activate call in
- * the timer interrupt context switch, and any other implicit uses
- * of "curproc".
+ * Take T out of PROC's thread array and clear its t_proc, as for
+ * proc_remthread. The caller holds p_lock.
  */
+static
 void
-proc_remthread(struct thread *t)
+proc_dropthread(struct proc *proc, struct thread *t)
 {
-	struct proc *proc;
 	unsigned i, num;
 	int spl;
 
-	proc = t->t_proc;
-	KASSERT(proc != NULL);
+	KASSERT(lock_do_i_hold(proc->p_lock));
 
-	lock_acquire(proc->p_lock);
 	/* ugh: find the thread in the array */
 	num = threadarray_num(&proc->p_threads);
 	for (i=0; i<num; i++) {
 		if (threadarray_get(&proc->p_threads, i) == t) {
 			threadarray_remove(&proc->p_threads, i);
-			lock_release(proc->p_lock);
 			spl = splhigh();
 			t->t_proc = NULL;
 			splx(spl);
@@ -466,17 +578,38 @@ proc_remthread(struct thread *t)
 		}
 	}
 	/* Did not find it. */
-	lock_release(proc->p_lock);
 	panic("Thread (%p) has escaped from its process (%p)\n", t, proc);
 }
 
+/*
+ * Remove a thread from its process. Either the thread or the process
+ * might or might not be current.
+ *
+ * Turn off interrupts on the local cpu while changing t_proc, in
+ * case it's current, to protect against the as_activate call in
+ * the timer interrupt context switch, and any other implicit uses
+ * of "curproc".
+ */
+void
+proc_remthread(struct thread *t)
+{
+	struct proc *proc;
+
+	proc = t->t_proc;
+	KASSERT(proc != NULL);
+
+	lock_acquire(proc->p_lock);
+	proc_dropthread(proc, t);
+	lock_release(proc->p_lock);
+}
+
 /*
  * Fetch the address space of (the current) process.
  *
- * Caution: address spaces aren't refcounted. If you implement
- * multithreaded processes, make sure to set up a refcount scheme or
- * some other method to make this safe. Otherwise the returned address
- * space might disappear under you.
+ * Caution: address spaces aren't refcounted. That's safe with
+ * multithreaded processes because the address space is only replaced
+ * or destroyed (by exec or exit) once proc_singlethread has made the
+ * caller the only thread left.
  */
 struct addrspace *
 proc_getas(void)
@@ -524,3 +657,228 @@ proc_setas(struct addrspace *newas)
 	lock_release(proc->p_lock);
 	return oldas;
 }
+
+////////////////////////////////////////////////////////////
+//
+// User threads.
+
+/*
+ * Find the uthread record for TID in PROC, or return NULL. If INDEX
+ * isn't null, set it to the record's slot. The caller holds p_lock.
+ */
+static
+struct uthread *
+proc_finduthread(struct proc *proc, int tid, unsigned *index)
+{
+	struct uthread *ut;
+	unsigned i, num;
+
+	KASSERT(lock_do_i_hold(proc->p_lock));
+
+	num = uthreadarray_num(&proc->p_uthreads);
+	for (i=0; i<num; i++) {
+		ut = uthreadarray_get(&proc->p_uthreads, i);
+		if (ut->ut_tid == tid) {
+			if (index != NULL) {
+				*index = i;
+			}
+			return ut;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Allocate a thread id for a new thread of the current process.
+ */
+int
+proc_newtid(int *ret)
+{
+	struct proc *proc = curproc;
+	struct uthread *ut;
+	int result;
+
+	ut = kmalloc(sizeof(*ut));
+	if (ut == NULL) {
+		return ENOMEM;
+	}
+	ut->ut_exited = false;
+	ut->ut_joining = false;
+	ut->ut_status = 0;
+
+	lock_acquire(proc->p_lock);
+	if (proc->p_exiting) {
+		/* We're about to be told to exit ourselves. */
+		lock_release(proc->p_lock);
+		kfree(ut);
+		return EINTR;
+	}
+	ut->ut_tid = proc->p_nexttid++;
+	result = uthreadarray_add(&proc->p_uthreads, ut, NULL);
+	lock_release(proc->p_lock);
+	if (result) {
+		kfree(ut);
+		return result;
+	}
+	*ret = ut->ut_tid;
+	return 0;
+}
+
+/*
+ * Give back a thread id from proc_newtid that never got a thread.
+ */
+void
+proc_freetid(int tid)
+{
+	struct proc *proc = curproc;
+	struct uthread *ut;
+	unsigned index;
+
+	lock_acquire(proc->p_lock);
+	ut = proc_finduthread(proc, tid, &index);
+	KASSERT(ut != NULL);
+	uthreadarray_remove(&proc->p_uthreads, index);
+	lock_release(proc->p_lock);
+	kfree(ut);
+}
+
+/*
+ * Wait for thread TID of the current process to exit.
+ */
+int
+proc_threadjoin(int tid, int *status)
+{
+	struct proc *proc = curproc;
+	struct uthread *ut;
+	unsigned index;
+
+	if (tid == curthread->t_tid) {
+		return EINVAL;
+	}
+
+	lock_acquire(proc->p_lock);
+	ut = proc_finduthread(proc, tid, NULL);
+	if (ut == NULL) {
+		lock_release(proc->p_lock);
+		return ESRCH;
+	}
+	if (ut->ut_joining) {
+		lock_release(proc->p_lock);
+		return EINVAL;
+	}
+	ut->ut_joining = true;
+	while (!ut->ut_exited && !proc->p_exiting) {
+		cv_wait(proc->p_threadcv, proc->p_lock);
+	}
+	if (!ut->ut_exited) {
+		ut->ut_joining = false;
+		lock_release(proc->p_lock);
+		return EINTR;
+	}
+
+	/* Only we can remove it, but other records may have moved. */
+	ut = proc_finduthread(proc, tid, &index);
+	KASSERT(ut != NULL);
+	uthreadarray_remove(&proc->p_uthreads, index);
+	lock_release(proc->p_lock);
+
+	*status = ut->ut_status;
+	kfree(ut);
+	return 0;
+}
+
+/*
+ * Make the current thread exit, taking the process with it if it's
+ * the last thread.
+ */
+void
+proc_threadexit(int status)
+{
+	struct proc *proc = curproc;
+	struct uthread *ut;
+
+	KASSERT(proc != kproc);
+
+	lock_acquire(proc->p_lock);
+	if (threadarray_num(&proc->p_threads) == 1) {
+		/* Last one out. Nobody else can be exiting us. */
+		KASSERT(!proc->p_exiting);
+		lock_release(proc->p_lock);
+		proc_exit(_MKWAIT_EXIT(status));
+		thread_exit();
+	}
+
+	ut = proc_finduthread(proc, curthread->t_tid, NULL);
+	if (ut != NULL) {
+		ut->ut_exited = true;
+		ut->ut_status = status;
+	}
+
+	/*
+	 * Leave the process and wake joiners (and proc_singlethread)
+	 * in one go under p_lock, so that the last thread to leave
+	 * always knows it's the last. After this PROC may be
+	 * destroyed at any moment.
+	 */
+	proc_dropthread(proc, curthread);
+	cv_broadcast(proc->p_threadcv, proc->p_lock);
+	lock_release(proc->p_lock);
+
+	proc_addthread(kproc, curthread);
+	thread_exit();
+}
+
+/*
+ * Make the current thread the only one in its process.
+ */
+bool
+proc_singlethread(const int *exitstatus)
+{
+	struct proc *proc = curproc;
+
+	lock_acquire(proc->p_lock);
+	if (proc->p_exiting) {
+		/*
+		 * If we're exiting, record that for the winner, which
+		 * can't finish until we're gone. The first exit wins.
+		 */
+		if (exitstatus != NULL && !proc->p_exitpending) {
+			proc->p_exitpending = true;
+			proc->p_exitstatus = *exitstatus;
+		}
+		lock_release(proc->p_lock);
+		return false;
+	}
+	if (threadarray_num(&proc->p_threads) > 1) {
+		/* Wake any joiners so they can notice. */
+		proc->p_exiting = true;
+		cv_broadcast(proc->p_threadcv, proc->p_lock);
+		futex_interrupt(proc);
+		while (threadarray_num(&proc->p_threads) > 1) {
+			cv_wait(proc->p_threadcv, proc->p_lock);
+		}
+		proc->p_exiting = false;
+	}
+	lock_release(proc->p_lock);
+	return true;
+}
+
+/*
+ * After proc_singlethread, check whether one of the threads it got
+ * rid of was trying to exit, and collect the status if so.
+ */
+bool
+proc_exitpending(int *status)
+{
+	struct proc *proc = curproc;
+	bool ret;
+
+	lock_acquire(proc->p_lock);
+	ret = proc->p_exitpending;
+	if (ret) {
+		*status = proc->p_exitstatus;
+		proc->p_exitpending = false;
+	}
+	lock_release(proc->p_lock);
+	return ret;
+}
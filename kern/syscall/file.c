@@ -44,10 +44,41 @@
 #include <vfs.h>
 #include <vnode.h>
 #include <file.h>
+#include <objcache.h>
 #include <syscall.h>
 
 /*** openfile functions ***/
 
+/*
+ * openfiles are cached with their lock already created, so opening a
+ * file doesn't have to make a new one every time.
+ */
+static
+int
+openfile_ctor(void *obj)
+{
+	struct openfile *file = obj;
+
+	file->of_lock = lock_create("file lock");
+	if (file->of_lock == NULL) {
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static
+void
+openfile_dtor(void *obj)
+{
+	struct openfile *file = obj;
+
+	lock_destroy(file->of_lock);
+}
+
+static struct objcache openfile_cache =
+	OBJCACHE_INITIALIZER("openfile", sizeof(struct openfile),
+			     openfile_ctor, openfile_dtor);
+
 /*
  * file_open
  * opens a file, places it in the filetable, sets RETFD to the file
@@ -66,19 +97,13 @@ file_open(char *filename, int flags, int mode, int *retfd)
 		return result;
 	}
 
-	file = kmalloc(sizeof(struct openfile));
+	file = objcache_alloc(&openfile_cache);
 	if (file == NULL) {
 		vfs_close(vn);
 		return ENOMEM;
 	}
 
-	/* initialize the file struct */
-	file->of_lock = lock_create("file lock");
-	if (file->of_lock == NULL) {
-		vfs_close(vn);
-		kfree(file);
-		return ENOMEM;
-	}
+	/* initialize the file struct (of_lock comes ready-made) */
 	file->of_vnode = vn;
 	file->of_offset = 0;
 	file->of_accmode = flags & O_ACCMODE;
@@ -92,8 +117,7 @@ file_open(char *filename, int flags, int mode, int *retfd)
 	/* place the file in the filetable, getting the file descriptor */
 	result = filetable_placefile(file, retfd);
 	if (result) {
-		lock_destroy(file->of_lock);
-		kfree(file);
+		objcache_free(&openfile_cache, file);
 		vfs_close(vn);
 		return result;
 	}
@@ -115,8 +139,7 @@ file_doclose(struct openfile *file)
 	if (file->of_refcount == 1) {
 		vfs_close(file->of_vnode);
 		lock_release(file->of_lock);
-		lock_destroy(file->of_lock);
-		kfree(file);
+		objcache_free(&openfile_cache, file);
 	}
 	else {
 		KASSERT(file->of_refcount > 1);
@@ -134,23 +157,28 @@ file_doclose(struct openfile *file)
 int
 file_close(int fd)
 {
+	struct filetable *ft = curproc->p_filetable;
 	struct openfile *file;
-	int result;
 
-	/* find the file in the filetable */
-	result = filetable_findfile(fd, &file);
-	if (result) {
-		return result;
+	if (fd < 0 || fd >= OPEN_MAX) {
+		return EBADF;
 	}
 
-	result = file_doclose(file);
-	if (result) {
-		/* leave file open for possible retry */
-		return result;
+	/*
+	 * take the file out of the table first, so no other thread can
+	 * find it; then drop the table's reference without holding
+	 * ft_lock, since the last close can sleep in the vfs.
+	 */
+	lock_acquire(ft->ft_lock);
+	file = ft->ft_openfiles[fd];
+	if (file == NULL) {
+		lock_release(ft->ft_lock);
+		return EBADF;
 	}
-	curproc->p_filetable->ft_openfiles[fd] = NULL;
+	ft->ft_openfiles[fd] = NULL;
+	lock_release(ft->ft_lock);
 
-	return 0;
+	return file_doclose(file);
 }
 
 /*** filetable functions ***/
@@ -184,6 +212,12 @@ filetable_init(const char *inpath, const char *outpath, const char *errpath)
 	if (curproc->p_filetable == NULL) {
 		return ENOMEM;
 	}
+	curproc->p_filetable->ft_lock = lock_create("filetable");
+	if (curproc->p_filetable->ft_lock == NULL) {
+		kfree(curproc->p_filetable);
+		curproc->p_filetable = NULL;
+		return ENOMEM;
+	}
 	
 	/* NULL-out the table */
 	for (fd = 0; fd < OPEN_MAX; fd++) {
@@ -239,8 +273,15 @@ filetable_copy(struct filetable **copy)
 	if (*copy == NULL) {
 		return ENOMEM;
 	}
+	(*copy)->ft_lock = lock_create("filetable");
+	if ((*copy)->ft_lock == NULL) {
+		kfree(*copy);
+		*copy = NULL;
+		return ENOMEM;
+	}
 
 	/* copy over the entries */
+	lock_acquire(ft->ft_lock);
 	for (fd = 0; fd < OPEN_MAX; fd++) {
 		if (ft->ft_openfiles[fd] != NULL) {
 			lock_acquire(ft->ft_openfiles[fd]->of_lock);
@@ -252,6 +293,7 @@ filetable_copy(struct filetable **copy)
 			(*copy)->ft_openfiles[fd] = NULL;
 		}
 	}
+	lock_release(ft->ft_lock);
 
 	return 0;
 }
@@ -274,6 +316,7 @@ filetable_destroy(struct filetable *ft)
 		}
 	}
 	
+	lock_destroy(ft->ft_lock);
 	kfree(ft);
 }	
 
@@ -288,13 +331,16 @@ filetable_placefile(struct openfile *file, int *fd)
 	struct filetable *ft = curproc->p_filetable;
 	int i;
 	
+	lock_acquire(ft->ft_lock);
 	for (i = 0; i < OPEN_MAX; i++) {
 		if (ft->ft_openfiles[i] == NULL) {
 			ft->ft_openfiles[i] = file;
+			lock_release(ft->ft_lock);
 			*fd = i;
 			return 0;
 		}
 	}
+	lock_release(ft->ft_lock);
 
 	return EMFILE;
 }
@@ -303,6 +349,9 @@ filetable_placefile(struct openfile *file, int *fd)
  * filetable_findfile
  * verifies that the file descriptor is valid and actually references an
  * open file, setting the FILE to the file at that index if it's there.
+ * the file comes with a reference of its own, so that another thread
+ * closing the fd can't free it out from under the caller; give it back
+ * with filetable_putfile.
  */
 int
 filetable_findfile(int fd, struct openfile **file)
@@ -313,14 +362,33 @@ filetable_findfile(int fd, struct openfile **file)
 		return EBADF;
 	}
 	
+	lock_acquire(ft->ft_lock);
 	*file = ft->ft_openfiles[fd];
 	if (*file == NULL) {
+		lock_release(ft->ft_lock);
 		return EBADF;
 	}
+	lock_acquire((*file)->of_lock);
+	(*file)->of_refcount++;
+	lock_release((*file)->of_lock);
+	lock_release(ft->ft_lock);
 
 	return 0;
 }
 
+/*
+ * filetable_putfile
+ * drops the reference filetable_findfile took.
+ */
+void
+filetable_putfile(struct openfile *file)
+{
+	int result;
+
+	result = file_doclose(file);
+	KASSERT(result == 0);
+}
+
 /*
  * filetable_dup2file
  * verifies that both file descriptors are valid, and that the OLDFD is
@@ -331,38 +399,39 @@ int
 filetable_dup2file(int oldfd, int newfd)
 {
 	struct filetable *ft = curproc->p_filetable;
-	struct openfile *file;
-	int result;
+	struct openfile *file, *oldfile;
 
 	if (oldfd < 0 || oldfd >= OPEN_MAX || newfd < 0 || newfd >= OPEN_MAX) {
 		return EBADF;
 	}
 
+	lock_acquire(ft->ft_lock);
 	file = ft->ft_openfiles[oldfd];
 	if (file == NULL) {
+		lock_release(ft->ft_lock);
 		return EBADF;
 	}
 
 	/* dup2'ing an fd to itself automatically succeeds (BSD semantics) */
 	if (oldfd == newfd) {
+		lock_release(ft->ft_lock);
 		return 0;
 	}
 
-	/* closes the newfd if it's open */
-	if (ft->ft_openfiles[newfd] != NULL) {
-		result = file_close(newfd);
-		if (result) {
-			return result;
-		}
-	}
-
 	/* up the refcount */
 	lock_acquire(file->of_lock);
 	file->of_refcount++;
 	lock_release(file->of_lock);
 
-	/* doesn't need to be synchronized because it's just changing the ft */
+	/* swap it in under ft_lock so newfd is never seen closed */
+	oldfile = ft->ft_openfiles[newfd];
 	ft->ft_openfiles[newfd] = file;
+	lock_release(ft->ft_lock);
+
+	/* closes whatever newfd had open */
+	if (oldfile != NULL) {
+		return file_doclose(oldfile);
+	}
 
 	return 0;
 }
@@ -111,6 +111,7 @@ sys_read(int fd, userptr_t buf, size_t size, int *retval)
 
 	if (file->of_accmode == O_WRONLY) {
 		lock_release(file->of_lock);
+		filetable_putfile(file);
 		return EBADF;
 	}
 
@@ -121,6 +122,7 @@ sys_read(int fd, userptr_t buf, size_t size, int *retval)
 	result = VOP_READ(file->of_vnode, &useruio);
 	if (result) {
 		lock_release(file->of_lock);
+		filetable_putfile(file);
 		return result;
 	}
 
@@ -128,6 +130,7 @@ sys_read(int fd, userptr_t buf, size_t size, int *retval)
 	file->of_offset = useruio.uio_offset;
 
 	lock_release(file->of_lock);
+	filetable_putfile(file);
 	
 	/*
 	 * The amount read is the size of the buffer originally, minus
@@ -159,6 +162,7 @@ sys_write(int fd, userptr_t buf, size_t size, int *retval)
 
 	if (file->of_accmode == O_RDONLY) {
 		lock_release(file->of_lock);
+		filetable_putfile(file);
 		return EBADF;
 	}
 
@@ -169,6 +173,7 @@ sys_write(int fd, userptr_t buf, size_t size, int *retval)
 	result = VOP_WRITE(file->of_vnode, &useruio);
 	if (result) {
 		lock_release(file->of_lock);
+		filetable_putfile(file);
 		return result;
 	}
 
@@ -176,6 +181,7 @@ sys_write(int fd, userptr_t buf, size_t size, int *retval)
 	file->of_offset = useruio.uio_offset;
 
 	lock_release(file->of_lock);
+	filetable_putfile(file);
 
 	/*
 	 * the amount written is the size of the buffer originally,
@@ -228,12 +234,14 @@ sys_lseek(int fd, off_t offset, int whence, off_t *retval)
 		result = VOP_STAT(file->of_vnode, &info);
 		if (result) {
 			lock_release(file->of_lock);
+			filetable_putfile(file);
 			return result;
 		}
 		*retval = info.st_size + offset;
 		break;
 	    default:
 		lock_release(file->of_lock);
+		filetable_putfile(file);
 		return EINVAL;
 	}
 
@@ -241,6 +249,7 @@ sys_lseek(int fd, off_t offset, int whence, off_t *retval)
 	result = VOP_TRYSEEK(file->of_vnode, *retval);
 	if (result) {
 		lock_release(file->of_lock);
+		filetable_putfile(file);
 		return result;
 	}
 	
@@ -248,6 +257,7 @@ sys_lseek(int fd, off_t offset, int whence, off_t *retval)
 	file->of_offset = *retval;
 
 	lock_release(file->of_lock);
+	filetable_putfile(file);
 
 	return 0;
 }
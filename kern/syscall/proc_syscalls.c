@@ -42,6 +42,7 @@
 #include <current.h>
 #include <copyinout.h>
 #include <pid.h>
+#include <synch.h>
 #include <syscall.h>
 
 /* note that sys_execv is defined in runprogram.c for convenience */
@@ -136,6 +137,59 @@ sys_fork(struct trapframe *tf, pid_t *retval)
 	return 0;
 }
 
+/*
+ * sys_vfork
+ *
+ * Like fork, but the child runs in our address space instead of a
+ * copy of it, which is much cheaper when all it is going to do is
+ * exec. Since we would trample each other's stacks, we sleep until
+ * the child has exec'd or exited and thus given the address space
+ * back.
+ */
+int
+sys_vfork(struct trapframe *tf, pid_t *retval)
+{
+	struct trapframe *ntf;
+	struct semaphore *wait;
+	struct proc *newproc;
+	int result;
+
+	ntf = kmalloc(sizeof(struct trapframe));
+	if (ntf==NULL) {
+		return ENOMEM;
+	}
+	*ntf = *tf;
+
+	wait = sem_create("vfork", 0);
+	if (wait == NULL) {
+		kfree(ntf);
+		return ENOMEM;
+	}
+
+	result = proc_vfork(wait, &newproc);
+	if (result) {
+		sem_destroy(wait);
+		kfree(ntf);
+		return result;
+	}
+	*retval = newproc->p_pid;
+
+	result = thread_fork(curthread->t_name, newproc,
+			     fork_newthread, ntf, 0);
+	if (result) {
+		/* this signals wait, which we then don't care about */
+		proc_unfork(newproc);
+		sem_destroy(wait);
+		kfree(ntf);
+		return result;
+	}
+
+	P(wait);
+	sem_destroy(wait);
+
+	return 0;
+}
+
 /*
  * sys_waitpid
  * just pass off the work to the pid code.
@@ -35,9 +35,12 @@
 #include <types.h>
 #include <kern/errno.h>
 #include <kern/fcntl.h>
+#include <kern/spawn.h>
+#include <kern/wait.h>
 #include <limits.h>
 #include <lib.h>
 #include <proc.h>
+#include <thread.h>
 #include <current.h>
 #include <synch.h>
 #include <copyinout.h>
@@ -45,20 +48,25 @@
 #include <vm.h>
 #include <vfs.h>
 #include <file.h>
+#include <pid.h>
 #include <syscall.h>
 #include <test.h>
 
 // XXX shouldn't be here
 #define NARG_MAX 1024
 
+/* Initial sizes of the argv buffers; most argvs fit without growing. */
+#define ARGV_INITBUF   256
+#define ARGV_INITARGS  16
+
 /*
  * argvdata structure.
  *
- * This is a single global (and synchronized) temporary storage for
- * argv. We make it global because exec uses a lot of kernel memory;
- * if we didn't restrict things we'd run out pretty rapidly. We bundle
- * things into a structure to make it relatively easy to move to having
- * e.g. two argv buffers instead of one.
+ * Temporary storage for an argv on its way through the kernel. Each
+ * exec gets its own, so execs in different processes don't wait for
+ * one another. The string buffer starts small and grows a page at a
+ * time up to ARG_MAX, and the offsets array doubles up to NARG_MAX,
+ * so the common short argv doesn't tie up a full ARG_MAX buffer.
  *
  * A better way to do this is to allocate the argv buffer in pageable
  * virtual memory. However, we don't have a VM system for that yet.
@@ -66,22 +74,104 @@
 struct argvdata {
 	char *buffer;
 	char *bufend;
+	size_t bufsize;
 	size_t *offsets;
+	int maxargs;
 	int nargs;
-	struct lock *lock;
 };
 
-static struct argvdata argdata;
+static
+void
+argvdata_init(struct argvdata *ad)
+{
+	ad->buffer = ad->bufend = NULL;
+	ad->bufsize = 0;
+	ad->offsets = NULL;
+	ad->maxargs = 0;
+	ad->nargs = 0;
+}
 
+static
 void
-execv_bootstrap(void)
+argvdata_cleanup(struct argvdata *ad)
+{
+	kfree(ad->buffer);
+	kfree(ad->offsets);
+	argvdata_init(ad);
+}
+
+/*
+ * Make the string buffer big enough for at least MINSIZE bytes.
+ */
+static
+int
+argvdata_growbuf(struct argvdata *ad, size_t minsize)
 {
-	argdata.lock = lock_create("argvlock");
-	if (argdata.lock == NULL) {
-		panic("Cannot create argv data lock\n");
+	size_t newsize, used;
+	char *newbuf;
+
+	if (minsize <= ad->bufsize) {
+		return 0;
+	}
+	if (minsize > ARG_MAX) {
+		return E2BIG;
+	}
+
+	if (minsize <= ARGV_INITBUF) {
+		newsize = ARGV_INITBUF;
+	}
+	else {
+		newsize = ROUNDUP(minsize, PAGE_SIZE);
+		if (newsize > ARG_MAX) {
+			newsize = ARG_MAX;
+		}
 	}
+
+	newbuf = kmalloc(newsize);
+	if (newbuf == NULL) {
+		return ENOMEM;
+	}
+	used = ad->bufend - ad->buffer;
+	if (used > 0) {
+		memcpy(newbuf, ad->buffer, used);
+	}
+	kfree(ad->buffer);
+	ad->buffer = newbuf;
+	ad->bufend = newbuf + used;
+	ad->bufsize = newsize;
+	return 0;
 }
 
+/*
+ * Make room for one more entry in the offsets array.
+ */
+static
+int
+argvdata_growargs(struct argvdata *ad)
+{
+	size_t *newoffsets;
+	int newmax;
+
+	if (ad->nargs < ad->maxargs) {
+		return 0;
+	}
+
+	newmax = ad->maxargs ? ad->maxargs * 2 : ARGV_INITARGS;
+	if (newmax > NARG_MAX) {
+		newmax = NARG_MAX;
+	}
+	newoffsets = kmalloc(newmax * sizeof(size_t));
+	if (newoffsets == NULL) {
+		return ENOMEM;
+	}
+	if (ad->nargs > 0) {
+		memcpy(newoffsets, ad->offsets, ad->nargs * sizeof(size_t));
+	}
+	kfree(ad->offsets);
+	ad->offsets = newoffsets;
+	ad->maxargs = newmax;
+	return 0;
+}
 
 /*
  * Copy an argv array into kernel space, using an argvdata buffer.
@@ -92,13 +182,13 @@ copyin_args(userptr_t argv, struct argvdata *ad)
 {
 	userptr_t argptr;
 	size_t arglen;
-	size_t bufsize, bufresid;
+	size_t bufresid;
 	int result;
 
-	KASSERT(lock_do_i_hold(ad->lock));
-
-	/* for convenience */
-	bufsize = bufresid = ARG_MAX;
+	result = argvdata_growbuf(ad, ARGV_INITBUF);
+	if (result) {
+		return result;
+	}
 
 	/* reset the argvdata */
 	ad->bufend = ad->buffer;
@@ -124,20 +214,37 @@ copyin_args(userptr_t argv, struct argvdata *ad)
 		if (ad->nargs >= NARG_MAX) {
 			return E2BIG;
 		}
+		result = argvdata_growargs(ad);
+		if (result) {
+			return result;
+		}
 
-		/* otherwise, copyinstr the arg into the argvdata buffer */
-		result = copyinstr(argptr, ad->bufend, bufresid, &arglen);
-		if (result == ENAMETOOLONG) {
-			return E2BIG;
+		/*
+		 * otherwise, copyinstr the arg into the argvdata
+		 * buffer, growing the buffer until it fits.
+		 */
+		while (1) {
+			bufresid = ad->bufsize - (ad->bufend - ad->buffer);
+			result = copyinstr(argptr, ad->bufend, bufresid,
+					   &arglen);
+			if (result != ENAMETOOLONG) {
+				break;
+			}
+			if (ad->bufsize == ARG_MAX) {
+				return E2BIG;
+			}
+			result = argvdata_growbuf(ad, ad->bufsize + 1);
+			if (result) {
+				return result;
+			}
 		}
-		else if (result) {
+		if (result) {
 			return result;
 		}
 
 		/* got one -- update the argvdata and the local argv userptr */
-		ad->offsets[ad->nargs] = bufsize - bufresid;
+		ad->offsets[ad->nargs] = ad->bufend - ad->buffer;
 		ad->bufend += arglen;
-		bufresid -= arglen;
 		argv += sizeof(userptr_t);
 	}
 
@@ -156,8 +263,6 @@ copyout_args(struct argvdata *ad, userptr_t *argv, vaddr_t *stackptr)
 	size_t buflen;
 	int i, result;
 
-	KASSERT(lock_do_i_hold(ad->lock));
-
 	/* we use the buflen a lot, precalc it */
 	buflen = ad->bufend - ad->buffer;
 
@@ -275,13 +380,17 @@ loadexec(char *path, vaddr_t *entrypoint, vaddr_t *stackptr)
         }
 
 	/*
-	 * Wipe out old address space.
+	 * Wipe out old address space, or if it was borrowed by vfork,
+	 * give it back and let the parent run again.
 	 *
 	 * Note: once this is done, execv() must not fail, because there's
 	 * nothing left for it to return an error to.
 	 */
-	if (oldvm) {
-		as_destroy(oldvm);
+	if (curproc->p_vforkwait != NULL) {
+		proc_vforkrelease(curproc);
+	}
+	else if (oldvm) {
+		as_destroy_later(oldvm);
 	}
 
 	/*
@@ -307,6 +416,7 @@ loadexec(char *path, vaddr_t *entrypoint, vaddr_t *stackptr)
 int
 runprogram(char *progname)
 {
+	struct argvdata argdata;
 	vaddr_t entrypoint, stackptr;
 	int argc;
 	userptr_t argv;
@@ -326,26 +436,18 @@ runprogram(char *progname)
 		}
 	}
 
-	lock_acquire(argdata.lock);
-
 	/*
 	 * Cons up argv.
 	 */
 
-	if (strlen(progname) + 1 > ARG_MAX) {
-		lock_release(argdata.lock);
-		return E2BIG;
+	argvdata_init(&argdata);
+	result = argvdata_growbuf(&argdata, strlen(progname) + 1);
+	if (result == 0) {
+		result = argvdata_growargs(&argdata);
 	}
-	argdata.buffer = kmalloc(strlen(progname) + 1);
-	if (argdata.buffer == NULL) {
-		lock_release(argdata.lock);
-		return ENOMEM;
-	}
-	argdata.offsets = kmalloc(sizeof(size_t));
-	if (argdata.offsets == NULL) {
-		kfree(argdata.buffer);
-		lock_release(argdata.lock);
-		return ENOMEM;
+	if (result) {
+		argvdata_cleanup(&argdata);
+		return result;
 	}
 	strcpy(argdata.buffer, progname);
 	argdata.bufend = argdata.buffer + (strlen(argdata.buffer) + 1);
@@ -355,17 +457,13 @@ runprogram(char *progname)
 	/* Load the executable. Note: must not fail after this succeeds. */
 	result = loadexec(progname, &entrypoint, &stackptr);
 	if (result) {
-		kfree(argdata.buffer);
-		kfree(argdata.offsets);
-		lock_release(argdata.lock);
+		argvdata_cleanup(&argdata);
 		return result;
 	}
 
 	result = copyout_args(&argdata, &argv, &stackptr);
 	if (result) {
-		kfree(argdata.buffer);
-		kfree(argdata.offsets);
-		lock_release(argdata.lock);
+		argvdata_cleanup(&argdata);
 
 		/* If copyout fails, *we* messed up, so panic */
 		panic("execv: copyout_args failed: %s\n", strerror(result));
@@ -374,10 +472,7 @@ runprogram(char *progname)
 	argc = argdata.nargs;
 
 	/* free the space */
-	kfree(argdata.buffer);
-	kfree(argdata.offsets);
-
-	lock_release(argdata.lock);
+	argvdata_cleanup(&argdata);
 
 	/* Warp to user mode. */
 	enter_new_process(argc, argv, NULL /*env*/, stackptr, entrypoint);
@@ -392,13 +487,15 @@ runprogram(char *progname)
  *
  * 1. Copy in the program name.
  * 2. Copy in the argv with copyin_args.
- * 3. Load the executable.
- * 4. Copy the argv out again with copyout_args.
- * 5. Warp to usermode.
+ * 3. Get rid of the process's other threads.
+ * 4. Load the executable.
+ * 5. Copy the argv out again with copyout_args.
+ * 6. Warp to usermode.
  */
 int
 sys_execv(userptr_t prog, userptr_t argv)
 {
+	struct argvdata argdata;
 	char *path;
 	vaddr_t entrypoint, stackptr;
 	int argc;
@@ -417,41 +514,38 @@ sys_execv(userptr_t prog, userptr_t argv)
 	}
 
 	/* get the argv strings. */
-
-	lock_acquire(argdata.lock);
-
-	/* allocate space */
-	argdata.buffer = kmalloc(ARG_MAX);
-	if (argdata.buffer == NULL) {
-		lock_release(argdata.lock);
+	argvdata_init(&argdata);
+	result = copyin_args(argv, &argdata);
+	if (result) {
 		kfree(path);
-		return ENOMEM;
+		argvdata_cleanup(&argdata);
+		return result;
 	}
-	argdata.offsets = kmalloc(NARG_MAX * sizeof(size_t));
-	if (argdata.offsets == NULL) {
-		kfree(argdata.buffer);
-		lock_release(argdata.lock);
+
+	/*
+	 * The old image is going away, so its other threads must too.
+	 * (If the load then fails, they're gone anyway.) If some other
+	 * thread is already exiting the process, lose; we'll exit on
+	 * the way back to user mode.
+	 */
+	if (!proc_singlethread(NULL)) {
 		kfree(path);
-		return ENOMEM;
+		argvdata_cleanup(&argdata);
+		return EINTR;
 	}
-
-	/* do the copyin */
-	result = copyin_args(argv, &argdata);
-	if (result) {
+	if (proc_exitpending(&result)) {
+		/* One of them called exit meanwhile; that wins. */
 		kfree(path);
-		kfree(argdata.buffer);
-		kfree(argdata.offsets);
-		lock_release(argdata.lock);
-		return result;
+		argvdata_cleanup(&argdata);
+		proc_exit(result);
+		thread_exit();
 	}
 
 	/* Load the executable. Note: must not fail after this succeeds. */
 	result = loadexec(path, &entrypoint, &stackptr);
 	if (result) {
 		kfree(path);
-		kfree(argdata.buffer);
-		kfree(argdata.offsets);
-		lock_release(argdata.lock);
+		argvdata_cleanup(&argdata);
 		return result;
 	}
 
@@ -461,18 +555,13 @@ sys_execv(userptr_t prog, userptr_t argv)
 	/* Send the argv strings to the process. */
 	result = copyout_args(&argdata, &argv, &stackptr);
 	if (result) {
-		lock_release(argdata.lock);
-
 		/* if copyout fails, *we* messed up, so panic */
 		panic("execv: copyout_args failed: %s\n", strerror(result));
 	}
 	argc = argdata.nargs;
 
-	/* free the argdata space */    
-	kfree(argdata.buffer);
-	kfree(argdata.offsets);
-
-	lock_release(argdata.lock);
+	/* free the argdata space */
+	argvdata_cleanup(&argdata);
 
 	/* Warp to user mode. */
 	enter_new_process(argc, argv, NULL /*env*/, stackptr, entrypoint);
@@ -481,3 +570,173 @@ sys_execv(userptr_t prog, userptr_t argv)
 	panic("enter_new_process returned\n");
 	return EINVAL;
 }
+
+/*
+ * spawn.
+ *
+ * Start a program in a new process without copying this one first.
+ * The path, argv and file actions are copied in here, while our
+ * address space is the current one; the new thread then applies the
+ * file actions, loads the executable into a fresh address space and
+ * copies the argv out onto its stack. We wait for it to get that far
+ * so that failures to start (no such file, bad executable) come back
+ * as an error instead of an exit status.
+ */
+struct spawninfo {
+	char *si_path;
+	struct argvdata si_args;
+	struct spawn_fdaction si_actions[SPAWN_MAXACTIONS];
+	int si_nactions;
+	struct semaphore *si_done;
+	int si_result;
+};
+
+static
+void
+spawninfo_destroy(struct spawninfo *si)
+{
+	if (si->si_done != NULL) {
+		sem_destroy(si->si_done);
+	}
+	argvdata_cleanup(&si->si_args);
+	kfree(si->si_path);
+	kfree(si);
+}
+
+/*
+ * Apply the file actions to the current process's file table.
+ */
+static
+int
+spawn_fdsetup(const struct spawn_fdaction *actions, int nactions)
+{
+	int i, result;
+
+	for (i = 0; i < nactions; i++) {
+		if (actions[i].sfa_srcfd == SPAWN_CLOSE) {
+			result = file_close(actions[i].sfa_fd);
+		}
+		else {
+			result = filetable_dup2file(actions[i].sfa_srcfd,
+						    actions[i].sfa_fd);
+		}
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+static
+void
+spawn_newthread(void *vsi, unsigned long junk)
+{
+	struct spawninfo *si = vsi;
+	vaddr_t entrypoint, stackptr;
+	userptr_t argv;
+	int argc, result;
+
+	(void)junk;
+
+	result = spawn_fdsetup(si->si_actions, si->si_nactions);
+	if (result == 0) {
+		/* Note: must not fail after this succeeds. */
+		result = loadexec(si->si_path, &entrypoint, &stackptr);
+	}
+	if (result == 0) {
+		result = copyout_args(&si->si_args, &argv, &stackptr);
+		if (result) {
+			/* If copyout fails, *we* messed up, so panic */
+			panic("spawn: copyout_args failed: %s\n",
+			      strerror(result));
+		}
+	}
+	argc = si->si_args.nargs;
+
+	/* Report back. After this, si belongs to the parent again. */
+	si->si_result = result;
+	V(si->si_done);
+
+	if (result) {
+		/* The parent collects our exit status. */
+		proc_exit(_MKWAIT_EXIT(255));
+	}
+
+	/* Warp to user mode. */
+	enter_new_process(argc, argv, NULL /*env*/, stackptr, entrypoint);
+}
+
+int
+sys_spawn(userptr_t prog, userptr_t argv, userptr_t actions, int nactions,
+	  pid_t *retval)
+{
+	struct spawninfo *si;
+	struct proc *newproc;
+	pid_t pid;
+	int result;
+
+	if (nactions < 0 || nactions > SPAWN_MAXACTIONS) {
+		return EINVAL;
+	}
+
+	si = kmalloc(sizeof(*si));
+	if (si == NULL) {
+		return ENOMEM;
+	}
+	argvdata_init(&si->si_args);
+	si->si_path = kmalloc(PATH_MAX);
+	si->si_done = sem_create("spawn", 0);
+	if (si->si_path == NULL || si->si_done == NULL) {
+		spawninfo_destroy(si);
+		return ENOMEM;
+	}
+
+	/* Get the filename, the argv strings and the file actions. */
+	result = copyinstr(prog, si->si_path, PATH_MAX, NULL);
+	if (result) {
+		spawninfo_destroy(si);
+		return result;
+	}
+	result = copyin_args(argv, &si->si_args);
+	if (result) {
+		spawninfo_destroy(si);
+		return result;
+	}
+	if (nactions > 0) {
+		result = copyin(actions, si->si_actions,
+				nactions * sizeof(struct spawn_fdaction));
+		if (result) {
+			spawninfo_destroy(si);
+			return result;
+		}
+	}
+	si->si_nactions = nactions;
+
+	result = proc_spawn(&newproc);
+	if (result) {
+		spawninfo_destroy(si);
+		return result;
+	}
+	pid = newproc->p_pid;
+
+	result = thread_fork(si->si_path, newproc, spawn_newthread, si, 0);
+	if (result) {
+		proc_unfork(newproc);
+		spawninfo_destroy(si);
+		return result;
+	}
+
+	/* Wait until the child is loaded or has given up. */
+	P(si->si_done);
+	result = si->si_result;
+	spawninfo_destroy(si);
+
+	if (result) {
+		/* It's exiting; reap it so the pid doesn't linger. */
+		pid_wait(pid, NULL, 0, NULL);
+		return result;
+	}
+
+	*retval = pid;
+	return 0;
+}
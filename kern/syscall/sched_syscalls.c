@@ -0,0 +1,78 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Scheduler-related syscalls.
+ */
+
+#include <types.h>
+#include <kern/schedstat.h>
+#include <lib.h>
+#include <thread.h>
+#include <current.h>
+#include <copyinout.h>
+#include <syscall.h>
+
+/*
+ * Set the calling thread's CPU affinity mask (see thread_setaffinity).
+ */
+int
+sys_setaffinity(uint32_t mask)
+{
+	return thread_setaffinity(mask);
+}
+
+/*
+ * Get the calling thread's CPU affinity mask.
+ */
+int
+sys_getaffinity(userptr_t user_mask)
+{
+	uint32_t mask;
+
+	mask = curthread->t_cpumask;
+	return copyout(&mask, user_mask, sizeof(mask));
+}
+
+/*
+ * Get scheduler statistics for cpu number WHICH, or for the calling
+ * thread if WHICH is SCHEDSTAT_SELF.
+ */
+int
+sys_schedstat(int which, userptr_t user_ss)
+{
+	struct schedstat ss;
+	int result;
+
+	result = thread_getschedstat(which, &ss);
+	if (result) {
+		return result;
+	}
+	return copyout(&ss, user_ss, sizeof(ss));
+}
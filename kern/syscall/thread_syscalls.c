@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * User thread syscalls.
+ *
+ * The threads of a process share its address space, filetable, and
+ * cwd; each gets its own kernel thread (and so its own kernel stack)
+ * and a thread id that thread_join can wait on. The bookkeeping is
+ * in proc.c.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/futex.h>
+#include <lib.h>
+#include <thread.h>
+#include <proc.h>
+#include <current.h>
+#include <copyinout.h>
+#include <futex.h>
+#include <syscall.h>
+
+/*
+ * Where a new thread should start in userland.
+ */
+struct uthread_start {
+	vaddr_t us_entry;
+	userptr_t us_arg;
+	vaddr_t us_stack;
+	vaddr_t us_gp;		/* creator's global pointer */
+};
+
+/*
+ * sys___thread_create
+ *
+ * create a new thread in the current process, which begins executing
+ * in uthread_newthread(). GP is the creating thread's global pointer:
+ * crt0 only sets it up in the first thread, and userland code
+ * addresses small globals (errno, for one) relative to it.
+ */
+
+static
+void
+uthread_newthread(void *vus, unsigned long tid)
+{
+	struct uthread_start us;
+
+	us = *(struct uthread_start *)vus;
+	kfree(vus);
+
+	curthread->t_tid = tid;
+
+	/* Don't bother starting if the process is on its way out. */
+	if (curproc->p_exiting) {
+		proc_threadexit(0);
+	}
+
+	enter_new_thread(us.us_arg, us.us_stack, us.us_entry, us.us_gp);
+}
+
+int
+sys___thread_create(userptr_t entry, userptr_t arg, userptr_t stack,
+		    vaddr_t gp, int *retval)
+{
+	struct uthread_start *us;
+	int tid;
+	int result;
+
+	if (entry == NULL || stack == NULL) {
+		return EINVAL;
+	}
+
+	us = kmalloc(sizeof(*us));
+	if (us == NULL) {
+		return ENOMEM;
+	}
+	us->us_entry = (vaddr_t)entry;
+	us->us_arg = arg;
+	/* MIPS wants the stack doubleword aligned. */
+	us->us_stack = (vaddr_t)stack & ~(vaddr_t)7;
+	us->us_gp = gp;
+
+	result = proc_newtid(&tid);
+	if (result) {
+		kfree(us);
+		return result;
+	}
+
+	result = thread_fork(curthread->t_name, NULL,
+			     uthread_newthread, us, tid);
+	if (result) {
+		proc_freetid(tid);
+		kfree(us);
+		return result;
+	}
+
+	*retval = tid;
+	return 0;
+}
+
+/*
+ * sys_thread_exit
+ *
+ * The last thread out takes the process with it; see proc_threadexit.
+ */
+__DEAD
+void
+sys_thread_exit(int status)
+{
+	proc_threadexit(status);
+}
+
+/*
+ * sys_thread_join
+ */
+int
+sys_thread_join(int tid, userptr_t user_status)
+{
+	int status;
+	int result;
+
+	result = proc_threadjoin(tid, &status);
+	if (result) {
+		return result;
+	}
+	if (user_status != NULL) {
+		result = copyout(&status, user_status, sizeof(status));
+	}
+	return result;
+}
+
+/*
+ * sys_futex
+ */
+int
+sys_futex(userptr_t addr, int op, int val, int *retval)
+{
+	switch (op) {
+	    case FUTEX_WAIT:
+		*retval = 0;
+		return futex_wait(addr, val);
+	    case FUTEX_WAKE:
+		if (val < 0) {
+			return EINVAL;
+		}
+		return futex_wake(addr, val, retval);
+	}
+	return EINVAL;
+}
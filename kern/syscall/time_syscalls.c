@@ -28,7 +28,10 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
 #include <clock.h>
+#include <callout.h>
 #include <copyinout.h>
 #include <syscall.h>
 
@@ -56,3 +59,37 @@ sys___time(userptr_t user_seconds_ptr, userptr_t user_nanoseconds_ptr)
 
 	return 0;
 }
+
+/*
+ * Sleep for the requested time, rounded up to whole hardclocks.
+ *
+ * Nothing interrupts a sleep in OS/161, so the remaining time is
+ * always zero and REM is never written.
+ */
+int
+sys_nanosleep(const_userptr_t user_req, userptr_t user_rem)
+{
+	struct timespec ts;
+	unsigned ticks;
+	int result;
+
+	(void)user_rem;
+
+	result = copyin(user_req, &ts, sizeof(ts));
+	if (result) {
+		return result;
+	}
+	if (ts.tv_sec < 0 || ts.tv_nsec < 0 || ts.tv_nsec >= 1000000000) {
+		return EINVAL;
+	}
+
+	/* Cap it well short of overflowing the wheel arithmetic. */
+	if (ts.tv_sec > 0x7fffffff / HZ - 1) {
+		ts.tv_sec = 0x7fffffff / HZ - 1;
+	}
+	ticks = ts.tv_sec * HZ + DIVROUNDUP(ts.tv_nsec, 1000000000 / HZ);
+	if (ticks > 0) {
+		clock_sleepticks(ticks);
+	}
+	return 0;
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+/*
+ * Memory hint syscalls: madvise, mincore, mlock, munlock.
+ *
+ * The real work is done on the address space by the as_* helpers in
+ * vm/addrspace.c; these just check and translate the arguments.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <proc.h>
+#include <copyinout.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <syscall.h>
+
+/* mincore results are copied out this many pages at a time */
+#define MINCORE_CHUNK 64
+
+int
+sys_madvise(userptr_t addr, size_t len, int advice)
+{
+	struct addrspace *as;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+	return as_advise(as, (vaddr_t)addr, len, advice);
+}
+
+int
+sys_mincore(userptr_t addr, size_t len, userptr_t vec)
+{
+	unsigned char buf[MINCORE_CHUNK];
+	struct addrspace *as;
+	vaddr_t vaddr;
+	size_t npages, n;
+	int result;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+
+	vaddr = (vaddr_t)addr;
+	if (len > USERSPACETOP) {
+		return ENOMEM;
+	}
+	npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+	if (npages == 0) {
+		return EINVAL;
+	}
+
+	while (npages > 0) {
+		n = npages < MINCORE_CHUNK ? npages : MINCORE_CHUNK;
+		result = as_mincore(as, vaddr, n, buf);
+		if (result) {
+			return result;
+		}
+		result = copyout(buf, vec, n);
+		if (result) {
+			return result;
+		}
+		vaddr += n * PAGE_SIZE;
+		vec += n;
+		npages -= n;
+	}
+	return 0;
+}
+
+int
+sys_mlock(userptr_t addr, size_t len)
+{
+	struct addrspace *as;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+	return as_lock(as, (vaddr_t)addr, len, 1);
+}
+
+int
+sys_munlock(userptr_t addr, size_t len)
+{
+	struct addrspace *as;
+
+	as = proc_getas();
+	if (as == NULL) {
+		return EFAULT;
+	}
+	return as_lock(as, (vaddr_t)addr, len, 0);
+}
@@ -0,0 +1,330 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Test code for callouts and timed waits.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <clock.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <thread.h>
+#include <callout.h>
+#include <test.h>
+
+#define CO_NCALLOUTS 5
+
+/* Delays, in order; far enough apart to be told apart, and one past
+   the end of the first level of the wheel. */
+static const unsigned co_delays[CO_NCALLOUTS] = { 1, 3, 20, 70, 150 };
+
+static struct callout co_callouts[CO_NCALLOUTS];
+static struct callout co_cancelled;
+static struct semaphore *co_sem;
+static struct spinlock co_lock = SPINLOCK_INITIALIZER;
+static unsigned co_order[CO_NCALLOUTS];
+static unsigned co_fired;
+
+/* Wheel times to start the boundary test at: just short of a level-1
+   block, a top-level block, and the 32-bit wrap. */
+static const uint32_t co_starts[] = { 0x3e, 0x00fffffd, 0xfffffffd };
+static const unsigned co_bdelays[CO_NCALLOUTS] = { 1, 3, 5, 70, 300 };
+static unsigned co_firedat[CO_NCALLOUTS];
+static unsigned co_tick;
+
+/* Threads and rounds for the migration test, and its delays. */
+#define CO_NMIGRATORS 4
+#define CO_MIGRATEROUNDS 40
+#define CO_MAXDELAY 20
+/* Allowed lateness, in ticks; a lost stretched tick is far worse. */
+#define CO_SLACK 10
+
+static struct semaphore *co_donesem;
+static volatile unsigned co_badruns;
+
+static
+void
+co_func(void *arg)
+{
+	unsigned which = (unsigned)arg;
+
+	spinlock_acquire(&co_lock);
+	if (co_fired < CO_NCALLOUTS) {
+		co_order[co_fired] = which;
+	}
+	co_fired++;
+	spinlock_release(&co_lock);
+	V(co_sem);
+}
+
+static
+bool
+co_runcallouts(void)
+{
+	unsigned i;
+	int spl;
+	bool ok = true;
+
+	co_fired = 0;
+
+	/*
+	 * Schedule them backwards, to make sure the order comes out.
+	 * Keep interrupts off so they all go on the same cpu's wheel.
+	 */
+	spl = splhigh();
+	for (i=CO_NCALLOUTS; i-- > 0; ) {
+		callout_init(&co_callouts[i], co_func, (void *)i);
+		callout_schedule(&co_callouts[i], co_delays[i]);
+	}
+	callout_init(&co_cancelled, co_func, (void *)CO_NCALLOUTS);
+	callout_schedule(&co_cancelled, 10);
+	if (!callout_stop(&co_cancelled)) {
+		kprintf("callout_stop didn't find a pending callout\n");
+		ok = false;
+	}
+	splx(spl);
+
+	for (i=0; i<CO_NCALLOUTS; i++) {
+		P(co_sem);
+	}
+	/* Give the cancelled one time to show up if it's going to. */
+	clock_sleepticks(20);
+
+	if (co_fired != CO_NCALLOUTS) {
+		kprintf("%u callouts ran; expected %u\n",
+			co_fired, CO_NCALLOUTS);
+		ok = false;
+	}
+	for (i=0; i<CO_NCALLOUTS; i++) {
+		if (co_order[i] != i) {
+			kprintf("callout %u ran in position %u\n",
+				co_order[i], i);
+			ok = false;
+		}
+	}
+	return ok;
+}
+
+static
+void
+co_recordfunc(void *arg)
+{
+	co_firedat[(unsigned)arg] = co_tick;
+}
+
+/*
+ * Run a private wheel by hand across level boundaries and check that
+ * each callout runs on exactly the right tick.
+ */
+static
+bool
+co_boundaries(void)
+{
+	struct callwheel *cw;
+	unsigned i, j;
+	bool ok = true;
+
+	cw = callwheel_create();
+	if (cw == NULL) {
+		panic("callouttest: Out of memory\n");
+	}
+
+	for (i=0; i<sizeof(co_starts)/sizeof(co_starts[0]); i++) {
+		callwheel_settime(cw, co_starts[i]);
+		for (j=0; j<CO_NCALLOUTS; j++) {
+			co_firedat[j] = 0;
+			callout_init(&co_callouts[j], co_recordfunc,
+				     (void *)j);
+			callwheel_schedule(cw, &co_callouts[j],
+					   co_bdelays[j]);
+		}
+		for (co_tick = 1; co_tick <= co_bdelays[CO_NCALLOUTS-1];
+		     co_tick++) {
+			callwheel_advance(cw, 1);
+		}
+		for (j=0; j<CO_NCALLOUTS; j++) {
+			callout_stop(&co_callouts[j]);
+			if (co_firedat[j] != co_bdelays[j]) {
+				kprintf("From 0x%x, callout due after %u "
+					"ran after %u\n",
+					(unsigned)co_starts[i],
+					co_bdelays[j], co_firedat[j]);
+				ok = false;
+			}
+		}
+	}
+
+	callwheel_destroy(cw);
+	return ok;
+}
+
+static
+void
+co_migratefunc(void *arg)
+{
+	V((struct semaphore *)arg);
+}
+
+/*
+ * Schedule callouts from threads that are being pushed from cpu to
+ * cpu, so some get scheduled just as their thread moves; each must
+ * still take about as long as asked.
+ */
+static
+void
+co_migrator(void *vsem, unsigned long num)
+{
+	struct semaphore *sem = vsem;
+	struct callout co;
+	unsigned i, delay;
+	uint32_t start, elapsed;
+
+	callout_init(&co, co_migratefunc, sem);
+	for (i=0; i<CO_MIGRATEROUNDS; i++) {
+		/* Hop somewhere else, then let the scheduler have us. */
+		if (thread_setaffinity((uint32_t)1 << ((i + num) % 4))) {
+			thread_setaffinity(1);
+		}
+		thread_setaffinity(THREAD_ANYCPU);
+
+		delay = 1 + random() % CO_MAXDELAY;
+		start = clock_ticks;
+		callout_schedule(&co, delay);
+		P(sem);
+		elapsed = clock_ticks - start;
+		if (elapsed + 1 < delay || elapsed > delay + CO_SLACK) {
+			kprintf("Thread %lu: callout due after %u ran "
+				"after %u\n", num, delay, (unsigned)elapsed);
+			spinlock_acquire(&co_lock);
+			co_badruns++;
+			spinlock_release(&co_lock);
+		}
+	}
+	/* Make sure it's done with CO before our stack goes away. */
+	callout_stop(&co);
+	sem_destroy(sem);
+	V(co_donesem);
+}
+
+static
+bool
+co_migrate(void)
+{
+	struct semaphore *sem;
+	unsigned i;
+	int result;
+
+	co_donesem = sem_create("comigrate", 0);
+	if (co_donesem == NULL) {
+		panic("callouttest: Out of memory\n");
+	}
+	co_badruns = 0;
+
+	for (i=0; i<CO_NMIGRATORS; i++) {
+		sem = sem_create("comigrator", 0);
+		if (sem == NULL) {
+			panic("callouttest: Out of memory\n");
+		}
+		result = thread_fork("comigrator", NULL, co_migrator,
+				     sem, i);
+		if (result) {
+			panic("callouttest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<CO_NMIGRATORS; i++) {
+		P(co_donesem);
+	}
+	sem_destroy(co_donesem);
+
+	return co_badruns == 0;
+}
+
+static
+bool
+co_timedwait(void)
+{
+	struct lock *lk;
+	struct cv *cv;
+	uint32_t start, elapsed;
+	int result;
+	bool ok = true;
+
+	lk = lock_create("cotest");
+	cv = cv_create("cotest");
+	if (lk == NULL || cv == NULL) {
+		panic("callouttest: Out of memory\n");
+	}
+
+	lock_acquire(lk);
+	start = clock_ticks;
+	result = cv_timedwait(cv, lk, 25);
+	elapsed = clock_ticks - start;
+	lock_release(lk);
+
+	if (result != ETIMEDOUT) {
+		kprintf("cv_timedwait returned %d; expected ETIMEDOUT\n",
+			result);
+		ok = false;
+	}
+	kprintf("cv_timedwait for 25 ticks took %u\n", elapsed);
+
+	cv_destroy(cv);
+	lock_destroy(lk);
+	return ok;
+}
+
+int
+callouttest(int nargs, char **args)
+{
+	bool ok;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting callout test...\n");
+
+	co_sem = sem_create("cotest", 0);
+	if (co_sem == NULL) {
+		panic("callouttest: Out of memory\n");
+	}
+
+	ok = co_runcallouts();
+	ok = co_boundaries() && ok;
+	ok = co_migrate() && ok;
+	ok = co_timedwait() && ok;
+
+	sem_destroy(co_sem);
+
+	kprintf("Callout test %s\n", ok ? "done" : "FAILED");
+	return 0;
+}
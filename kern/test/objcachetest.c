@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Test code for object caches.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <objcache.h>
+#include <test.h>
+
+#define OC_NOBJS   300
+#define OC_MAGIC   0x0bc0ffee
+
+struct octestobj {
+	uint32_t magic;		/* set by the constructor */
+	unsigned owner;		/* set by the user */
+	char pad[40];
+};
+
+static unsigned octest_constructed;
+
+static
+int
+octest_ctor(void *obj)
+{
+	struct octestobj *o = obj;
+
+	o->magic = OC_MAGIC;
+	octest_constructed++;
+	return 0;
+}
+
+static
+void
+octest_dtor(void *obj)
+{
+	struct octestobj *o = obj;
+
+	KASSERT(o->magic == OC_MAGIC);
+	o->magic = 0;
+	octest_constructed--;
+}
+
+static struct objcache octest_cache =
+	OBJCACHE_INITIALIZER("octest", sizeof(struct octestobj),
+			     octest_ctor, octest_dtor);
+
+static struct octestobj *octest_objs[OC_NOBJS];
+
+static
+int
+octest_fill(unsigned from, unsigned to)
+{
+	unsigned i;
+
+	for (i=from; i<to; i++) {
+		octest_objs[i] = objcache_alloc(&octest_cache);
+		if (octest_objs[i] == NULL) {
+			kprintf("objcache_alloc returned NULL; "
+				"test failed.\n");
+			return ENOMEM;
+		}
+		if (octest_objs[i]->magic != OC_MAGIC) {
+			panic("octest: object %u not constructed\n", i);
+		}
+		octest_objs[i]->owner = i;
+	}
+	return 0;
+}
+
+static
+void
+octest_check(unsigned from, unsigned to)
+{
+	unsigned i;
+
+	for (i=from; i<to; i++) {
+		if (octest_objs[i]->owner != i) {
+			panic("octest: object %u handed out twice\n", i);
+		}
+	}
+}
+
+int
+objcachetest(int nargs, char **args)
+{
+	unsigned i;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting objcache test...\n");
+
+	/* Enough objects to need several slabs. */
+	if (octest_fill(0, OC_NOBJS)) {
+		return 0;
+	}
+	octest_check(0, OC_NOBJS);
+
+	/* Free every other one, and get them back. */
+	for (i=0; i<OC_NOBJS; i+=2) {
+		objcache_free(&octest_cache, octest_objs[i]);
+	}
+	for (i=0; i<OC_NOBJS; i+=2) {
+		if (octest_fill(i, i+1)) {
+			return 0;
+		}
+	}
+	octest_check(0, OC_NOBJS);
+
+	for (i=0; i<OC_NOBJS; i++) {
+		objcache_free(&octest_cache, octest_objs[i]);
+	}
+
+	objcache_printstats();
+	kprintf("%u objects still constructed (at most one slab's worth)\n",
+		octest_constructed);
+	kprintf("objcache test done\n");
+
+	return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Pid allocator test.
+ *
+ * Allocates and releases pids over and over, from the kernel
+ * process, so the allocator runs through every chunk of the table and
+ * wraps around at least once, while holding on to a few pids spread
+ * through the range. Released pids must come back, and the ones held
+ * must never be handed out again while they're in use.
+ */
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/wait.h>
+#include <limits.h>
+#include <lib.h>
+#include <bitmap.h>
+#include <pid.h>
+#include <test.h>
+
+#define NROUNDS   (2 * PID_MAX)
+#define NKEEP     32
+#define KEEPEVERY 997
+
+int
+pidtest(int nargs, char **args)
+{
+	struct bitmap *live, *freed;
+	pid_t keep[NKEEP];
+	pid_t pid, prev, ret;
+	unsigned nkeep, wraps, reused, i;
+	int result;
+	bool ok = true;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting pid allocator test...\n");
+
+	live = bitmap_create(PID_MAX + 1);
+	freed = bitmap_create(PID_MAX + 1);
+	if (live == NULL || freed == NULL) {
+		panic("pidtest: Out of memory\n");
+	}
+
+	nkeep = wraps = reused = 0;
+	prev = INVALID_PID;
+	for (i=0; i<NROUNDS; i++) {
+		result = pid_alloc(&pid);
+		if (result) {
+			kprintf("pid_alloc: %s\n", strerror(result));
+			ok = false;
+			break;
+		}
+		if (pid < PID_MIN || pid > PID_MAX) {
+			kprintf("Got out of range pid %d\n", pid);
+			ok = false;
+			break;
+		}
+		if (bitmap_isset(live, pid)) {
+			kprintf("Got pid %d, which is still in use\n", pid);
+			ok = false;
+			break;
+		}
+		if (pid < prev) {
+			wraps++;
+		}
+		prev = pid;
+
+		if (i % KEEPEVERY == 0 && nkeep < NKEEP) {
+			bitmap_mark(live, pid);
+			keep[nkeep++] = pid;
+			continue;
+		}
+
+		if (bitmap_isset(freed, pid)) {
+			reused++;
+		}
+		else {
+			bitmap_mark(freed, pid);
+		}
+		pid_unalloc(pid);
+
+		/* It should be gone now. */
+		if (pid_wait(pid, NULL, WNOHANG, &ret) != ESRCH) {
+			kprintf("Pid %d still there after release\n", pid);
+			ok = false;
+		}
+	}
+
+	/* The ones we kept should still be ours, and not exited. */
+	for (i=0; i<nkeep; i++) {
+		ret = INVALID_PID;
+		result = pid_wait(keep[i], NULL, WNOHANG, &ret);
+		if (result || ret != 0) {
+			kprintf("Kept pid %d: wait gave %d/%d\n", keep[i],
+				result, ret);
+			ok = false;
+		}
+		pid_unalloc(keep[i]);
+	}
+
+	if (ok && wraps == 0) {
+		kprintf("Allocator never wrapped around\n");
+		ok = false;
+	}
+	if (ok && reused == 0) {
+		kprintf("No released pid was ever reused\n");
+		ok = false;
+	}
+
+	bitmap_destroy(freed);
+	bitmap_destroy(live);
+
+	kprintf("%u pids kept, %u wraps, %u reused\n", nkeep, wraps, reused);
+	kprintf("Pid allocator test %s\n", ok ? "done" : "FAILED");
+	return 0;
+}
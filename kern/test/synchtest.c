@@ -35,7 +35,9 @@
 #include <kern/wait.h>
 #include <lib.h>
 #include <clock.h>
+#include <callout.h>
 #include <thread.h>
+#include <spinlock.h>
 #include <synch.h>
 #include <test.h>
 
@@ -51,6 +53,11 @@ static struct semaphore *testsem;
 static struct lock *testlock;
 static struct cv *testcv;
 static struct semaphore *donesem;
+static struct rwlock *testrwlock;
+static struct semaphore *rwinsem;
+static struct semaphore *rwgosem;
+static volatile unsigned rwwriters;
+static volatile bool rwgotread, rwgotwrite;
 
 static
 void
@@ -80,6 +87,24 @@ inititems(void)
 			panic("synchtest: sem_create failed\n");
 		}
 	}
+	if (testrwlock==NULL) {
+		testrwlock = rwlock_create("testrwlock");
+		if (testrwlock == NULL) {
+			panic("synchtest: rwlock_create failed\n");
+		}
+	}
+	if (rwinsem==NULL) {
+		rwinsem = sem_create("rwinsem", 0);
+		if (rwinsem == NULL) {
+			panic("synchtest: sem_create failed\n");
+		}
+	}
+	if (rwgosem==NULL) {
+		rwgosem = sem_create("rwgosem", 0);
+		if (rwgosem == NULL) {
+			panic("synchtest: sem_create failed\n");
+		}
+	}
 }
 
 static
@@ -297,3 +322,514 @@ cvtest(int nargs, char **args)
 
 	return 0;
 }
+
+/*
+ * Reader-writer lock test.
+ */
+
+static
+void
+rwfail(unsigned long num, const char *msg)
+{
+	kprintf("thread %lu: %s\n", num, msg);
+	kprintf("Test failed\n");
+	V(donesem);
+	thread_exit();
+}
+
+/*
+ * Readers that all get in together: each says so, then holds on
+ * until told to go.
+ */
+static
+void
+rwsharethread(void *junk, unsigned long num)
+{
+	(void)junk;
+	(void)num;
+
+	rwlock_acquire_read(testrwlock);
+	V(rwinsem);
+	P(rwgosem);
+	rwlock_release_read(testrwlock);
+	V(donesem);
+}
+
+/*
+ * Even threads write the test values, odd threads check them; a
+ * writer must find nobody else inside, and a reader no writer.
+ */
+static
+void
+rwmixthread(void *junk, unsigned long num)
+{
+	int i;
+	(void)junk;
+
+	for (i=0; i<NLOCKLOOPS; i++) {
+		if (num % 2 == 0) {
+			rwlock_acquire_write(testrwlock);
+			if (rwwriters != 0) {
+				rwlock_release_write(testrwlock);
+				rwfail(num, "two writers inside");
+			}
+			rwwriters++;
+			testval1 = num;
+			thread_yield();
+			testval2 = num*num;
+			if (testval1 != num) {
+				rwlock_release_write(testrwlock);
+				rwfail(num, "testval1 changed under a writer");
+			}
+			rwwriters--;
+			rwlock_release_write(testrwlock);
+		}
+		else {
+			rwlock_acquire_read(testrwlock);
+			if (rwwriters != 0) {
+				rwlock_release_read(testrwlock);
+				rwfail(num, "reader inside with a writer");
+			}
+			if (testval2 != testval1*testval1) {
+				rwlock_release_read(testrwlock);
+				rwfail(num, "reader saw a half-done write");
+			}
+			rwlock_release_read(testrwlock);
+		}
+	}
+	V(donesem);
+}
+
+static
+void
+rwwaitwriter(void *junk, unsigned long num)
+{
+	(void)junk;
+
+	rwlock_acquire_write(testrwlock);
+	rwgotwrite = true;
+	if (rwgotread) {
+		rwlock_release_write(testrwlock);
+		rwfail(num, "a later reader went ahead of a waiting writer");
+	}
+	rwlock_release_write(testrwlock);
+	V(donesem);
+}
+
+static
+void
+rwwaitreader(void *junk, unsigned long num)
+{
+	(void)junk;
+
+	rwlock_acquire_read(testrwlock);
+	rwgotread = true;
+	if (!rwgotwrite) {
+		rwlock_release_read(testrwlock);
+		rwfail(num, "reader got in ahead of a waiting writer");
+	}
+	rwlock_release_read(testrwlock);
+	V(donesem);
+}
+
+static
+void
+rwfork(const char *name, void (*func)(void *, unsigned long),
+       unsigned long num)
+{
+	int result;
+
+	result = thread_fork(name, NULL, func, NULL, num);
+	if (result) {
+		panic("rwlocktest: thread_fork failed: %s\n",
+		      strerror(result));
+	}
+}
+
+int
+rwlocktest(int nargs, char **args)
+{
+	int i;
+	bool ok = true;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting rwlock test...\n");
+
+	/* The try variants, from one thread, so they mustn't sleep. */
+	rwlock_acquire_read(testrwlock);
+	if (!rwlock_tryacquire_read(testrwlock)) {
+		kprintf("tryacquire_read failed against a reader\n");
+		ok = false;
+	}
+	else {
+		rwlock_release_read(testrwlock);
+	}
+	if (rwlock_tryacquire_write(testrwlock)) {
+		kprintf("tryacquire_write succeeded against a reader\n");
+		rwlock_release_write(testrwlock);
+		ok = false;
+	}
+	rwlock_release_read(testrwlock);
+	rwlock_acquire_write(testrwlock);
+	if (rwlock_tryacquire_read(testrwlock)) {
+		kprintf("tryacquire_read succeeded against a writer\n");
+		rwlock_release_read(testrwlock);
+		ok = false;
+	}
+	if (rwlock_tryacquire_write(testrwlock)) {
+		kprintf("tryacquire_write succeeded against a writer\n");
+		rwlock_release_write(testrwlock);
+		ok = false;
+	}
+	rwlock_release_write(testrwlock);
+
+	/* All the readers at once, with us reading too. */
+	kprintf("If this hangs, readers are excluding each other: ");
+	rwlock_acquire_read(testrwlock);
+	for (i=0; i<NTHREADS; i++) {
+		rwfork("rwshare", rwsharethread, i);
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(rwinsem);
+	}
+	rwlock_release_read(testrwlock);
+	for (i=0; i<NTHREADS; i++) {
+		V(rwgosem);
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+	kprintf("ok\n");
+
+	/* Writers and readers mixed. */
+	testval1 = 0;
+	testval2 = 0;
+	rwwriters = 0;
+	for (i=0; i<NTHREADS; i++) {
+		rwfork("rwmix", rwmixthread, i);
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+
+	/*
+	 * A writer waiting behind our read lock has to hold off a
+	 * reader that comes after it.
+	 */
+	rwgotread = rwgotwrite = false;
+	rwlock_acquire_read(testrwlock);
+	rwfork("rwwriter", rwwaitwriter, 0);
+	while (testrwlock->rwl_writerswaiting == 0) {
+		clock_sleepticks(1);
+	}
+	if (rwlock_tryacquire_read(testrwlock)) {
+		kprintf("tryacquire_read went ahead of a waiting writer\n");
+		rwlock_release_read(testrwlock);
+		ok = false;
+	}
+	rwfork("rwreader", rwwaitreader, 1);
+	clock_sleepticks(5);
+	if (rwgotread || rwgotwrite) {
+		kprintf("rwlock let someone in past a reader and a "
+			"waiting writer\n");
+		ok = false;
+	}
+	rwlock_release_read(testrwlock);
+	P(donesem);
+	P(donesem);
+
+	kprintf("Rwlock test %s\n", ok ? "done" : "FAILED");
+	return 0;
+}
+
+/*
+ * FIFO semaphore test: waiters that went to sleep in order must be
+ * let through in that order.
+ */
+
+static struct semaphore *fifosem;
+static struct semaphore *fifoready;
+static struct spinlock fifolock = SPINLOCK_INITIALIZER;
+static unsigned fifoorder[NTHREADS];
+static unsigned fifonext;
+
+static
+void
+fifothread(void *junk, unsigned long num)
+{
+	(void)junk;
+
+	V(fifoready);
+	P(fifosem);
+	spinlock_acquire(&fifolock);
+	fifoorder[fifonext++] = num;
+	spinlock_release(&fifolock);
+	V(donesem);
+}
+
+int
+fifosemtest(int nargs, char **args)
+{
+	int i, result;
+	bool ok = true;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting FIFO semaphore test...\n");
+
+	fifosem = sem_create_fifo("fifosem", 0);
+	fifoready = sem_create("fifoready", 0);
+	if (fifosem == NULL || fifoready == NULL) {
+		panic("fifosemtest: sem_create failed\n");
+	}
+	fifonext = 0;
+
+	/* Start them one at a time, each asleep before the next. */
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("fifotest", NULL, fifothread, NULL, i);
+		if (result) {
+			panic("fifosemtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+		P(fifoready);
+		clock_sleepticks(1);
+	}
+
+	for (i=0; i<NTHREADS; i++) {
+		V(fifosem);
+		P(donesem);
+	}
+	for (i=0; i<NTHREADS; i++) {
+		if (fifoorder[i] != (unsigned)i) {
+			kprintf("Thread %u got through in place %d\n",
+				fifoorder[i], i);
+			ok = false;
+		}
+	}
+
+	sem_destroy(fifoready);
+	sem_destroy(fifosem);
+
+	kprintf("FIFO semaphore test %s\n", ok ? "done" : "FAILED");
+	return 0;
+}
+
+/*
+ * Wait morphing test: cv_signal and cv_broadcast from the lock holder
+ * move waiters straight onto the lock. Each must come out of cv_wait
+ * holding the lock, and none may be lost on the way.
+ */
+
+static struct lock *morphlock;
+static struct cv *morphcv;
+static volatile unsigned morphwaiting, morphtokens, morphwoken;
+static volatile bool morphbad;
+
+static
+void
+morphthread(void *junk, unsigned long num)
+{
+	(void)junk;
+
+	lock_acquire(morphlock);
+	morphwaiting++;
+	while (morphtokens == 0) {
+		cv_wait(morphcv, morphlock);
+		if (!lock_do_i_hold(morphlock)) {
+			kprintf("Thread %lu: back from cv_wait without "
+				"the lock\n", num);
+			morphbad = true;
+			V(donesem);
+			thread_exit();
+		}
+	}
+	morphtokens--;
+	morphwoken++;
+	lock_release(morphlock);
+	V(donesem);
+}
+
+int
+morphtest(int nargs, char **args)
+{
+	int i, result;
+	unsigned woken;
+	bool ok = true;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting CV wait morphing test...\n");
+	kprintf("If this hangs, a wakeup was lost.\n");
+
+	morphlock = lock_create("morphlock");
+	morphcv = cv_create("morphcv");
+	if (morphlock == NULL || morphcv == NULL) {
+		panic("morphtest: Out of memory\n");
+	}
+	morphwaiting = morphtokens = morphwoken = 0;
+	morphbad = false;
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("morphtest", NULL, morphthread, NULL, i);
+		if (result) {
+			panic("morphtest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+
+	/*
+	 * Once they've all counted themselves, they're all on the CV:
+	 * each is queued before cv_wait lets go of the lock.
+	 */
+	lock_acquire(morphlock);
+	while (morphwaiting < NTHREADS) {
+		lock_release(morphlock);
+		clock_sleepticks(1);
+		lock_acquire(morphlock);
+	}
+
+	/* Half one at a time... */
+	for (i=0; i<NTHREADS/2; i++) {
+		morphtokens++;
+		cv_signal(morphcv, morphlock);
+		woken = morphwoken;
+		lock_release(morphlock);
+		P(donesem);
+		lock_acquire(morphlock);
+		if (morphwoken != woken + 1) {
+			kprintf("cv_signal let %u threads through\n",
+				morphwoken - woken);
+			ok = false;
+		}
+	}
+
+	/* ...and the rest all at once. */
+	morphtokens += NTHREADS - NTHREADS/2;
+	cv_broadcast(morphcv, morphlock);
+	if (morphwoken != NTHREADS/2) {
+		kprintf("A waiter ran while we held the lock\n");
+		ok = false;
+	}
+	lock_release(morphlock);
+	for (i=NTHREADS/2; i<NTHREADS; i++) {
+		P(donesem);
+	}
+	if (morphwoken != NTHREADS || morphtokens != 0 || morphbad) {
+		ok = false;
+	}
+
+	cv_destroy(morphcv);
+	lock_destroy(morphlock);
+
+	kprintf("CV wait morphing test %s\n", ok ? "done" : "FAILED");
+	return 0;
+}
+
+/*
+ * Spinlock test: threads spread over the CPUs bump a counter with a
+ * deliberately slow read-modify-write under one spinlock. Which
+ * acquire path this exercises, ticket or test-and-set with backoff,
+ * depends on whether the kernel was built with the ticketlock option.
+ */
+
+#define SPINLOCKLOOPS 5000
+
+static struct spinlock spintestlock = SPINLOCK_INITIALIZER;
+static volatile unsigned long spincount;
+static volatile bool spininside;
+static volatile bool spinbad;
+
+static
+void
+spinthread(void *junk, unsigned long num)
+{
+	unsigned long val;
+	volatile int spinwaste = 0;
+	int i, j;
+
+	(void)junk;
+
+	/* Fails for CPUs that don't exist; then just run anywhere. */
+	thread_setaffinity((uint32_t)1 << (num % 32));
+
+	for (i=0; i<SPINLOCKLOOPS; i++) {
+		spinlock_acquire(&spintestlock);
+		if (spininside || !spinlock_do_i_hold(&spintestlock)) {
+			spinbad = true;
+		}
+		spininside = true;
+		val = spincount;
+		/* Widen the window a bit; can't sleep in here. */
+		for (j=0; j<(int)(num % 8) * 10; j++) {
+			spinwaste++;
+		}
+		spincount = val + 1;
+		spininside = false;
+		spinlock_release(&spintestlock);
+	}
+
+	thread_setaffinity(THREAD_ANYCPU);
+	V(donesem);
+}
+
+int
+spinlocktest(int nargs, char **args)
+{
+	int i, result;
+	bool ok = true;
+
+	(void)nargs;
+	(void)args;
+
+	inititems();
+	kprintf("Starting spinlock test (%s)...\n",
+		OPT_TICKETLOCK ? "ticket" : "test-and-set");
+
+	spincount = 0;
+	spininside = false;
+	spinbad = false;
+
+	for (i=0; i<NTHREADS; i++) {
+		result = thread_fork("spinlocktest", NULL, spinthread, NULL, i);
+		if (result) {
+			panic("spinlocktest: thread_fork failed: %s\n",
+			      strerror(result));
+		}
+	}
+	for (i=0; i<NTHREADS; i++) {
+		P(donesem);
+	}
+
+	if (spinbad) {
+		kprintf("Two threads held the spinlock at once\n");
+		ok = false;
+	}
+	if (spincount != (unsigned long)NTHREADS * SPINLOCKLOOPS) {
+		kprintf("Counter is %lu, expected %lu\n", spincount,
+			(unsigned long)NTHREADS * SPINLOCKLOOPS);
+		ok = false;
+	}
+	/* The lock words should be back to unheld. */
+#if OPT_TICKETLOCK
+	if (spinlock_data_get(&spintestlock.splk_lock) !=
+	    spinlock_data_get(&spintestlock.splk_serving)) {
+		kprintf("Tickets issued and served don't match\n");
+		ok = false;
+	}
+#else
+	if (spinlock_data_get(&spintestlock.splk_lock) != 0) {
+		kprintf("Lock word still set\n");
+		ok = false;
+	}
+#endif
+
+	kprintf("Spinlock test %s\n", ok ? "done" : "FAILED");
+	return 0;
+}
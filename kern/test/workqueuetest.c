@@ -0,0 +1,274 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+
+/*
+ * Test code for work queues.
+ */
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <workqueue.h>
+#include <test.h>
+
+#define WQ_NWORK 5
+
+/* Delay for work_schedule; long enough to tell from work_queue. */
+#define WQ_DELAY 20
+
+static struct work wq_work[WQ_NWORK];
+static struct work wq_cancelled;
+static struct semaphore *wq_sem;
+static struct spinlock wq_lock = SPINLOCK_INITIALIZER;
+static unsigned wq_order[WQ_NWORK];
+static unsigned wq_ran;
+static volatile bool wq_done;
+
+/* Work that frees itself. */
+struct wq_selffree {
+	struct work sf_work;
+	unsigned sf_magic;
+};
+#define WQ_MAGIC 0x5e1ff4ee
+
+static
+void
+wq_func(void *arg)
+{
+	unsigned which = (unsigned)arg;
+
+	spinlock_acquire(&wq_lock);
+	if (wq_ran < WQ_NWORK) {
+		wq_order[wq_ran] = which;
+	}
+	wq_ran++;
+	spinlock_release(&wq_lock);
+	V(wq_sem);
+}
+
+/*
+ * Queue a batch and one to cancel, and check the rest run in order.
+ */
+static
+bool
+wq_runwork(void)
+{
+	unsigned i;
+	int spl;
+	bool ok = true;
+
+	wq_ran = 0;
+
+	/*
+	 * Keep interrupts off so they all go on the same cpu's queue
+	 * and the worker can't start on them until we're done.
+	 */
+	spl = splhigh();
+	for (i=0; i<WQ_NWORK; i++) {
+		work_init(&wq_work[i], wq_func, (void *)i);
+		if (!work_queue(&wq_work[i])) {
+			kprintf("work_queue refused idle work %u\n", i);
+			ok = false;
+		}
+	}
+	if (work_queue(&wq_work[0])) {
+		kprintf("work_queue accepted work already queued\n");
+		ok = false;
+	}
+	work_init(&wq_cancelled, wq_func, (void *)WQ_NWORK);
+	work_queue(&wq_cancelled);
+	if (!work_cancel(&wq_cancelled)) {
+		kprintf("work_cancel didn't find queued work\n");
+		ok = false;
+	}
+	splx(spl);
+
+	for (i=0; i<WQ_NWORK; i++) {
+		P(wq_sem);
+	}
+	/* Give the cancelled one time to show up if it's going to. */
+	clock_sleepticks(5);
+
+	if (wq_ran != WQ_NWORK) {
+		kprintf("%u work items ran; expected %u\n", wq_ran, WQ_NWORK);
+		ok = false;
+	}
+	for (i=0; i<WQ_NWORK; i++) {
+		if (wq_order[i] != i) {
+			kprintf("work %u ran in position %u\n",
+				wq_order[i], i);
+			ok = false;
+		}
+	}
+	if (work_cancel(&wq_work[0])) {
+		kprintf("work_cancel found work that already ran\n");
+		ok = false;
+	}
+	return ok;
+}
+
+/*
+ * Schedule one item and check it waits; schedule another and cancel
+ * it before it's due.
+ */
+static
+bool
+wq_schedule(void)
+{
+	uint32_t start, elapsed;
+	bool ok = true;
+
+	wq_ran = 0;
+
+	work_init(&wq_work[0], wq_func, (void *)0);
+	work_init(&wq_cancelled, wq_func, (void *)WQ_NWORK);
+
+	start = clock_ticks;
+	work_schedule(&wq_work[0], WQ_DELAY);
+	work_schedule(&wq_cancelled, WQ_DELAY);
+	if (!work_cancel(&wq_cancelled)) {
+		kprintf("work_cancel didn't find scheduled work\n");
+		ok = false;
+	}
+	P(wq_sem);
+	elapsed = clock_ticks - start;
+
+	clock_sleepticks(WQ_DELAY + 5);
+	if (wq_ran != 1) {
+		kprintf("%u scheduled work items ran; expected 1\n", wq_ran);
+		ok = false;
+	}
+	if (elapsed < WQ_DELAY - 1) {
+		kprintf("Work scheduled for %u ticks ran after %u\n",
+			WQ_DELAY, elapsed);
+		ok = false;
+	}
+	return ok;
+}
+
+static
+void
+wq_slowfunc(void *arg)
+{
+	(void)arg;
+
+	V(wq_sem);
+	clock_sleepticks(5);
+	wq_done = true;
+}
+
+/*
+ * work_cancel on running work should wait for it to finish.
+ */
+static
+bool
+wq_cancelrunning(void)
+{
+	bool ok = true;
+
+	wq_done = false;
+	work_init(&wq_work[0], wq_slowfunc, NULL);
+	work_queue(&wq_work[0]);
+	P(wq_sem);
+	if (work_cancel(&wq_work[0])) {
+		kprintf("work_cancel stopped work that was running\n");
+		ok = false;
+	}
+	if (!wq_done) {
+		kprintf("work_cancel returned while the work was running\n");
+		ok = false;
+	}
+	return ok;
+}
+
+static
+void
+wq_selffreefunc(void *arg)
+{
+	struct wq_selffree *sf = arg;
+
+	KASSERT(sf->sf_magic == WQ_MAGIC);
+	sf->sf_magic = 0;
+	kfree(sf);
+	V(wq_sem);
+}
+
+/*
+ * Work may free itself; the worker mustn't touch it afterwards.
+ * Queue a few so the worker goes on to the next one after each.
+ */
+static
+void
+wq_selffree(void)
+{
+	struct wq_selffree *sf;
+	unsigned i;
+
+	for (i=0; i<WQ_NWORK; i++) {
+		sf = kmalloc(sizeof(*sf));
+		if (sf == NULL) {
+			panic("workqueuetest: Out of memory\n");
+		}
+		sf->sf_magic = WQ_MAGIC;
+		work_init(&sf->sf_work, wq_selffreefunc, sf);
+		work_queue(&sf->sf_work);
+	}
+	for (i=0; i<WQ_NWORK; i++) {
+		P(wq_sem);
+	}
+}
+
+int
+workqueuetest(int nargs, char **args)
+{
+	bool ok;
+
+	(void)nargs;
+	(void)args;
+
+	kprintf("Starting work queue test...\n");
+
+	wq_sem = sem_create("wqtest", 0);
+	if (wq_sem == NULL) {
+		panic("workqueuetest: Out of memory\n");
+	}
+
+	ok = wq_runwork();
+	ok = wq_schedule() && ok;
+	ok = wq_cancelrunning() && ok;
+	wq_selffree();
+
+	sem_destroy(wq_sem);
+
+	kprintf("Work queue test %s\n", ok ? "done" : "FAILED");
+	return 0;
+}
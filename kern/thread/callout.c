@@ -0,0 +1,439 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Callouts and the per-cpu timer wheels.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spl.h>
+#include <spinlock.h>
+#include <current.h>
+#include <clock.h>
+#include <synch.h>
+#include <callout.h>
+
+/*
+ * The wheel is hierarchical: CALLOUT_LEVELS levels of CALLOUT_SLOTS
+ * slots each. Level 0 has one slot per hardclock for the current
+ * block of CALLOUT_SLOTS hardclocks; level 1 has one slot per block
+ * of CALLOUT_SLOTS hardclocks within the current block of
+ * CALLOUT_SLOTS^2; and so on. A callout goes on the lowest level
+ * whose current block contains its expiry time. Each time the wheel
+ * enters a new block at some level, the matching slot one level up
+ * is emptied and its callouts are put back, which moves them down.
+ *
+ * So scheduling and stopping are constant time, and each hardclock
+ * looks at one level-0 slot plus, now and then, one slot per level
+ * above.
+ *
+ * Callouts further off than the wheel reaches (which includes ones
+ * just past the end of the current top-level block) are parked in
+ * the next top-level slot to come round, and put back when it does.
+ *
+ * A cpu's wheel is kept in step with its c_hardclocks count, so ticks
+ * that a stretched clock accounts for outside hardclock() reach the
+ * wheel too.
+ */
+
+#define CALLOUT_SLOTBITS 6
+#define CALLOUT_SLOTS (1U << CALLOUT_SLOTBITS)
+#define CALLOUT_SLOTMASK (CALLOUT_SLOTS - 1)
+#define CALLOUT_LEVELS 4
+
+struct callwheel {
+	struct spinlock cw_lock;
+	uint32_t cw_now;		/* Hardclocks processed so far */
+	unsigned cw_count;		/* Callouts pending */
+	struct callout *cw_running;	/* Callout being run, if any */
+	struct callout *cw_slots[CALLOUT_LEVELS][CALLOUT_SLOTS];
+};
+
+/*
+ * Create a wheel for a cpu.
+ */
+struct callwheel *
+callwheel_create(void)
+{
+	struct callwheel *cw;
+	unsigned i, j;
+
+	cw = kmalloc(sizeof(*cw));
+	if (cw == NULL) {
+		return NULL;
+	}
+	spinlock_init(&cw->cw_lock);
+	spinlock_setname(&cw->cw_lock, "callwheel");
+	cw->cw_now = 0;
+	cw->cw_count = 0;
+	cw->cw_running = NULL;
+	for (i=0; i<CALLOUT_LEVELS; i++) {
+		for (j=0; j<CALLOUT_SLOTS; j++) {
+			cw->cw_slots[i][j] = NULL;
+		}
+	}
+	return cw;
+}
+
+/*
+ * Free a wheel, which must be empty.
+ */
+void
+callwheel_destroy(struct callwheel *cw)
+{
+	KASSERT(cw->cw_count == 0);
+	KASSERT(cw->cw_running == NULL);
+	spinlock_cleanup(&cw->cw_lock);
+	kfree(cw);
+}
+
+/*
+ * Set an empty wheel's clock.
+ */
+void
+callwheel_settime(struct callwheel *cw, uint32_t now)
+{
+	spinlock_acquire(&cw->cw_lock);
+	KASSERT(cw->cw_count == 0);
+	cw->cw_now = now;
+	spinlock_release(&cw->cw_lock);
+}
+
+/*
+ * Put a callout on the right slot of a wheel.
+ */
+static
+void
+callwheel_insert(struct callwheel *cw, struct callout *co)
+{
+	struct callout **slot;
+	uint32_t expire;
+	unsigned level, shift;
+
+	KASSERT(spinlock_do_i_hold(&cw->cw_lock));
+	KASSERT(!co->co_pending);
+
+	/* Expiry times are compared modulo 2^32. */
+	expire = co->co_expire;
+	if ((int32_t)(expire - cw->cw_now) < 0) {
+		expire = cw->cw_now;
+	}
+
+	for (level=0; level < CALLOUT_LEVELS; level++) {
+		shift = CALLOUT_SLOTBITS * (level + 1);
+		if ((expire >> shift) == (cw->cw_now >> shift)) {
+			break;
+		}
+	}
+	if (level == CALLOUT_LEVELS) {
+		/* Beyond the wheel; park it in the next top-level slot. */
+		level = CALLOUT_LEVELS - 1;
+		shift = CALLOUT_SLOTBITS * level;
+		expire = ((cw->cw_now >> shift) + 1) << shift;
+	}
+
+	shift = CALLOUT_SLOTBITS * level;
+	slot = &cw->cw_slots[level][(expire >> shift) & CALLOUT_SLOTMASK];
+
+	co->co_next = *slot;
+	if (co->co_next != NULL) {
+		co->co_next->co_prevp = &co->co_next;
+	}
+	co->co_prevp = slot;
+	*slot = co;
+	co->co_pending = true;
+	co->co_wheel = cw;
+	cw->cw_count++;
+}
+
+/*
+ * Take a callout off its slot.
+ */
+static
+void
+callwheel_remove(struct callwheel *cw, struct callout *co)
+{
+	KASSERT(spinlock_do_i_hold(&cw->cw_lock));
+	KASSERT(co->co_pending);
+	KASSERT(co->co_wheel == cw);
+
+	*co->co_prevp = co->co_next;
+	if (co->co_next != NULL) {
+		co->co_next->co_prevp = co->co_prevp;
+	}
+	co->co_next = NULL;
+	co->co_prevp = NULL;
+	co->co_pending = false;
+	KASSERT(cw->cw_count > 0);
+	cw->cw_count--;
+}
+
+/*
+ * Empty a slot and put its callouts back on the wheel.
+ */
+static
+void
+callwheel_cascade(struct callwheel *cw, unsigned level, unsigned index)
+{
+	struct callout *co;
+
+	while ((co = cw->cw_slots[level][index]) != NULL) {
+		callwheel_remove(cw, co);
+		callwheel_insert(cw, co);
+	}
+}
+
+void
+callout_init(struct callout *co, void (*func)(void *), void *arg)
+{
+	co->co_next = NULL;
+	co->co_prevp = NULL;
+	co->co_expire = 0;
+	co->co_pending = false;
+	co->co_wheel = NULL;
+	co->co_func = func;
+	co->co_arg = arg;
+}
+
+void
+callout_schedule(struct callout *co, unsigned ticks)
+{
+	struct callwheel *cw;
+	int spl;
+
+	if (ticks == 0) {
+		ticks = 1;
+	}
+
+	callout_stop(co);
+
+	/*
+	 * Stay on this cpu until the callout is on its wheel: the
+	 * wheel, the hardclock count, and the stretched tick all have
+	 * to be the same cpu's.
+	 */
+	spl = splhigh();
+	cw = curcpu->c_callwheel;
+	spinlock_acquire(&cw->cw_lock);
+	/* If our clock tick is stretched, it may need to be shorter now. */
+	hardclock_restore();
+	/*
+	 * Count from the cpu's hardclocks, which the wheel may not
+	 * have caught up with yet.
+	 */
+	co->co_expire = curcpu->c_hardclocks + ticks;
+	callwheel_insert(cw, co);
+	spinlock_release(&cw->cw_lock);
+	splx(spl);
+}
+
+void
+callwheel_schedule(struct callwheel *cw, struct callout *co, unsigned ticks)
+{
+	if (ticks == 0) {
+		ticks = 1;
+	}
+
+	callout_stop(co);
+
+	spinlock_acquire(&cw->cw_lock);
+	co->co_expire = cw->cw_now + ticks;
+	callwheel_insert(cw, co);
+	spinlock_release(&cw->cw_lock);
+}
+
+bool
+callout_stop(struct callout *co)
+{
+	struct callwheel *cw;
+
+	while (1) {
+		cw = co->co_wheel;
+		if (cw == NULL) {
+			return false;
+		}
+		spinlock_acquire(&cw->cw_lock);
+		if (co->co_wheel != cw) {
+			/* Finished or moved while we weren't looking */
+			spinlock_release(&cw->cw_lock);
+			continue;
+		}
+		if (co->co_pending) {
+			callwheel_remove(cw, co);
+			co->co_wheel = NULL;
+			spinlock_release(&cw->cw_lock);
+			return true;
+		}
+		/* It's running. */
+		KASSERT(cw->cw_running == co);
+		if (cw == curcpu->c_callwheel) {
+			/* ...and we must be it. */
+			spinlock_release(&cw->cw_lock);
+			return false;
+		}
+		spinlock_release(&cw->cw_lock);
+	}
+}
+
+/*
+ * Run a wheel forward until its clock reads TARGET.
+ */
+static
+void
+callwheel_advanceto(struct callwheel *cw, uint32_t target)
+{
+	struct callout *co;
+	unsigned level, index;
+
+	spinlock_acquire(&cw->cw_lock);
+	while (cw->cw_now != target) {
+		cw->cw_now++;
+		if (cw->cw_count == 0) {
+			continue;
+		}
+
+		/* Cascade down any higher-level slot we've just entered. */
+		for (level=1; level < CALLOUT_LEVELS; level++) {
+			if ((cw->cw_now &
+			     ((1U << (CALLOUT_SLOTBITS * level)) - 1)) != 0) {
+				break;
+			}
+			index = (cw->cw_now >> (CALLOUT_SLOTBITS * level))
+				& CALLOUT_SLOTMASK;
+			callwheel_cascade(cw, level, index);
+		}
+
+		index = cw->cw_now & CALLOUT_SLOTMASK;
+		while ((co = cw->cw_slots[0][index]) != NULL) {
+			callwheel_remove(cw, co);
+			if ((int32_t)(co->co_expire - cw->cw_now) > 0) {
+				/* Parked; not really due yet. */
+				callwheel_insert(cw, co);
+				continue;
+			}
+			cw->cw_running = co;
+			spinlock_release(&cw->cw_lock);
+			co->co_func(co->co_arg);
+			spinlock_acquire(&cw->cw_lock);
+			cw->cw_running = NULL;
+			if (!co->co_pending) {
+				co->co_wheel = NULL;
+			}
+		}
+	}
+	spinlock_release(&cw->cw_lock);
+}
+
+/*
+ * Bring the current cpu's wheel up to its hardclock count.
+ */
+void
+callout_hardclock(void)
+{
+	callwheel_advanceto(curcpu->c_callwheel, curcpu->c_hardclocks);
+}
+
+void
+callwheel_advance(struct callwheel *cw, unsigned ticks)
+{
+	uint32_t target;
+
+	spinlock_acquire(&cw->cw_lock);
+	target = cw->cw_now + ticks;
+	spinlock_release(&cw->cw_lock);
+
+	callwheel_advanceto(cw, target);
+}
+
+/*
+ * Return how many hardclocks the current cpu can go without one
+ * before its wheel needs attention: until the next level-0 callout
+ * if there's one in the current block, otherwise until the next block
+ * if anything is pending at all. This counts from c_hardclocks, so
+ * any ticks the wheel hasn't caught up with yet come off.
+ */
+unsigned
+callout_nexttick(void)
+{
+	struct callwheel *cw;
+	unsigned i, ret, behind;
+
+	cw = curcpu->c_callwheel;
+	spinlock_acquire(&cw->cw_lock);
+	if (cw->cw_count == 0) {
+		ret = (unsigned)-1;
+	}
+	else {
+		ret = CALLOUT_SLOTS - (cw->cw_now & CALLOUT_SLOTMASK);
+		for (i = (cw->cw_now & CALLOUT_SLOTMASK) + 1;
+		     i < CALLOUT_SLOTS; i++) {
+			if (cw->cw_slots[0][i] != NULL) {
+				ret = i - (cw->cw_now & CALLOUT_SLOTMASK);
+				break;
+			}
+		}
+		behind = curcpu->c_hardclocks - cw->cw_now;
+		ret = ret > behind ? ret - behind : 1;
+	}
+	spinlock_release(&cw->cw_lock);
+	return ret;
+}
+
+////////////////////////////////////////////////////////////
+
+static
+void
+clock_sleepticks_wake(void *vsem)
+{
+	V((struct semaphore *)vsem);
+}
+
+/*
+ * Sleep for a number of hardclocks.
+ */
+void
+clock_sleepticks(unsigned ticks)
+{
+	struct semaphore *sem;
+	struct callout co;
+
+	sem = sem_create("sleepticks", 0);
+	if (sem == NULL) {
+		/* Fall back to sleeping on lbolt. */
+		clocksleep(DIVROUNDUP(ticks, HZ));
+		return;
+	}
+	callout_init(&co, clock_sleepticks_wake, sem);
+	callout_schedule(&co, ticks);
+	P(sem);
+	callout_stop(&co);
+	sem_destroy(sem);
+}
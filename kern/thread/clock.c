@@ -34,6 +34,9 @@
 #include <clock.h>
 #include <thread.h>
 #include <current.h>
+#include <callout.h>
+#include <mainbus.h>
+#include "opt-tickless.h"
 
 /*
  * Time handling.
@@ -59,6 +62,11 @@
 static struct wchan *lbolt;
 static struct spinlock lbolt_lock;
 
+/*
+ * System-wide tick counter, advanced by CPU 0.
+ */
+volatile uint32_t clock_ticks;
+
 /*
  * Setup.
  */
@@ -85,25 +93,98 @@ timerclock(void)
 	spinlock_release(&lbolt_lock);
 }
 
+/*
+ * Advance the tick counters by TICKS hardclocks.
+ */
+static
+void
+hardclock_advance(unsigned ticks)
+{
+	curcpu->c_hardclocks += ticks;
+	if (curcpu->c_number == 0) {
+		clock_ticks += ticks;
+	}
+}
+
 /*
  * This is called HZ times a second (on each processor) by the timer
- * code.
+ * code, or less often on a cpu whose tick has been stretched; in that
+ * case it makes up for the hardclocks it missed.
  */
 void
 hardclock(void)
 {
+	unsigned ticks, prev;
+
 	/*
 	 * Collect statistics here as desired.
 	 */
 
-	curcpu->c_hardclocks++;
-	if ((curcpu->c_hardclocks % MIGRATE_HARDCLOCKS) == 0) {
+	/* The timer has already gone back to one hardclock a period. */
+	ticks = curcpu->c_tickperiod;
+	curcpu->c_tickperiod = 1;
+
+	prev = curcpu->c_hardclocks;
+	hardclock_advance(ticks);
+	callout_hardclock();
+	if (prev / MIGRATE_HARDCLOCKS !=
+	    curcpu->c_hardclocks / MIGRATE_HARDCLOCKS) {
 		thread_consider_migration();
 	}
-	if ((curcpu->c_hardclocks % SCHEDULE_HARDCLOCKS) == 0) {
+	if (prev / SCHEDULE_HARDCLOCKS !=
+	    curcpu->c_hardclocks / SCHEDULE_HARDCLOCKS) {
 		schedule();
 	}
-	thread_yield();
+	if (thread_tick(ticks)) {
+		thread_yield();
+	}
+}
+
+void
+hardclock_stretch(unsigned ticks)
+{
+#if OPT_TICKLESS
+	unsigned next, elapsed;
+
+	if (curcpu->c_number == 0) {
+		return;
+	}
+	elapsed = curcpu->c_tickperiod > 1 ? mainbus_timer_elapsed() : 0;
+
+	/* Don't sleep through a callout. */
+	next = callout_nexttick();
+	next = next > elapsed ? next - elapsed : 1;
+	if (ticks > next) {
+		ticks = next;
+	}
+
+	if (ticks <= curcpu->c_tickperiod) {
+		return;
+	}
+	/*
+	 * Reprogramming the timer loses the time so far; account for
+	 * it here. The callout wheel catches up at the next hardclock.
+	 */
+	hardclock_advance(elapsed);
+	curcpu->c_tickperiod = ticks;
+	mainbus_settimer(ticks);
+#else
+	(void)ticks;
+#endif
+}
+
+void
+hardclock_restore(void)
+{
+#if OPT_TICKLESS
+	if (curcpu->c_tickperiod == 1) {
+		return;
+	}
+	/* As above; the wheel catches up at the next hardclock. */
+	hardclock_advance(mainbus_timer_elapsed());
+	curcpu->c_tickperiod = 1;
+	mainbus_settimer(1);
+#endif
 }
 
 /*
@@ -0,0 +1,287 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Futexes.
+ *
+ * A futex is just an int in user memory. Userland does its locking
+ * with atomic operations on the int and only comes here when it has
+ * to sleep (FUTEX_WAIT) or there might be sleepers to wake
+ * (FUTEX_WAKE).
+ *
+ * Sleepers are keyed by the physical address of the int, so two
+ * processes sharing a page match as well as two threads sharing an
+ * address space. The key is hashed into a fixed table of buckets,
+ * each with a spinlock, a wait channel, and a list of the waiters
+ * sleeping there. Checking the int and joining the list both happen
+ * under the bucket lock, and so does waking, so a wakeup can't slip
+ * in between the check and the sleep.
+ *
+ * Waiters with different keys can share a bucket (and its wait
+ * channel), so futex_wake marks the waiters it means to wake and
+ * then wakes the whole channel; the others go back to sleep.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <futex.h>
+
+/* Number of hash buckets. */
+#define FUTEX_BUCKETS	64
+
+/*
+ * A thread in futex_wait. Lives on the sleeper's stack.
+ */
+struct futex_waiter {
+	paddr_t fw_key;			/* physical address waited on */
+	struct proc *fw_proc;		/* process of the sleeper */
+	int fw_result;			/* 0, or EINTR from futex_interrupt */
+	bool fw_woken;			/* taken off the list by a waker */
+	struct futex_waiter *fw_next;	/* next in bucket */
+};
+
+struct futex_bucket {
+	struct spinlock fb_lock;
+	struct wchan *fb_wchan;
+	struct futex_waiter *fb_waiters;
+	struct futex_waiter **fb_tailp;	/* Link to put new waiters on */
+};
+
+static struct futex_bucket futex_table[FUTEX_BUCKETS];
+
+/*
+ * Initialize.
+ */
+void
+futex_bootstrap(void)
+{
+	unsigned i;
+
+	for (i=0; i<FUTEX_BUCKETS; i++) {
+		spinlock_init(&futex_table[i].fb_lock);
+		futex_table[i].fb_wchan = wchan_create("futex");
+		if (futex_table[i].fb_wchan == NULL) {
+			panic("futex_bootstrap: Out of memory\n");
+		}
+		futex_table[i].fb_waiters = NULL;
+		futex_table[i].fb_tailp = &futex_table[i].fb_waiters;
+	}
+}
+
+/*
+ * Pick the bucket for KEY. Mix in the page number so that the same
+ * offset in different pages doesn't always collide.
+ */
+static
+struct futex_bucket *
+futex_bucket(paddr_t key)
+{
+	return &futex_table[((key >> 2) ^ (key >> 12)) % FUTEX_BUCKETS];
+}
+
+/*
+ * Translate user address UADDR to its key. On success the caller
+ * must as_putpaddr when done reading the int.
+ */
+static
+int
+futex_getkey(struct addrspace *as, userptr_t uaddr, paddr_t *key)
+{
+	vaddr_t va = (vaddr_t)uaddr;
+
+	if (va % sizeof(int) != 0) {
+		return EINVAL;
+	}
+	if (va >= USERSPACETOP || as == NULL) {
+		return EFAULT;
+	}
+	return as_getpaddr(as, va, key);
+}
+
+/*
+ * Take FW, which follows PREV on FB's list (or is first, if PREV is
+ * null), off the list and mark it woken with RESULT. Returns the
+ * waiter that now follows PREV.
+ */
+static
+struct futex_waiter *
+futex_unlink(struct futex_bucket *fb, struct futex_waiter *prev,
+	     struct futex_waiter *fw, int result)
+{
+	struct futex_waiter *next;
+
+	KASSERT(spinlock_do_i_hold(&fb->fb_lock));
+
+	next = fw->fw_next;
+	if (prev == NULL) {
+		fb->fb_waiters = next;
+	}
+	else {
+		prev->fw_next = next;
+	}
+	if (fb->fb_tailp == &fw->fw_next) {
+		fb->fb_tailp = prev == NULL ? &fb->fb_waiters : &prev->fw_next;
+	}
+	fw->fw_next = NULL;
+	fw->fw_result = result;
+	fw->fw_woken = true;
+	return next;
+}
+
+int
+futex_wait(userptr_t uaddr, int val)
+{
+	struct addrspace *as;
+	struct futex_bucket *fb;
+	struct futex_waiter fw;
+	paddr_t key;
+	int result;
+
+	as = proc_getas();
+	result = futex_getkey(as, uaddr, &key);
+	if (result) {
+		return result;
+	}
+	fb = futex_bucket(key);
+
+	fw.fw_key = key;
+	fw.fw_proc = curproc;
+	fw.fw_result = 0;
+	fw.fw_woken = false;
+
+	/*
+	 * The frame is held, so read the int through the direct map;
+	 * that can't fault, which it mustn't under a spinlock.
+	 */
+	spinlock_acquire(&fb->fb_lock);
+	if (curproc->p_exiting) {
+		result = EINTR;
+	}
+	else if (*(volatile int *)PADDR_TO_KVADDR(key) != val) {
+		result = EAGAIN;
+	}
+	else {
+		/* At the end, so wakes go in arrival order. */
+		fw.fw_next = NULL;
+		*fb->fb_tailp = &fw;
+		fb->fb_tailp = &fw.fw_next;
+	}
+	spinlock_release(&fb->fb_lock);
+	as_putpaddr(as);
+	if (result) {
+		return result;
+	}
+
+	/* Once on the list, we can't miss being woken. */
+	spinlock_acquire(&fb->fb_lock);
+	while (!fw.fw_woken) {
+		wchan_sleep(fb->fb_wchan, &fb->fb_lock);
+	}
+	spinlock_release(&fb->fb_lock);
+
+	return fw.fw_result;
+}
+
+int
+futex_wake(userptr_t uaddr, int max, int *retval)
+{
+	struct addrspace *as;
+	struct futex_bucket *fb;
+	struct futex_waiter *fw, *prev;
+	paddr_t key;
+	int result, count;
+
+	as = proc_getas();
+	result = futex_getkey(as, uaddr, &key);
+	if (result) {
+		return result;
+	}
+	as_putpaddr(as);
+	fb = futex_bucket(key);
+
+	count = 0;
+	prev = NULL;
+	spinlock_acquire(&fb->fb_lock);
+	fw = fb->fb_waiters;
+	while (fw != NULL && count < max) {
+		if (fw->fw_key == key) {
+			fw = futex_unlink(fb, prev, fw, 0);
+			count++;
+		}
+		else {
+			prev = fw;
+			fw = fw->fw_next;
+		}
+	}
+	if (count > 0) {
+		wchan_wakeall(fb->fb_wchan, &fb->fb_lock);
+	}
+	spinlock_release(&fb->fb_lock);
+
+	*retval = count;
+	return 0;
+}
+
+void
+futex_interrupt(struct proc *proc)
+{
+	struct futex_bucket *fb;
+	struct futex_waiter *fw, *prev;
+	unsigned i;
+	bool any;
+
+	for (i=0; i<FUTEX_BUCKETS; i++) {
+		fb = &futex_table[i];
+		any = false;
+		prev = NULL;
+		spinlock_acquire(&fb->fb_lock);
+		fw = fb->fb_waiters;
+		while (fw != NULL) {
+			if (fw->fw_proc == proc) {
+				fw = futex_unlink(fb, prev, fw, EINTR);
+				any = true;
+			}
+			else {
+				prev = fw;
+				fw = fw->fw_next;
+			}
+		}
+		if (any) {
+			wchan_wakeall(fb->fb_wchan, &fb->fb_lock);
+		}
+		spinlock_release(&fb->fb_lock);
+	}
+}
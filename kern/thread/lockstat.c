@@ -0,0 +1,260 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Lock contention statistics.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <clock.h>
+#include <spinlock.h>
+#include <lockstat.h>
+
+/* Number of entries; a power of two */
+#define LOCKSTAT_MAX		256
+/* Length kept of each lock name */
+#define LOCKSTAT_NAMELEN	24
+/* Number of entries lockstat_print shows */
+#define LOCKSTAT_TOP		20
+
+struct lockstat {
+	char ls_name[LOCKSTAT_NAMELEN];	/* Empty if entry unused */
+	unsigned ls_kind;		/* LOCKSTAT_SPIN etc. */
+	unsigned ls_acquires;		/* Times acquired */
+	unsigned ls_contended;		/* Times found already held */
+	uint64_t ls_wait;		/* Total ns spent waiting */
+	uint64_t ls_maxwait;		/* Longest single wait */
+	uint64_t ls_hold;		/* Total ns held */
+};
+
+static const char *const lockstat_kinds[] = {
+	"spin", "lock", "sem", "cv",
+};
+
+/*
+ * The table is an open-addressed hash on name and kind. Entries are
+ * never removed (resetting only zeroes the counts), so the pointers
+ * cached in the locks stay good.
+ *
+ * lockstat_lock has no name, so taking it doesn't come back here.
+ */
+static struct spinlock lockstat_lock = SPINLOCK_INITIALIZER;
+static struct lockstat lockstats[LOCKSTAT_MAX];
+static unsigned lockstat_dropped;	/* Acquisitions with no room */
+
+volatile bool lockstat_enabled;
+
+uint64_t
+lockstat_now(void)
+{
+	struct timespec ts;
+
+	gettime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Compare NAME to a stored (possibly truncated) entry name.
+ */
+static
+bool
+lockstat_samename(const char *entry, const char *name)
+{
+	unsigned i;
+
+	for (i=0; i<LOCKSTAT_NAMELEN-1; i++) {
+		if (entry[i] != name[i]) {
+			return false;
+		}
+		if (entry[i] == 0) {
+			return true;
+		}
+	}
+	return true;
+}
+
+/*
+ * Find or make the entry for NAME and KIND. Returns NULL if the table
+ * is full.
+ */
+static
+struct lockstat *
+lockstat_find(unsigned kind, const char *name)
+{
+	struct lockstat *ls;
+	unsigned hash, i, j;
+
+	KASSERT(spinlock_do_i_hold(&lockstat_lock));
+
+	hash = kind;
+	for (i=0; name[i] != 0 && i < LOCKSTAT_NAMELEN-1; i++) {
+		hash = hash*33 + (unsigned char)name[i];
+	}
+
+	for (i=0; i<LOCKSTAT_MAX; i++) {
+		ls = &lockstats[(hash + i) & (LOCKSTAT_MAX - 1)];
+		if (ls->ls_name[0] == 0) {
+			for (j=0; name[j] != 0 && j < LOCKSTAT_NAMELEN-1; j++) {
+				ls->ls_name[j] = name[j];
+			}
+			ls->ls_name[j] = 0;
+			ls->ls_kind = kind;
+			return ls;
+		}
+		if (ls->ls_kind == kind && lockstat_samename(ls->ls_name, name)) {
+			return ls;
+		}
+	}
+	return NULL;
+}
+
+void
+lockstat_acquire(struct lockstat **lsp, unsigned kind, const char *name,
+		 bool contended, uint64_t wait)
+{
+	struct lockstat *ls;
+
+	spinlock_acquire(&lockstat_lock);
+	ls = *lsp;
+	if (ls == NULL) {
+		/* An empty name would look like a free entry */
+		ls = lockstat_find(kind, name[0] ? name : "?");
+		if (ls == NULL) {
+			lockstat_dropped++;
+			spinlock_release(&lockstat_lock);
+			return;
+		}
+		*lsp = ls;
+	}
+	ls->ls_acquires++;
+	if (contended) {
+		ls->ls_contended++;
+		ls->ls_wait += wait;
+		if (wait > ls->ls_maxwait) {
+			ls->ls_maxwait = wait;
+		}
+	}
+	spinlock_release(&lockstat_lock);
+}
+
+void
+lockstat_hold(struct lockstat *ls, uint64_t hold)
+{
+	if (ls == NULL) {
+		return;
+	}
+	spinlock_acquire(&lockstat_lock);
+	ls->ls_hold += hold;
+	spinlock_release(&lockstat_lock);
+}
+
+void
+lockstat_enable(bool on)
+{
+	lockstat_enabled = on;
+}
+
+void
+lockstat_reset(void)
+{
+	unsigned i;
+
+	spinlock_acquire(&lockstat_lock);
+	for (i=0; i<LOCKSTAT_MAX; i++) {
+		lockstats[i].ls_acquires = 0;
+		lockstats[i].ls_contended = 0;
+		lockstats[i].ls_wait = 0;
+		lockstats[i].ls_maxwait = 0;
+		lockstats[i].ls_hold = 0;
+	}
+	lockstat_dropped = 0;
+	spinlock_release(&lockstat_lock);
+}
+
+/*
+ * Print the LOCKSTAT_TOP entries with the most total waiting. Take a
+ * copy first, so nothing we call while printing (kmalloc, the console
+ * locks) has to get past lockstat_lock.
+ */
+void
+lockstat_print(void)
+{
+	struct lockstat *copy, *ls, tmp;
+	unsigned i, j, best, num, dropped;
+
+	copy = kmalloc(sizeof(lockstats));
+	if (copy == NULL) {
+		kprintf("lockstat: Out of memory\n");
+		return;
+	}
+
+	spinlock_acquire(&lockstat_lock);
+	num = 0;
+	for (i=0; i<LOCKSTAT_MAX; i++) {
+		if (lockstats[i].ls_acquires > 0) {
+			copy[num++] = lockstats[i];
+		}
+	}
+	dropped = lockstat_dropped;
+	spinlock_release(&lockstat_lock);
+
+	kprintf("Lock statistics (%s; times in microseconds):\n",
+		lockstat_enabled ? "collecting" : "stopped");
+	kprintf("kind name                       acquired  contended"
+		"       wait    maxwait       hold\n");
+
+	/* Partial selection sort: we only want the top few. */
+	for (i=0; i<num && i<LOCKSTAT_TOP; i++) {
+		best = i;
+		for (j=i+1; j<num; j++) {
+			if (copy[j].ls_wait > copy[best].ls_wait) {
+				best = j;
+			}
+		}
+		tmp = copy[i];
+		copy[i] = copy[best];
+		copy[best] = tmp;
+
+		ls = &copy[i];
+		kprintf("%-4s %-24s %10u %10u %10llu %10llu %10llu\n",
+			lockstat_kinds[ls->ls_kind], ls->ls_name,
+			ls->ls_acquires, ls->ls_contended,
+			ls->ls_wait / 1000, ls->ls_maxwait / 1000,
+			ls->ls_hold / 1000);
+	}
+	if (num > LOCKSTAT_TOP) {
+		kprintf("(%u more not shown)\n", num - LOCKSTAT_TOP);
+	}
+	if (dropped > 0) {
+		kprintf("%u acquisitions not counted: table full\n", dropped);
+	}
+
+	kfree(copy);
+}
@@ -38,11 +38,50 @@
 #include <spinlock.h>
 #include <membar.h>
 #include <current.h>	/* for curcpu */
+#include <lockstat.h>
 
 /*
  * Spinlocks.
  */
 
+/*
+ * Backoff, in trips round an empty loop. With test-and-set a failed
+ * attempt doubles the delay, up to SPINLOCK_BACKOFF_MAX; with tickets
+ * a waiter delays SPINLOCK_BACKOFF_UNIT for each holder ahead of it,
+ * since each of those will keep the lock for a while.
+ */
+#define SPINLOCK_BACKOFF_MIN	4
+#define SPINLOCK_BACKOFF_MAX	1024
+#define SPINLOCK_BACKOFF_UNIT	32
+
+static
+inline
+void
+spinlock_backoff(unsigned count)
+{
+	volatile unsigned i;
+
+	for (i=0; i<count; i++) {
+		/* nothing */
+	}
+}
+
+/*
+ * Check if anyone holds the lock.
+ */
+static
+inline
+bool
+spinlock_isheld(struct spinlock *splk)
+{
+#if OPT_TICKETLOCK
+	return spinlock_data_get(&splk->splk_lock) !=
+		spinlock_data_get(&splk->splk_serving);
+#else
+	return spinlock_data_get(&splk->splk_lock) != 0;
+#endif
+}
+
 
 /*
  * Initialize spinlock.
@@ -51,7 +90,15 @@ void
 spinlock_init(struct spinlock *splk)
 {
 	spinlock_data_set(&splk->splk_lock, 0);
+#if OPT_TICKETLOCK
+	spinlock_data_set(&splk->splk_serving, 0);
+#endif
 	splk->splk_holder = NULL;
+#if OPT_LOCKSTAT
+	splk->splk_name = NULL;
+	splk->splk_stat = NULL;
+	splk->splk_stamp = 0;
+#endif
 }
 
 /*
@@ -61,7 +108,22 @@ void
 spinlock_cleanup(struct spinlock *splk)
 {
 	KASSERT(splk->splk_holder == NULL);
-	KASSERT(spinlock_data_get(&splk->splk_lock) == 0);
+	KASSERT(!spinlock_isheld(splk));
+}
+
+/*
+ * Name spinlock, for lockstat.
+ */
+void
+spinlock_setname(struct spinlock *splk, const char *name)
+{
+#if OPT_LOCKSTAT
+	splk->splk_name = name;
+	splk->splk_stat = NULL;
+#else
+	(void)splk;
+	(void)name;
+#endif
 }
 
 /*
@@ -75,6 +137,15 @@ void
 spinlock_acquire(struct spinlock *splk)
 {
 	struct cpu *mycpu;
+#if OPT_TICKETLOCK
+	spinlock_data_t ticket, serving;
+#else
+	unsigned backoff = SPINLOCK_BACKOFF_MIN;
+#endif
+#if OPT_LOCKSTAT
+	uint64_t start = 0, now;
+	bool contended = false;
+#endif
 
 	splraise(IPL_NONE, IPL_HIGH);
 
@@ -90,6 +161,25 @@ spinlock_acquire(struct spinlock *splk)
 		mycpu = NULL;
 	}
 
+#if OPT_LOCKSTAT
+	/* Count it as contended if it's held when we get here. */
+	if (lockstat_enabled && splk->splk_name != NULL) {
+		start = lockstat_now();
+		contended = spinlock_isheld(splk);
+	}
+#endif
+
+#if OPT_TICKETLOCK
+	/*
+	 * Take a ticket and wait for it to be called. The counters
+	 * wrap, which is fine as long as there are fewer than 2^32
+	 * CPUs in line.
+	 */
+	ticket = spinlock_data_fetchadd(&splk->splk_lock, 1);
+	while ((serving = spinlock_data_get(&splk->splk_serving)) != ticket) {
+		spinlock_backoff((ticket - serving) * SPINLOCK_BACKOFF_UNIT);
+	}
+#else
 	while (1) {
 		/*
 		 * Do test-test-and-set, that is, read first before
@@ -100,18 +190,36 @@ spinlock_acquire(struct spinlock *splk)
 		 * previous value. If that value was 0, the lock was
 		 * previously unheld and we now own it. If it was 1,
 		 * we don't.
+		 *
+		 * If we lose a race for it, back off before looking
+		 * again, so the CPUs that lost don't all pile onto the
+		 * lock word together next time it comes free.
 		 */
 		if (spinlock_data_get(&splk->splk_lock) != 0) {
 			continue;
 		}
 		if (spinlock_data_testandset(&splk->splk_lock) != 0) {
+			spinlock_backoff(backoff);
+			if (backoff < SPINLOCK_BACKOFF_MAX) {
+				backoff *= 2;
+			}
 			continue;
 		}
 		break;
 	}
+#endif
 
 	membar_store_any();
 	splk->splk_holder = mycpu;
+
+#if OPT_LOCKSTAT
+	if (start != 0) {
+		now = contended ? lockstat_now() : start;
+		lockstat_acquire(&splk->splk_stat, LOCKSTAT_SPIN,
+				 splk->splk_name, contended, now - start);
+		splk->splk_stamp = now;
+	}
+#endif
 }
 
 /*
@@ -120,6 +228,14 @@ spinlock_acquire(struct spinlock *splk)
 void
 spinlock_release(struct spinlock *splk)
 {
+#if OPT_LOCKSTAT
+	/* Once it's released it may go away; get these first. */
+	uint64_t stamp = splk->splk_stamp;
+	struct lockstat *ls = splk->splk_stat;
+
+	splk->splk_stamp = 0;
+#endif
+
 	/* this must work before curcpu initialization */
 	if (CURCPU_EXISTS()) {
 		KASSERT(splk->splk_holder == curcpu->c_self);
@@ -129,7 +245,18 @@ spinlock_release(struct spinlock *splk)
 
 	splk->splk_holder = NULL;
 	membar_any_store();
+#if OPT_TICKETLOCK
+	/* Only the holder writes splk_serving, so this needn't be atomic. */
+	spinlock_data_set(&splk->splk_serving,
+			  spinlock_data_get(&splk->splk_serving) + 1);
+#else
 	spinlock_data_set(&splk->splk_lock, 0);
+#endif
+#if OPT_LOCKSTAT
+	if (stamp != 0) {
+		lockstat_hold(ls, lockstat_now() - stamp);
+	}
+#endif
 	spllower(IPL_HIGH, IPL_NONE);
 }
 
@@ -33,12 +33,29 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <lib.h>
 #include <spinlock.h>
 #include <wchan.h>
 #include <thread.h>
 #include <current.h>
 #include <synch.h>
+#include <callout.h>
+#include <objcache.h>
+#include <lockstat.h>
+
+/*
+ * Synchronization objects are created and destroyed along with nearly
+ * everything else (files, pids, processes), so they get caches.
+ */
+static struct objcache sem_cache =
+	OBJCACHE_INITIALIZER("semaphore", sizeof(struct semaphore), NULL, NULL);
+static struct objcache lock_cache =
+	OBJCACHE_INITIALIZER("lock", sizeof(struct lock), NULL, NULL);
+static struct objcache cv_cache =
+	OBJCACHE_INITIALIZER("cv", sizeof(struct cv), NULL, NULL);
+static struct objcache rwlock_cache =
+	OBJCACHE_INITIALIZER("rwlock", sizeof(struct rwlock), NULL, NULL);
 
 ////////////////////////////////////////////////////////////
 //
@@ -49,45 +66,70 @@ sem_create(const char *name, unsigned initial_count)
 {
         struct semaphore *sem;
 
-        sem = kmalloc(sizeof(struct semaphore));
+        sem = objcache_alloc(&sem_cache);
         if (sem == NULL) {
                 return NULL;
         }
 
         sem->sem_name = kstrdup(name);
         if (sem->sem_name == NULL) {
-                kfree(sem);
+                objcache_free(&sem_cache, sem);
                 return NULL;
         }
 
 	sem->sem_wchan = wchan_create(sem->sem_name);
 	if (sem->sem_wchan == NULL) {
 		kfree(sem->sem_name);
-		kfree(sem);
+		objcache_free(&sem_cache, sem);
 		return NULL;
 	}
 
 	spinlock_init(&sem->sem_lock);
+	spinlock_setname(&sem->sem_lock, sem->sem_name);
         sem->sem_count = initial_count;
+	sem->sem_fifo = false;
+	sem->sem_handoffs = 0;
+#if OPT_LOCKSTAT
+	sem->sem_stat = NULL;
+#endif
 
         return sem;
 }
 
+struct semaphore *
+sem_create_fifo(const char *name, unsigned initial_count)
+{
+	struct semaphore *sem;
+
+	sem = sem_create(name, initial_count);
+	if (sem != NULL) {
+		sem->sem_fifo = true;
+	}
+	return sem;
+}
+
 void
 sem_destroy(struct semaphore *sem)
 {
         KASSERT(sem != NULL);
+	KASSERT(sem->sem_handoffs == 0);
 
 	/* wchan_cleanup will assert if anyone's waiting on it */
 	spinlock_cleanup(&sem->sem_lock);
 	wchan_destroy(sem->sem_wchan);
         kfree(sem->sem_name);
-        kfree(sem);
+        objcache_free(&sem_cache, sem);
 }
 
 void
 P(struct semaphore *sem)
 {
+	bool handedoff;
+#if OPT_LOCKSTAT
+	uint64_t start = lockstat_enabled ? lockstat_now() : 0;
+	bool contended;
+#endif
+
         KASSERT(sem != NULL);
 
         /*
@@ -100,24 +142,45 @@ P(struct semaphore *sem)
 
 	/* Use the semaphore spinlock to protect the wchan as well. */
 	spinlock_acquire(&sem->sem_lock);
+#if OPT_LOCKSTAT
+	contended = sem->sem_count == 0;
+#endif
+	handedoff = false;
         while (sem->sem_count == 0) {
 		/*
 		 *
-		 * Note that we don't maintain strict FIFO ordering of
-		 * threads going through the semaphore; that is, we
-		 * might "get" it on the first try even if other
-		 * threads are waiting. Apparently according to some
-		 * textbooks semaphores must for some reason have
-		 * strict ordering. Too bad. :-)
+		 * Note that unless sem_fifo is set we don't maintain
+		 * strict FIFO ordering of threads going through the
+		 * semaphore; that is, we might "get" it on the first
+		 * try even if other threads are waiting.
 		 *
-		 * Exercise: how would you implement strict FIFO
-		 * ordering?
+		 * With sem_fifo, V doesn't raise the count while
+		 * anyone is waiting; it wakes the first waiter and
+		 * leaves a handoff for it. Only woken waiters look for
+		 * one, and each V wakes exactly one waiter, so the
+		 * handoff can't be taken by anyone else.
 		 */
 		wchan_sleep(sem->sem_wchan, &sem->sem_lock);
+		if (sem->sem_handoffs > 0) {
+			KASSERT(sem->sem_fifo);
+			sem->sem_handoffs--;
+			handedoff = true;
+			break;
+		}
         }
-        KASSERT(sem->sem_count > 0);
-        sem->sem_count--;
+	if (!handedoff) {
+		KASSERT(sem->sem_count > 0);
+		sem->sem_count--;
+	}
 	spinlock_release(&sem->sem_lock);
+
+#if OPT_LOCKSTAT
+	if (start != 0) {
+		lockstat_acquire(&sem->sem_stat, LOCKSTAT_SEM, sem->sem_name,
+				 contended,
+				 contended ? lockstat_now() - start : 0);
+	}
+#endif
 }
 
 void
@@ -127,9 +190,21 @@ V(struct semaphore *sem)
 
 	spinlock_acquire(&sem->sem_lock);
 
-        sem->sem_count++;
-        KASSERT(sem->sem_count > 0);
-	wchan_wakeone(sem->sem_wchan, &sem->sem_lock);
+	if (sem->sem_fifo) {
+		if (wchan_wakeone(sem->sem_wchan, &sem->sem_lock)) {
+			/* Pass it straight to the longest waiter. */
+			sem->sem_handoffs++;
+		}
+		else {
+			sem->sem_count++;
+			KASSERT(sem->sem_count > 0);
+		}
+	}
+	else {
+		sem->sem_count++;
+		KASSERT(sem->sem_count > 0);
+		wchan_wakeone(sem->sem_wchan, &sem->sem_lock);
+	}
 
 	spinlock_release(&sem->sem_lock);
 }
@@ -143,25 +218,30 @@ lock_create(const char *name)
 {
         struct lock *lock;
 
-        lock = kmalloc(sizeof(struct lock));
+        lock = objcache_alloc(&lock_cache);
         if (lock == NULL) {
                 return NULL;
         }
 
         lock->lk_name = kstrdup(name);
         if (lock->lk_name == NULL) {
-                kfree(lock);
+                objcache_free(&lock_cache, lock);
                 return NULL;
         }
 
 	lock->lk_wchan = wchan_create(lock->lk_name);
 	if (lock->lk_wchan == NULL) {
 		kfree(lock->lk_name);
-		kfree(lock);
+		objcache_free(&lock_cache, lock);
 		return NULL;
 	}
 	spinlock_init(&lock->lk_lock);
+	spinlock_setname(&lock->lk_lock, lock->lk_name);
 	lock->lk_holder = NULL;
+#if OPT_LOCKSTAT
+	lock->lk_stat = NULL;
+	lock->lk_stamp = 0;
+#endif
 
         return lock;
 }
@@ -176,36 +256,99 @@ lock_destroy(struct lock *lock)
 	wchan_destroy(lock->lk_wchan);
 
         kfree(lock->lk_name);
-        kfree(lock);
+        objcache_free(&lock_cache, lock);
 }
 
+/*
+ * How long to spin waiting for a lock whose holder is running, in
+ * trips round the loop in lock_acquire. This should be about the cost
+ * of going to sleep and being woken up again; past that, spinning
+ * just wastes the cpu.
+ */
+unsigned lock_maxspin = 1000;
+
 void
 lock_acquire(struct lock *lock)
 {
+	struct thread *holder;
+	unsigned spins;
+#if OPT_LOCKSTAT
+	uint64_t start = lockstat_enabled ? lockstat_now() : 0, now;
+	bool contended;
+#endif
+
 	DEBUGASSERT(lock != NULL);
         KASSERT(curthread->t_in_interrupt == false);
 
 	spinlock_acquire(&lock->lk_lock);
 	KASSERT(lock->lk_holder != curthread);
-	while (lock->lk_holder != NULL) {
+#if OPT_LOCKSTAT
+	contended = lock->lk_holder != NULL;
+#endif
+	spins = 0;
+	while ((holder = lock->lk_holder) != NULL) {
+		/*
+		 * If the holder is running (it can only be on another
+		 * cpu), it may well let go before we could get to
+		 * sleep and back; spin without the spinlock, watching
+		 * for lk_holder to change. The holder can't go away
+		 * while it holds the lock, so it's safe to look at
+		 * it here with lk_lock held.
+		 */
+		if (spins < lock_maxspin && holder->t_state == S_RUN) {
+			spinlock_release(&lock->lk_lock);
+			while (lock->lk_holder == holder &&
+			       spins < lock_maxspin) {
+				spins++;
+			}
+			spinlock_acquire(&lock->lk_lock);
+			continue;
+		}
 		/* As in the semaphore. */
                 wchan_sleep(lock->lk_wchan, &lock->lk_lock);
 	}
 
 	lock->lk_holder = curthread;
 	spinlock_release(&lock->lk_lock);
+
+#if OPT_LOCKSTAT
+	if (start != 0) {
+		now = contended ? lockstat_now() : start;
+		lockstat_acquire(&lock->lk_stat, LOCKSTAT_LOCK, lock->lk_name,
+				 contended, now - start);
+		lock->lk_stamp = now;
+	}
+#endif
 }
 
 void
 lock_release(struct lock *lock)
 {
+#if OPT_LOCKSTAT
+	uint64_t stamp;
+	struct lockstat *ls;
+#endif
+
 	DEBUGASSERT(lock != NULL);
 
+#if OPT_LOCKSTAT
+	/* Once it's released it may go away; get these first. */
+	stamp = lock->lk_stamp;
+	ls = lock->lk_stat;
+	lock->lk_stamp = 0;
+#endif
+
 	spinlock_acquire(&lock->lk_lock);
 	KASSERT(lock->lk_holder == curthread);
 	lock->lk_holder = NULL;
 	wchan_wakeone(lock->lk_wchan, &lock->lk_lock);
 	spinlock_release(&lock->lk_lock);
+
+#if OPT_LOCKSTAT
+	if (stamp != 0) {
+		lockstat_hold(ls, lockstat_now() - stamp);
+	}
+#endif
 }
 
 bool
@@ -232,25 +375,29 @@ cv_create(const char *name)
 {
         struct cv *cv;
 
-        cv = kmalloc(sizeof(struct cv));
+        cv = objcache_alloc(&cv_cache);
         if (cv == NULL) {
                 return NULL;
         }
 
         cv->cv_name = kstrdup(name);
         if (cv->cv_name==NULL) {
-                kfree(cv);
+                objcache_free(&cv_cache, cv);
                 return NULL;
         }
 
 	cv->cv_wchan = wchan_create(cv->cv_name);
 	if (cv->cv_wchan == NULL) {
 		kfree(cv->cv_name);
-		kfree(cv);
+		objcache_free(&cv_cache, cv);
 		return NULL;
 	}
 
 	spinlock_init(&cv->cv_wchanlock);
+	spinlock_setname(&cv->cv_wchanlock, cv->cv_name);
+#if OPT_LOCKSTAT
+	cv->cv_stat = NULL;
+#endif
         return cv;
 }
 
@@ -263,12 +410,16 @@ cv_destroy(struct cv *cv)
 	wchan_destroy(cv->cv_wchan);
 
         kfree(cv->cv_name);
-        kfree(cv);
+        objcache_free(&cv_cache, cv);
 }
 
 void
 cv_wait(struct cv *cv, struct lock *lock)
 {
+#if OPT_LOCKSTAT
+	uint64_t start = lockstat_enabled ? lockstat_now() : 0;
+#endif
+
 	spinlock_acquire(&cv->cv_wchanlock);
 	lock_release(lock);
 	wchan_sleep(cv->cv_wchan, &cv->cv_wchanlock);
@@ -281,23 +432,292 @@ cv_wait(struct cv *cv, struct lock *lock)
 	 * logic to make that work cleanly.
 	 */
 	spinlock_release(&cv->cv_wchanlock);
+
+#if OPT_LOCKSTAT
+	/* Every wait blocks, so every one counts as contended. */
+	if (start != 0) {
+		lockstat_acquire(&cv->cv_stat, LOCKSTAT_CV, cv->cv_name,
+				 true, lockstat_now() - start);
+	}
+#endif
 	lock_acquire(lock);
 }
 
+/*
+ * State shared between cv_timedwait and its callout.
+ */
+struct cv_timeout {
+	struct cv *ct_cv;
+	struct thread *ct_thread;	/* The waiter */
+	bool ct_done;		/* Waiter is awake; don't fire */
+	bool ct_fired;		/* Timed out */
+};
+
+/*
+ * Only a waiter still on the CV has timed out. One that cv_signal or
+ * cv_broadcast has already moved to the lock's wait channel was
+ * signalled, and lock_release will wake it.
+ */
+static
+void
+cv_timeout(void *vct)
+{
+	struct cv_timeout *ct = vct;
+	struct cv *cv = ct->ct_cv;
+
+	spinlock_acquire(&cv->cv_wchanlock);
+	if (!ct->ct_done &&
+	    wchan_wakethread(cv->cv_wchan, ct->ct_thread,
+			     &cv->cv_wchanlock)) {
+		ct->ct_fired = true;
+	}
+	spinlock_release(&cv->cv_wchanlock);
+}
+
+int
+cv_timedwait(struct cv *cv, struct lock *lock, unsigned ticks)
+{
+	struct cv_timeout ct;
+	struct callout co;
+	bool fired;
+
+	ct.ct_cv = cv;
+	ct.ct_thread = curthread;
+	ct.ct_done = false;
+	ct.ct_fired = false;
+	callout_init(&co, cv_timeout, &ct);
+
+	spinlock_acquire(&cv->cv_wchanlock);
+	lock_release(lock);
+	/*
+	 * The callout takes cv_wchanlock, so it can't get in before
+	 * we're on the wchan.
+	 */
+	callout_schedule(&co, ticks);
+	wchan_sleep(cv->cv_wchan, &cv->cv_wchanlock);
+	ct.ct_done = true;
+	fired = ct.ct_fired;
+	spinlock_release(&cv->cv_wchanlock);
+
+	/* This waits if it's running, so CT can go away afterwards. */
+	callout_stop(&co);
+
+	lock_acquire(lock);
+	return fired ? ETIMEDOUT : 0;
+}
+
+/*
+ * Wait morphing (see synch.h): move waiters from the CV to the lock's
+ * wait channel; lock_release will wake them. The order cv_wchanlock,
+ * then lk_lock, is the same one cv_wait uses. If the caller doesn't
+ * hold the lock after all, there's no release coming to wake them,
+ * so fall back to waking them here.
+ */
 void
 cv_signal(struct cv *cv, struct lock *lock)
 {
-	(void)lock;
 	spinlock_acquire(&cv->cv_wchanlock);
-	wchan_wakeone(cv->cv_wchan, &cv->cv_wchanlock);
+	spinlock_acquire(&lock->lk_lock);
+	if (lock->lk_holder == curthread) {
+		wchan_moveone(cv->cv_wchan, &cv->cv_wchanlock,
+			      lock->lk_wchan, &lock->lk_lock);
+		spinlock_release(&lock->lk_lock);
+	}
+	else {
+		spinlock_release(&lock->lk_lock);
+		wchan_wakeone(cv->cv_wchan, &cv->cv_wchanlock);
+	}
 	spinlock_release(&cv->cv_wchanlock);
 }
 
 void
 cv_broadcast(struct cv *cv, struct lock *lock)
 {
-	(void)lock;
 	spinlock_acquire(&cv->cv_wchanlock);
-	wchan_wakeall(cv->cv_wchan, &cv->cv_wchanlock);
+	spinlock_acquire(&lock->lk_lock);
+	if (lock->lk_holder == curthread) {
+		wchan_moveall(cv->cv_wchan, &cv->cv_wchanlock,
+			      lock->lk_wchan, &lock->lk_lock);
+		spinlock_release(&lock->lk_lock);
+	}
+	else {
+		spinlock_release(&lock->lk_lock);
+		wchan_wakeall(cv->cv_wchan, &cv->cv_wchanlock);
+	}
 	spinlock_release(&cv->cv_wchanlock);
 }
+
+////////////////////////////////////////////////////////////
+//
+// Reader-writer lock.
+
+struct rwlock *
+rwlock_create(const char *name)
+{
+	struct rwlock *rwl;
+
+	rwl = objcache_alloc(&rwlock_cache);
+	if (rwl == NULL) {
+		return NULL;
+	}
+
+	rwl->rwl_name = kstrdup(name);
+	if (rwl->rwl_name == NULL) {
+		objcache_free(&rwlock_cache, rwl);
+		return NULL;
+	}
+
+	rwl->rwl_readwchan = wchan_create(rwl->rwl_name);
+	if (rwl->rwl_readwchan == NULL) {
+		kfree(rwl->rwl_name);
+		objcache_free(&rwlock_cache, rwl);
+		return NULL;
+	}
+	rwl->rwl_writewchan = wchan_create(rwl->rwl_name);
+	if (rwl->rwl_writewchan == NULL) {
+		wchan_destroy(rwl->rwl_readwchan);
+		kfree(rwl->rwl_name);
+		objcache_free(&rwlock_cache, rwl);
+		return NULL;
+	}
+
+	spinlock_init(&rwl->rwl_lock);
+	spinlock_setname(&rwl->rwl_lock, rwl->rwl_name);
+	rwl->rwl_readers = 0;
+	rwl->rwl_writerswaiting = 0;
+	rwl->rwl_writer = NULL;
+
+	return rwl;
+}
+
+void
+rwlock_destroy(struct rwlock *rwl)
+{
+	KASSERT(rwl != NULL);
+
+	KASSERT(rwl->rwl_readers == 0);
+	KASSERT(rwl->rwl_writer == NULL);
+	spinlock_cleanup(&rwl->rwl_lock);
+	wchan_destroy(rwl->rwl_writewchan);
+	wchan_destroy(rwl->rwl_readwchan);
+
+	kfree(rwl->rwl_name);
+	objcache_free(&rwlock_cache, rwl);
+}
+
+void
+rwlock_acquire_read(struct rwlock *rwl)
+{
+	DEBUGASSERT(rwl != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rwl->rwl_lock);
+	KASSERT(rwl->rwl_writer != curthread);
+	/* Stand aside for waiting writers, not just a holding one. */
+	while (rwl->rwl_writer != NULL || rwl->rwl_writerswaiting > 0) {
+		wchan_sleep(rwl->rwl_readwchan, &rwl->rwl_lock);
+	}
+	rwl->rwl_readers++;
+	spinlock_release(&rwl->rwl_lock);
+}
+
+void
+rwlock_release_read(struct rwlock *rwl)
+{
+	DEBUGASSERT(rwl != NULL);
+
+	spinlock_acquire(&rwl->rwl_lock);
+	KASSERT(rwl->rwl_readers > 0);
+	rwl->rwl_readers--;
+	if (rwl->rwl_readers == 0) {
+		wchan_wakeone(rwl->rwl_writewchan, &rwl->rwl_lock);
+	}
+	spinlock_release(&rwl->rwl_lock);
+}
+
+void
+rwlock_acquire_write(struct rwlock *rwl)
+{
+	DEBUGASSERT(rwl != NULL);
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&rwl->rwl_lock);
+	KASSERT(rwl->rwl_writer != curthread);
+	while (rwl->rwl_writer != NULL || rwl->rwl_readers > 0) {
+		rwl->rwl_writerswaiting++;
+		wchan_sleep(rwl->rwl_writewchan, &rwl->rwl_lock);
+		rwl->rwl_writerswaiting--;
+	}
+	rwl->rwl_writer = curthread;
+	spinlock_release(&rwl->rwl_lock);
+}
+
+void
+rwlock_release_write(struct rwlock *rwl)
+{
+	DEBUGASSERT(rwl != NULL);
+
+	spinlock_acquire(&rwl->rwl_lock);
+	KASSERT(rwl->rwl_writer == curthread);
+	rwl->rwl_writer = NULL;
+	/*
+	 * Hand off to the next writer if there is one; the readers
+	 * would only go back to sleep behind it. Otherwise let all
+	 * the readers in at once.
+	 */
+	if (rwl->rwl_writerswaiting > 0) {
+		wchan_wakeone(rwl->rwl_writewchan, &rwl->rwl_lock);
+	}
+	else {
+		wchan_wakeall(rwl->rwl_readwchan, &rwl->rwl_lock);
+	}
+	spinlock_release(&rwl->rwl_lock);
+}
+
+bool
+rwlock_tryacquire_read(struct rwlock *rwl)
+{
+	bool ret;
+
+	DEBUGASSERT(rwl != NULL);
+
+	spinlock_acquire(&rwl->rwl_lock);
+	ret = rwl->rwl_writer == NULL && rwl->rwl_writerswaiting == 0;
+	if (ret) {
+		rwl->rwl_readers++;
+	}
+	spinlock_release(&rwl->rwl_lock);
+
+	return ret;
+}
+
+bool
+rwlock_tryacquire_write(struct rwlock *rwl)
+{
+	bool ret;
+
+	DEBUGASSERT(rwl != NULL);
+
+	spinlock_acquire(&rwl->rwl_lock);
+	ret = rwl->rwl_writer == NULL && rwl->rwl_readers == 0;
+	if (ret) {
+		rwl->rwl_writer = curthread;
+	}
+	spinlock_release(&rwl->rwl_lock);
+
+	return ret;
+}
+
+bool
+rwlock_do_i_hold_write(struct rwlock *rwl)
+{
+	bool ret;
+
+	DEBUGASSERT(rwl != NULL);
+
+	spinlock_acquire(&rwl->rwl_lock);
+	ret = (rwl->rwl_writer == curthread);
+	spinlock_release(&rwl->rwl_lock);
+
+	return ret;
+}
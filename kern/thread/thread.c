@@ -49,16 +49,24 @@
 #include <proc.h>
 #include <current.h>
 #include <synch.h>
+#include <clock.h>
+#include <callout.h>
+#include <workqueue.h>
 #include <addrspace.h>
 #include <mainbus.h>
 #include <vnode.h>
 #include <pid.h>
 #include <file.h>
+#include <platform/maxcpus.h>
+#include <objcache.h>
 
 
 /* Magic number used as a guard value on kernel thread stacks. */
 #define THREAD_STACK_MAGIC 0xbaadf00d
 
+/* Dead threads each cpu keeps, with their stacks, for thread_fork. */
+#define THREAD_POOLMAX 8
+
 /* Wait channel. A wchan is protected by an associated, passed-in spinlock. */
 struct wchan {
 	const char *wc_name;		/* name for this channel */
@@ -66,6 +74,12 @@ struct wchan {
 	unsigned wc_index;		/* index into allwchans[] */
 };
 
+/* Caches for thread structures and wait channels. */
+static struct objcache thread_cache =
+	OBJCACHE_INITIALIZER("thread", sizeof(struct thread), NULL, NULL);
+static struct objcache wchan_cache =
+	OBJCACHE_INITIALIZER("wchan", sizeof(struct wchan), NULL, NULL);
+
 /* Master array of CPUs. */
 DECLARRAY(cpu);
 DEFARRAY(cpu, /*no inline*/ );
@@ -120,26 +134,17 @@ thread_checkstack(struct thread *thread)
 }
 
 /*
- * Create a thread. This is used both to create a first thread
- * for each CPU and to create subsequent forked threads.
+ * Set up a new thread structure, except for the stack.
  */
 static
-struct thread *
-thread_create(const char *name)
+int
+thread_init(struct thread *thread, const char *name)
 {
-	struct thread *thread;
-
 	DEBUGASSERT(name != NULL);
 
-	thread = kmalloc(sizeof(*thread));
-	if (thread == NULL) {
-		return NULL;
-	}
-
 	thread->t_name = kstrdup(name);
 	if (thread->t_name == NULL) {
-		kfree(thread);
-		return NULL;
+		return ENOMEM;
 	}
 	thread->t_wchan_name = "NEW";
 	thread->t_state = S_READY;
@@ -147,18 +152,50 @@ thread_create(const char *name)
 	/* Thread subsystem fields */
 	thread_machdep_init(&thread->t_machdep);
 	threadlistnode_init(&thread->t_listnode, thread);
-	thread->t_stack = NULL;
 	thread->t_context = NULL;
 	thread->t_cpu = NULL;
 	thread->t_proc = NULL;
+	thread->t_priority = 0;
+	thread->t_ticks = 0;
+	thread->t_readysince = 0;
+	thread->t_lastran = 0;
+	thread->t_madeready = 0;
+	thread->t_cpumask = THREAD_ANYCPU;
+	bzero(&thread->t_schedstat, sizeof(thread->t_schedstat));
 
 	/* Interrupt state fields */
 	thread->t_in_interrupt = false;
 	thread->t_curspl = IPL_HIGH;
 	thread->t_iplhigh_count = 1; /* corresponding to t_curspl */
 
+	/* Public fields */
+	thread->t_tid = 0;
+
 	/* If you add to struct thread, be sure to initialize here */
 
+	return 0;
+}
+
+/*
+ * Create a thread. This is used both to create a first thread
+ * for each CPU and to create subsequent forked threads.
+ */
+static
+struct thread *
+thread_create(const char *name)
+{
+	struct thread *thread;
+
+	thread = objcache_alloc(&thread_cache);
+	if (thread == NULL) {
+		return NULL;
+	}
+	thread->t_stack = NULL;
+
+	if (thread_init(thread, name)) {
+		objcache_free(&thread_cache, thread);
+		return NULL;
+	}
 	return thread;
 }
 
@@ -187,14 +224,31 @@ cpu_create(unsigned hardware_number)
 
 	c->c_curthread = NULL;
 	threadlist_init(&c->c_zombies);
+	threadlist_init(&c->c_threadpool);
+	threadlist_init(&c->c_sendaway);
+	c->c_idlethread = NULL;
 	c->c_hardclocks = 0;
+	c->c_stealrand = hardware_number + 1;
+	c->c_asbacklog = 0;
 
 	c->c_isidle = false;
 	threadlist_init(&c->c_runqueue);
 	spinlock_init(&c->c_runqueue_lock);
+	spinlock_setname(&c->c_runqueue_lock, "runqueue");
+	c->c_tickperiod = 1;
+	bzero(&c->c_schedstat, sizeof(c->c_schedstat));
+	c->c_callwheel = callwheel_create();
+	if (c->c_callwheel == NULL) {
+		panic("cpu_create: Out of memory\n");
+	}
+	c->c_workqueue = workqueue_create();
+	if (c->c_workqueue == NULL) {
+		panic("cpu_create: Out of memory\n");
+	}
 
 	c->c_ipi_pending = 0;
 	c->c_numshootdown = 0;
+	c->c_shootdown_gen = 0;
 	spinlock_init(&c->c_ipi_lock);
 
 	result = cpuarray_add(&allcpus, c, &c->c_number);
@@ -267,12 +321,43 @@ thread_destroy(struct thread *thread)
 	thread->t_wchan_name = "DESTROYED";
 
 	kfree(thread->t_name);
-	kfree(thread);
+	objcache_free(&thread_cache, thread);
+}
+
+/*
+ * Put a dead thread in the current cpu's pool instead of destroying
+ * it, keeping its stack, so thread_fork can skip allocating both.
+ * It's cleaned up as in thread_destroy, short of freeing anything
+ * but the name.
+ *
+ * The pool is per-cpu and only touched with interrupts off.
+ */
+static
+void
+thread_recycle(struct thread *thread)
+{
+	KASSERT(thread != curthread);
+	KASSERT(thread->t_state != S_RUN);
+	KASSERT(thread->t_proc == NULL);
+	KASSERT(thread->t_stack != NULL);
+
+	threadlistnode_cleanup(&thread->t_listnode);
+	thread_machdep_cleanup(&thread->t_machdep);
+
+	thread->t_wchan_name = "RECYCLED";
+
+	kfree(thread->t_name);
+	thread->t_name = NULL;
+
+	/* Most recently used first: its stack is likeliest to be cached */
+	threadlistnode_init(&thread->t_listnode, thread);
+	threadlist_addhead(&curcpu->c_threadpool, thread);
 }
 
 /*
  * Clean up zombies. (Zombies are threads that have exited but still
- * need to have thread_destroy called on them.)
+ * need to have thread_destroy called on them.) Keep up to
+ * THREAD_POOLMAX of them for reuse.
  *
  * The list of zombies is per-cpu.
  */
@@ -285,7 +370,13 @@ exorcise(void)
 	while ((z = threadlist_remhead(&curcpu->c_zombies)) != NULL) {
 		KASSERT(z != curthread);
 		KASSERT(z->t_state == S_ZOMBIE);
-		thread_destroy(z);
+		if (z->t_stack != NULL &&
+		    curcpu->c_threadpool.tl_count < THREAD_POOLMAX) {
+			thread_recycle(z);
+		}
+		else {
+			thread_destroy(z);
+		}
 	}
 }
 
@@ -431,12 +522,67 @@ cpu_hatch(unsigned software_number)
 	thread_exit();
 }
 
+/*
+ * A cpu's idle thread. It's never on a run queue; thread_switch
+ * switches to it when the thread giving up the cpu can't stay there
+ * and there's nothing else to run, so that the cpu gets off that
+ * thread's stack (and thread_sendaway can pass the thread on). It
+ * then idles on its own stack until something else is runnable.
+ */
+static
+void
+thread_idle(void *junk1, unsigned long junk2)
+{
+	(void)junk1;
+	(void)junk2;
+
+	while (1) {
+		thread_yield();
+	}
+}
+
+/*
+ * Create the idle thread for cpu C.
+ */
+static
+void
+thread_idle_create(struct cpu *c)
+{
+	struct thread *t;
+	char namebuf[16];
+	int result;
+
+	snprintf(namebuf, sizeof(namebuf), "<idle #%d>", c->c_number);
+	t = thread_create(namebuf);
+	if (t == NULL) {
+		panic("thread_idle_create: Out of memory\n");
+	}
+	t->t_stack = kmalloc(STACK_SIZE);
+	if (t->t_stack == NULL) {
+		panic("thread_idle_create: Out of memory\n");
+	}
+	thread_checkstack_init(t);
+	t->t_cpu = c;
+	t->t_cpumask = (uint32_t)1 << c->c_number;
+	result = proc_addthread(kproc, t);
+	if (result) {
+		panic("thread_idle_create: proc_addthread: %s\n",
+		      strerror(result));
+	}
+	/* As in thread_fork. */
+	t->t_iplhigh_count++;
+	switchframe_init(t, thread_idle, NULL, 0);
+
+	c->c_idlethread = t;
+}
+
 /*
  * Start up secondary cpus. Called from boot().
  */
 void
 thread_start_cpus(void)
 {
+	struct cpu *c;
 	char buf[64];
 	unsigned i;
 
@@ -451,23 +597,147 @@ thread_start_cpus(void)
 	}
 	sem_destroy(cpu_startup_sem);
 	cpu_startup_sem = NULL;
+
+	/*
+	 * Now everyone's here, start the work queues. The idle threads
+	 * come first, because the workers pin themselves to their cpus
+	 * with thread_setaffinity, which may need them.
+	 */
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		thread_idle_create(c);
+	}
+	for (i=0; i<cpuarray_num(&allcpus); i++) {
+		c = cpuarray_get(&allcpus, i);
+		workqueue_start(c->c_workqueue, c->c_number);
+	}
+}
+
+/*
+ * With options tickless, a cpu stretches its clock tick while it has
+ * only one thread to run, up to STRETCH_BUSYTICKS, and while idle, up
+ * to STRETCH_IDLETICKS. Making a thread runnable there brings the
+ * tick back (see thread_make_runnable).
+ */
+#define STRETCH_BUSYTICKS 16
+#define STRETCH_IDLETICKS (60 * HZ)
+
+/*
+ * Put a thread on a cpu's run queue, which is kept sorted by
+ * priority: the thread goes after everything at its own level or
+ * higher, and ahead of everything lower.
+ */
+static
+void
+runqueue_insert(struct cpu *c, struct thread *t)
+{
+	struct thread *other;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	t->t_readysince = clock_ticks;
+	THREADLIST_FORALL_REV(other, c->c_runqueue) {
+		if (other->t_priority <= t->t_priority) {
+			threadlist_insertafter(&c->c_runqueue, other, t);
+			return;
+		}
+	}
+	threadlist_addhead(&c->c_runqueue, t);
+}
+
+/*
+ * Return the priority of the first thread on a cpu's run queue, or
+ * MLFQ_LEVELS if it's empty.
+ */
+static
+unsigned
+runqueue_toppriority(struct cpu *c)
+{
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	if (threadlist_isempty(&c->c_runqueue)) {
+		return MLFQ_LEVELS;
+	}
+	return c->c_runqueue.tl_head.tln_next->tln_self->t_priority;
+}
+
+/*
+ * Return true if thread T may run on cpu C.
+ */
+static
+bool
+thread_allowed(struct thread *t, struct cpu *c)
+{
+	return (t->t_cpumask & ((uint32_t)1 << c->c_number)) != 0;
+}
+
+/*
+ * Choose a cpu for a thread that can't stay where it last ran: the
+ * least loaded one it's allowed on, idle ones first. The queue lengths
+ * are read without locking; it's only a hint.
+ */
+static
+struct cpu *
+thread_pickcpu(struct thread *t)
+{
+	unsigned i, numcpus, count, bestcount;
+	struct cpu *c, *best;
+
+	best = NULL;
+	bestcount = 0;
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (!thread_allowed(t, c)) {
+			continue;
+		}
+		count = c->c_isidle ? 0 : c->c_runqueue.tl_count + 1;
+		if (best == NULL || count < bestcount) {
+			best = c;
+			bestcount = count;
+		}
+	}
+	return best;
 }
 
 /*
  * Make a thread runnable.
  *
  * targetcpu might be curcpu; it might not be, too.
+ *
+ * Ordinarily the thread goes back to the cpu it last ran on, whose
+ * cache is likeliest to still hold its working set. If its affinity
+ * mask no longer allows that cpu, it goes elsewhere instead -- but
+ * only once that cpu is off its stack, which we check under that
+ * cpu's run queue lock. (A cpu that went idle after the thread slept
+ * is still running on its stack as curthread; in that case the thread
+ * has to go back there and gets moved at its next context switch.)
  */
 static
 void
 thread_make_runnable(struct thread *target, bool already_have_lock)
 {
-	struct cpu *targetcpu;
-	bool isidle;
+	struct cpu *targetcpu, *c;
+	bool isidle, moved;
 
-	/* Lock the run queue of the target thread's cpu. */
 	targetcpu = target->t_cpu;
+	target->t_madeready = clock_ticks;
+
+	moved = false;
+	if (!already_have_lock && !thread_allowed(target, targetcpu)) {
+		c = thread_pickcpu(target);
+		if (c != NULL) {
+			spinlock_acquire(&targetcpu->c_runqueue_lock);
+			if (targetcpu->c_curthread != target) {
+				target->t_cpu = c;
+				moved = c != targetcpu;
+			}
+			spinlock_release(&targetcpu->c_runqueue_lock);
+			targetcpu = target->t_cpu;
+		}
+	}
 
+	/* Lock the run queue of the target thread's cpu. */
 	if (already_have_lock) {
 		/* The target thread's cpu should be already locked. */
 		KASSERT(spinlock_do_i_hold(&targetcpu->c_runqueue_lock));
@@ -476,8 +746,13 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		spinlock_acquire(&targetcpu->c_runqueue_lock);
 	}
 
+	if (moved) {
+		targetcpu->c_schedstat.ss_migrations++;
+		target->t_schedstat.ss_migrations++;
+	}
+
 	isidle = targetcpu->c_isidle;
-	threadlist_addtail(&targetcpu->c_runqueue, target);
+	runqueue_insert(targetcpu, target);
 	if (isidle) {
 		/*
 		 * Other processor is idle; send interrupt to make
@@ -485,12 +760,123 @@ thread_make_runnable(struct thread *target, bool already_have_lock)
 		 */
 		ipi_send(targetcpu, IPI_UNIDLE);
 	}
+	else if (targetcpu->c_tickperiod > 1) {
+		/*
+		 * It has stretched its tick because it had nothing
+		 * else to run; now it does, so it needs the tick back
+		 * to share the cpu out.
+		 */
+		if (targetcpu == curcpu->c_self) {
+			hardclock_restore();
+		}
+		else {
+			ipi_send(targetcpu, IPI_UNIDLE);
+		}
+	}
 
 	if (!already_have_lock) {
 		spinlock_release(&targetcpu->c_runqueue_lock);
 	}
 }
 
+/*
+ * Requeue threads that yielded on a cpu they're no longer allowed on
+ * (see thread_switch). They had to wait until we were off their
+ * stacks; thread_make_runnable picks them a cpu they may run on.
+ *
+ * The list is per-cpu.
+ */
+static
+void
+thread_sendaway(void)
+{
+	struct thread *t;
+
+	while ((t = threadlist_remhead(&curcpu->c_sendaway)) != NULL) {
+		KASSERT(t != curthread);
+		KASSERT(t->t_state == S_READY);
+		thread_make_runnable(t, false);
+	}
+}
+
+/*
+ * Work stealing.
+ *
+ * A cpu that's about to go idle calls this to take a thread from
+ * somebody else's run queue instead. It looks for the cpu with the
+ * longest run queue, starting the search at a random cpu so that
+ * several idle cpus don't all pile onto the same victim, and takes
+ * the last thread off it (the lowest priority and most recently
+ * queued, which is the one least likely to run there soon).
+ *
+ * The queue lengths are read without locking, as a hint; the victim
+ * is checked again once its lock is held. The caller must not hold
+ * its own run queue lock, because we take the victim's, and two cpus
+ * stealing from each other would otherwise deadlock. The thread is
+ * returned rather than queued, with t_cpu already pointing at the
+ * current cpu. Threads whose affinity excludes us are left alone.
+ */
+static
+struct thread *
+thread_steal(void)
+{
+	unsigned i, start, numcpus, count, bestcount;
+	struct cpu *c, *best;
+	struct thread *t;
+	uint32_t r;
+
+	numcpus = cpuarray_num(&allcpus);
+	if (numcpus < 2) {
+		return NULL;
+	}
+
+	/* xorshift */
+	r = curcpu->c_stealrand;
+	r ^= r << 13;
+	r ^= r >> 17;
+	r ^= r << 5;
+	curcpu->c_stealrand = r;
+	start = r % numcpus;
+
+	best = NULL;
+	bestcount = 0;
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, (start + i) % numcpus);
+		if (c == curcpu->c_self || c->c_isidle) {
+			continue;
+		}
+		count = c->c_runqueue.tl_count;
+		if (count > bestcount) {
+			best = c;
+			bestcount = count;
+		}
+	}
+	if (best == NULL) {
+		return NULL;
+	}
+
+	spinlock_acquire(&best->c_runqueue_lock);
+	THREADLIST_FORALL_REV(t, best->c_runqueue) {
+		/*
+		 * Don't take the victim's curthread; see the comment
+		 * in thread_pickvictim.
+		 */
+		if (t != best->c_curthread &&
+		    thread_allowed(t, curcpu->c_self)) {
+			break;
+		}
+	}
+	if (t != NULL) {
+		threadlist_remove(&best->c_runqueue, t);
+		t->t_cpu = curcpu->c_self;
+		DEBUG(DB_THREADS, "Stole thread %s: cpu %u -> %u",
+		      t->t_name, best->c_number, curcpu->c_number);
+	}
+	spinlock_release(&best->c_runqueue_lock);
+
+	return t;
+}
+
 /*
  * Create a new thread based on an existing one.
  *
@@ -508,18 +894,32 @@ thread_fork(const char *name,
 	    void *data1, unsigned long data2)
 {
 	struct thread *newthread;
-	int result;
+	int result, spl;
 
-	newthread = thread_create(name);
-	if (newthread == NULL) {
-		return ENOMEM;
+	/* Reuse a dead thread and its stack if this cpu has one */
+	spl = splhigh();
+	newthread = threadlist_remhead(&curcpu->c_threadpool);
+	splx(spl);
+	if (newthread != NULL) {
+		KASSERT(newthread->t_stack != NULL);
+		if (thread_init(newthread, name)) {
+			kfree(newthread->t_stack);
+			objcache_free(&thread_cache, newthread);
+			return ENOMEM;
+		}
 	}
+	else {
+		newthread = thread_create(name);
+		if (newthread == NULL) {
+			return ENOMEM;
+		}
 
-	/* Allocate a stack */
-	newthread->t_stack = kmalloc(STACK_SIZE);
-	if (newthread->t_stack == NULL) {
-		thread_destroy(newthread);
-		return ENOMEM;
+		/* Allocate a stack */
+		newthread->t_stack = kmalloc(STACK_SIZE);
+		if (newthread->t_stack == NULL) {
+			thread_destroy(newthread);
+			return ENOMEM;
+		}
 	}
 	thread_checkstack_init(newthread);
 
@@ -529,6 +929,8 @@ thread_fork(const char *name,
 
 	/* Thread subsystem fields */
 	newthread->t_cpu = curthread->t_cpu;
+	newthread->t_priority = curthread->t_priority;
+	newthread->t_cpumask = curthread->t_cpumask;
 
 	/* Attach the new thread to its process */
 	if (proc == NULL) {
@@ -572,6 +974,8 @@ void
 thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 {
 	struct thread *cur, *next;
+	bool sendaway;
+	unsigned idlestart, wait, bucket;
 	int spl;
 
 	DEBUGASSERT(curcpu->c_curthread == curthread);
@@ -597,8 +1001,27 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* Lock the run queue. */
 	spinlock_acquire(&curcpu->c_runqueue_lock);
 
-	/* Micro-optimization: if nothing to do, just return */
-	if (newstate == S_READY && threadlist_isempty(&curcpu->c_runqueue)) {
+	/*
+	 * A thread that yields on a cpu its affinity mask doesn't allow
+	 * is sent away (see thread_sendaway). We can't hand it over to
+	 * another cpu while we're on its stack, so if there's nothing
+	 * else to run here we switch to the idle thread to do it. Until
+	 * the idle threads exist (early in boot) it carries on here.
+	 */
+	sendaway = newstate == S_READY &&
+		!thread_allowed(cur, curcpu->c_self) &&
+		(!threadlist_isempty(&curcpu->c_runqueue) ||
+		 curcpu->c_idlethread != NULL);
+
+	/*
+	 * Micro-optimization: if nothing to do, just return. That
+	 * includes the case where everything waiting is lower
+	 * priority than we are. The idle thread always goes on to
+	 * idle.
+	 */
+	if (newstate == S_READY && !sendaway &&
+	    cur != curcpu->c_idlethread &&
+	    runqueue_toppriority(curcpu) > cur->t_priority) {
 		spinlock_release(&curcpu->c_runqueue_lock);
 		splx(spl);
 		return;
@@ -609,7 +1032,15 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	    case S_RUN:
 		panic("Illegal S_RUN in thread_switch\n");
 	    case S_READY:
-		thread_make_runnable(cur, true /*have lock*/);
+		if (cur == curcpu->c_idlethread) {
+			/* Not queued anywhere; see thread_idle. */
+		}
+		else if (sendaway) {
+			threadlist_addtail(&curcpu->c_sendaway, cur);
+		}
+		else {
+			thread_make_runnable(cur, true /*have lock*/);
+		}
 		break;
 	    case S_SLEEP:
 		cur->t_wchan_name = wc->wc_name;
@@ -631,6 +1062,22 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	}
 	cur->t_state = newstate;
 
+	/*
+	 * Count the switch. It's involuntary if the timer preempted us
+	 * (see hardclock), voluntary otherwise.
+	 */
+	if (cur == curcpu->c_idlethread) {
+		/* Not a real switch. */
+	}
+	else if (newstate == S_READY && cur->t_in_interrupt) {
+		curcpu->c_schedstat.ss_ivswitches++;
+		cur->t_schedstat.ss_ivswitches++;
+	}
+	else {
+		curcpu->c_schedstat.ss_vswitches++;
+		cur->t_schedstat.ss_vswitches++;
+	}
+
 	/*
 	 * Get the next thread. While there isn't one, call md_idle().
 	 * curcpu->c_isidle must be true when md_idle is
@@ -648,18 +1095,57 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	 * lock to look at it, this should not be visible or matter.
 	 */
 
+	/*
+	 * Before idling, try to take a thread from another cpu's run
+	 * queue (see thread_steal). While idle, the cpu's clock tick is
+	 * stretched so it isn't woken up for nothing.
+	 */
+
 	/* The current cpu is now idle. */
 	curcpu->c_isidle = true;
 	do {
 		next = threadlist_remhead(&curcpu->c_runqueue);
-		if (next == NULL) {
+		if (next == NULL && sendaway) {
+			/* Get off cur's stack so it can go elsewhere. */
+			next = curcpu->c_idlethread;
+		}
+		else if (next == NULL) {
+			idlestart = curcpu->c_hardclocks;
+			hardclock_stretch(STRETCH_IDLETICKS);
 			spinlock_release(&curcpu->c_runqueue_lock);
-			cpu_idle();
+			next = thread_steal();
+			if (next == NULL) {
+				cpu_idle();
+			}
+			hardclock_restore();
 			spinlock_acquire(&curcpu->c_runqueue_lock);
+			curcpu->c_schedstat.ss_idleticks +=
+				curcpu->c_hardclocks - idlestart;
+			if (next != NULL) {
+				runqueue_insert(curcpu, next);
+				curcpu->c_schedstat.ss_migrations++;
+				next->t_schedstat.ss_migrations++;
+				next = NULL;
+			}
 		}
 	} while (next == NULL);
 	curcpu->c_isidle = false;
 
+	/* Record how long the next thread waited to run. */
+	if (next != curcpu->c_idlethread) {
+		wait = clock_ticks - next->t_madeready;
+		bucket = 0;
+		while (wait > 0 && bucket < SCHEDSTAT_BUCKETS - 1) {
+			wait >>= 1;
+			bucket++;
+		}
+		curcpu->c_schedstat.ss_latency[bucket]++;
+		next->t_schedstat.ss_latency[bucket]++;
+	}
+
+	/* Remember when we left, for thread_consider_migration. */
+	cur->t_lastran = clock_ticks;
+
 	/*
 	 * Note that curcpu->c_curthread may be the same variable as
 	 * curthread and it may not be, depending on how curthread and
@@ -733,6 +1219,9 @@ thread_switch(threadstate_t newstate, struct wchan *wc, struct spinlock *lk)
 	/* Clean up dead threads. */
 	exorcise();
 
+	/* Pass on threads that can't stay here. */
+	thread_sendaway();
+
 	/* Turn interrupts back on. */
 	splx(spl);
 }
@@ -766,6 +1255,9 @@ thread_startup(void (*entrypoint)(void *data1, unsigned long data2),
 	/* Clean up dead threads. */
 	exorcise();
 
+	/* Pass on threads that can't stay here. */
+	thread_sendaway();
+
 	/* Enable interrupts. */
 	spl0();
 
@@ -828,17 +1320,154 @@ thread_yield(void)
 /*
  * Scheduler.
  *
- * This is called periodically from hardclock(). It should reshuffle
- * the current CPU's run queue by job priority.
+ * This is a multi-level feedback queue. Each thread has a priority
+ * level, and each cpu's run queue is kept sorted by level (see
+ * runqueue_insert), so thread_switch always picks the first thread
+ * at the highest nonempty level and threads within a level take turns.
+ *
+ * A thread that runs through its whole quantum is presumed to be
+ * compute-bound and drops a level, where it gets a longer quantum but
+ * runs only when nothing above it is ready. A thread that sleeps (on
+ * I/O, or a lock) is raised on wakeup, so interactive jobs stay near
+ * the top. To keep low-priority threads from starving, schedule()
+ * raises any thread that has been waiting on the run queue for
+ * mlfq_agingticks.
+ */
+
+unsigned mlfq_quantum = 1;
+unsigned mlfq_wakeboost = 1;
+unsigned mlfq_agingticks = HZ / 2;
+
+#define MLFQ_QUANTUM(level) (mlfq_quantum << (level))
+
+/*
+ * Charge the current thread for TICKS hardclocks.
+ */
+bool
+thread_tick(unsigned ticks)
+{
+	struct thread *cur;
+	bool ret;
+
+	if (curcpu->c_isidle) {
+		return false;
+	}
+
+	cur = curthread;
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	cur->t_ticks += ticks;
+	if (cur->t_ticks >= MLFQ_QUANTUM(cur->t_priority)) {
+		cur->t_ticks = 0;
+		if (cur->t_priority < MLFQ_LEVELS - 1) {
+			cur->t_priority++;
+		}
+		ret = true;
+	}
+	else {
+		ret = runqueue_toppriority(curcpu) < cur->t_priority;
+	}
+	if (threadlist_isempty(&curcpu->c_runqueue)) {
+		/* Nobody to share with; don't tick until we must. */
+		hardclock_stretch(STRETCH_BUSYTICKS);
+		ret = false;
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	return ret;
+}
+
+/*
+ * Raise a thread that's being woken up.
  */
+static
+void
+thread_wakeboost(struct thread *t)
+{
+	t->t_priority = t->t_priority > mlfq_wakeboost ?
+		t->t_priority - mlfq_wakeboost : 0;
+	t->t_ticks = 0;
+}
 
+/*
+ * This is called periodically from hardclock(). It ages the current
+ * CPU's run queue: threads that have been waiting too long move up a
+ * level.
+ */
 void
 schedule(void)
 {
-	/*
-	 * You can write this. If we do nothing, threads will run in
-	 * round-robin fashion.
-	 */
+	struct threadlist aged;
+	struct thread *t, *next;
+	uint32_t now;
+
+	threadlist_init(&aged);
+
+	spinlock_acquire(&curcpu->c_runqueue_lock);
+	now = clock_ticks;
+	for (t = curcpu->c_runqueue.tl_head.tln_next->tln_self;
+	     t != NULL; t = next) {
+		next = t->t_listnode.tln_next->tln_self;
+		if (t->t_priority > 0 &&
+		    now - t->t_readysince >= mlfq_agingticks) {
+			threadlist_remove(&curcpu->c_runqueue, t);
+			t->t_priority--;
+			t->t_ticks = 0;
+			threadlist_addtail(&aged, t);
+		}
+	}
+	while ((t = threadlist_remhead(&aged)) != NULL) {
+		runqueue_insert(curcpu, t);
+	}
+	spinlock_release(&curcpu->c_runqueue_lock);
+
+	threadlist_cleanup(&aged);
+}
+
+/*
+ * Choose the thread on cpu C's run queue that should be the next to
+ * migrate, or return NULL if none can. We prefer whichever has been
+ * off-cpu longest, as its cache footprint here has most likely
+ * decayed anyway; threads that have never run count as oldest. Ties
+ * go to the one further back in the queue. Threads pinned to C are
+ * not candidates.
+ *
+ * Ordinarily, curthread will not appear on the run queue. However, it
+ * can under the following circumstances:
+ *   - it went to sleep;
+ *   - the processor became idle, so it remained curthread;
+ *   - it was reawakened, so it was put on the run queue;
+ *   - and the processor hasn't fully unidled yet, so all these
+ *     things are still true.
+ *
+ * If the timer interrupt happens at (almost) exactly the proper
+ * moment, we can come here while things are in this state and see
+ * curthread. However, *migrating* curthread can cause bad things to
+ * happen (Exercise: Why? And what?) so skip it.
+ */
+static
+struct thread *
+thread_pickvictim(struct cpu *c, uint32_t now)
+{
+	struct thread *t, *best;
+	uint32_t bestage;
+
+	KASSERT(spinlock_do_i_hold(&c->c_runqueue_lock));
+
+	best = NULL;
+	bestage = 0;
+	THREADLIST_FORALL(t, c->c_runqueue) {
+		if (t == c->c_curthread) {
+			continue;
+		}
+		if ((t->t_cpumask & ~((uint32_t)1 << c->c_number)) == 0) {
+			continue;
+		}
+		if (best == NULL || now - t->t_lastran >= bestage) {
+			best = t;
+			bestage = now - t->t_lastran;
+		}
+	}
+	return best;
 }
 
 /*
@@ -848,11 +1477,18 @@ schedule(void)
  * CPU is busy and other CPUs are idle, or less busy, it should move
  * threads across to those other other CPUs.
  *
+ * Idle CPUs don't wait for this; they pull work for themselves in
+ * thread_switch (see thread_steal). This push pass still evens out
+ * CPUs that are busy but unevenly loaded.
+ *
  * Migrating threads isn't free because of cache affinity; a thread's
  * working cache set will end up having to be moved to the other CPU,
  * which is fairly slow. The tradeoff between this performance loss
  * and the performance loss due to underutilization of some CPUs is
  * something that needs to be tuned and probably is workload-specific.
+ * To keep the cost down we move the threads that have gone longest
+ * without running (see thread_pickvictim), and each only to a CPU
+ * its affinity mask allows.
  *
  * For here and now, because we know we're running on System/161 and
  * System/161 does not (yet) model such cache effects, we'll be very
@@ -865,7 +1501,8 @@ thread_consider_migration(void)
 	unsigned i, numcpus;
 	struct cpu *c;
 	struct threadlist victims;
-	struct thread *t;
+	struct thread *t, *next;
+	uint32_t now;
 
 	my_count = total_count = 0;
 	numcpus = cpuarray_num(&allcpus);
@@ -884,57 +1521,42 @@ thread_consider_migration(void)
 		return;
 	}
 
+	/* Collect the victims, oldest first. */
 	to_send = my_count - one_share;
 	threadlist_init(&victims);
 	spinlock_acquire(&curcpu->c_runqueue_lock);
+	now = clock_ticks;
 	for (i=0; i<to_send; i++) {
-		t = threadlist_remtail(&curcpu->c_runqueue);
-		threadlist_addhead(&victims, t);
+		t = thread_pickvictim(curcpu->c_self, now);
+		if (t == NULL) {
+			break;
+		}
+		threadlist_remove(&curcpu->c_runqueue, t);
+		threadlist_addtail(&victims, t);
 	}
 	spinlock_release(&curcpu->c_runqueue_lock);
 
-	for (i=0; i < numcpus && to_send > 0; i++) {
+	for (i=0; i < numcpus && !threadlist_isempty(&victims); i++) {
 		c = cpuarray_get(&allcpus, i);
 		if (c == curcpu->c_self) {
 			continue;
 		}
 		spinlock_acquire(&c->c_runqueue_lock);
-		while (c->c_runqueue.tl_count < one_share && to_send > 0) {
-			t = threadlist_remhead(&victims);
-			/*
-			 * Ordinarily, curthread will not appear on
-			 * the run queue. However, it can under the
-			 * following circumstances:
-			 *   - it went to sleep;
-			 *   - the processor became idle, so it
-			 *     remained curthread;
-			 *   - it was reawakened, so it was put on the
-			 *     run queue;
-			 *   - and the processor hasn't fully unidled
-			 *     yet, so all these things are still true.
-			 *
-			 * If the timer interrupt happens at (almost)
-			 * exactly the proper moment, we can come here
-			 * while things are in this state and see
-			 * curthread. However, *migrating* curthread
-			 * can cause bad things to happen (Exercise:
-			 * Why? And what?) so shuffle it to the end of
-			 * the list and decrement to_send in order to
-			 * skip it. Then it goes back on our own run
-			 * queue below.
-			 */
-			if (t == curthread) {
-				threadlist_addtail(&victims, t);
-				to_send--;
+		for (t = victims.tl_head.tln_next->tln_self;
+		     t != NULL && c->c_runqueue.tl_count < one_share;
+		     t = next) {
+			next = t->t_listnode.tln_next->tln_self;
+			if (!thread_allowed(t, c)) {
 				continue;
 			}
-
+			threadlist_remove(&victims, t);
 			t->t_cpu = c;
-			threadlist_addtail(&c->c_runqueue, t);
+			runqueue_insert(c, t);
+			c->c_schedstat.ss_migrations++;
+			t->t_schedstat.ss_migrations++;
 			DEBUG(DB_THREADS,
 			      "Migrated thread %s: cpu %u -> %u",
 			      t->t_name, curcpu->c_number, c->c_number);
-			to_send--;
 			if (c->c_isidle) {
 				/*
 				 * Other processor is idle; send
@@ -948,13 +1570,14 @@ thread_consider_migration(void)
 
 	/*
 	 * Because the code above isn't atomic, the thread counts may have
-	 * changed while we were working and we may end up with leftovers.
-	 * Don't panic; just put them back on our own run queue.
+	 * changed while we were working, and some victims may not have
+	 * been allowed on any CPU that had room; we may end up with
+	 * leftovers. Don't panic; just put them back on our own run queue.
 	 */
 	if (!threadlist_isempty(&victims)) {
 		spinlock_acquire(&curcpu->c_runqueue_lock);
 		while ((t = threadlist_remhead(&victims)) != NULL) {
-			threadlist_addtail(&curcpu->c_runqueue, t);
+			runqueue_insert(curcpu, t);
 		}
 		spinlock_release(&curcpu->c_runqueue_lock);
 	}
@@ -963,6 +1586,115 @@ thread_consider_migration(void)
 	threadlist_cleanup(&victims);
 }
 
+/*
+ * Restrict the current thread to the CPUs in MASK.
+ */
+int
+thread_setaffinity(uint32_t mask)
+{
+	unsigned numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	if (numcpus < 32) {
+		mask &= ((uint32_t)1 << numcpus) - 1;
+	}
+	if (mask == 0) {
+		return EINVAL;
+	}
+
+	curthread->t_cpumask = mask;
+	if (!thread_allowed(curthread, curcpu->c_self)) {
+		/* Move now (see thread_switch). */
+		thread_yield();
+	}
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Scheduler statistics.
+ *
+ * The per-cpu counters are updated under the cpu's run queue lock, and
+ * copied under it here; the per-thread ones are only updated by
+ * thread_switch and the migration paths, so copying the current
+ * thread's with interrupts off is enough.
+ */
+int
+thread_getschedstat(int which, struct schedstat *ss)
+{
+	struct cpu *c;
+	int spl;
+
+	if (which == SCHEDSTAT_SELF) {
+		spl = splhigh();
+		*ss = curthread->t_schedstat;
+		splx(spl);
+		return 0;
+	}
+	if (which < 0 || (unsigned)which >= cpuarray_num(&allcpus)) {
+		return EINVAL;
+	}
+	c = cpuarray_get(&allcpus, which);
+	spinlock_acquire(&c->c_runqueue_lock);
+	*ss = c->c_schedstat;
+	spinlock_release(&c->c_runqueue_lock);
+	return 0;
+}
+
+void
+schedstat_print(void)
+{
+	struct schedstat ss;
+	unsigned i, j, numcpus;
+
+	kprintf("cpu    vswitch   ivswitch    migrate   idletick\n");
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		thread_getschedstat(i, &ss);
+		kprintf("%3u %10u %10u %10u %10u\n", i, ss.ss_vswitches,
+			ss.ss_ivswitches, ss.ss_migrations, ss.ss_idleticks);
+	}
+
+	kprintf("\nRun queue latency (hardclocks):\n");
+	kprintf("cpu");
+	for (j=0; j<SCHEDSTAT_BUCKETS; j++) {
+		if (j == 0) {
+			kprintf("     <1");
+		}
+		else if (j == SCHEDSTAT_BUCKETS - 1) {
+			kprintf("  >=%-3u", 1U << (j - 1));
+		}
+		else {
+			kprintf("  <%-4u", 1U << j);
+		}
+	}
+	kprintf("\n");
+	for (i=0; i<numcpus; i++) {
+		thread_getschedstat(i, &ss);
+		kprintf("%3u", i);
+		for (j=0; j<SCHEDSTAT_BUCKETS; j++) {
+			kprintf(" %6u", ss.ss_latency[j]);
+		}
+		kprintf("\n");
+	}
+}
+
+void
+schedstat_reset(void)
+{
+	struct cpu *c;
+	unsigned i, numcpus;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		spinlock_acquire(&c->c_runqueue_lock);
+		bzero(&c->c_schedstat, sizeof(c->c_schedstat));
+		spinlock_release(&c->c_runqueue_lock);
+	}
+}
+
 ////////////////////////////////////////////////////////////
 
 /*
@@ -983,7 +1715,7 @@ wchan_create(const char *name)
 	struct wchan *wc;
 	int result;
 
-	wc = kmalloc(sizeof(*wc));
+	wc = objcache_alloc(&wchan_cache);
 	if (wc == NULL) {
 		return NULL;
 	}
@@ -997,7 +1729,7 @@ wchan_create(const char *name)
 	if (result) {
 		KASSERT(result == ENOMEM);
 		threadlist_cleanup(&wc->wc_threads);
-		kfree(wc);
+		objcache_free(&wchan_cache, wc);
 		return NULL;
 	}
 
@@ -1028,7 +1760,7 @@ wchan_destroy(struct wchan *wc)
 	spinlock_release(&allwchans_lock);
 
 	threadlist_cleanup(&wc->wc_threads);
-	kfree(wc);
+	objcache_free(&wchan_cache, wc);
 }
 
 /*
@@ -1057,7 +1789,7 @@ wchan_sleep(struct wchan *wc, struct spinlock *lk)
 /*
  * Wake up one thread sleeping on a wait channel.
  */
-void
+bool
 wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 {
 	struct thread *target;
@@ -1069,7 +1801,7 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 
 	if (target == NULL) {
 		/* Nobody was sleeping. */
-		return;
+		return false;
 	}
 
 	/*
@@ -1080,7 +1812,9 @@ wchan_wakeone(struct wchan *wc, struct spinlock *lk)
 	 * in thread_sleep.
 	 */
 
+	thread_wakeboost(target);
 	thread_make_runnable(target, false);
+	return true;
 }
 
 /*
@@ -1110,12 +1844,71 @@ wchan_wakeall(struct wchan *wc, struct spinlock *lk)
 	 * make each thread runnable.
 	 */
 	while ((target = threadlist_remhead(&list)) != NULL) {
+		thread_wakeboost(target);
 		thread_make_runnable(target, false);
 	}
 
 	threadlist_cleanup(&list);
 }
 
+/*
+ * Wake a particular thread, if it's sleeping on the wait channel.
+ */
+bool
+wchan_wakethread(struct wchan *wc, struct thread *t, struct spinlock *lk)
+{
+	struct thread *target;
+
+	KASSERT(spinlock_do_i_hold(lk));
+
+	THREADLIST_FORALL(target, wc->wc_threads) {
+		if (target == t) {
+			threadlist_remove(&wc->wc_threads, t);
+			thread_wakeboost(t);
+			thread_make_runnable(t, false);
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Move one thread from one wait channel to another.
+ */
+void
+wchan_moveone(struct wchan *from, struct spinlock *fromlk,
+	      struct wchan *to, struct spinlock *tolk)
+{
+	struct thread *target;
+
+	KASSERT(spinlock_do_i_hold(fromlk));
+	KASSERT(spinlock_do_i_hold(tolk));
+
+	target = threadlist_remhead(&from->wc_threads);
+	if (target != NULL) {
+		target->t_wchan_name = to->wc_name;
+		threadlist_addtail(&to->wc_threads, target);
+	}
+}
+
+/*
+ * Move all threads from one wait channel to another.
+ */
+void
+wchan_moveall(struct wchan *from, struct spinlock *fromlk,
+	      struct wchan *to, struct spinlock *tolk)
+{
+	struct thread *target;
+
+	KASSERT(spinlock_do_i_hold(fromlk));
+	KASSERT(spinlock_do_i_hold(tolk));
+
+	while ((target = threadlist_remhead(&from->wc_threads)) != NULL) {
+		target->t_wchan_name = to->wc_name;
+		threadlist_addtail(&to->wc_threads, target);
+	}
+}
+
 /*
  * Return nonzero if there are no threads sleeping on the channel.
  * This is meant to be used only for diagnostic purposes.
@@ -1165,26 +1958,85 @@ ipi_broadcast(int code)
 	}
 }
 
-void
-ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+/*
+ * Queue NUM shootdowns on TARGET and poke it with one IPI. If they
+ * don't all fit, the target flushes its whole TLB instead. Returns
+ * the target's shootdown generation as of queueing; once it changes,
+ * the batch has been processed.
+ */
+static
+unsigned
+ipi_tlbshootdown_batch(struct cpu *target,
+		       const struct tlbshootdown *mappings, unsigned num)
 {
+	unsigned i, gen;
 	int n;
 
 	spinlock_acquire(&target->c_ipi_lock);
 
 	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
-		target->c_numshootdown = TLBSHOOTDOWN_ALL;
-	}
-	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+	for (i=0; i<num && n != TLBSHOOTDOWN_ALL; i++) {
+		if (n == TLBSHOOTDOWN_MAX) {
+			n = TLBSHOOTDOWN_ALL;
+		}
+		else {
+			target->c_shootdown[n] = mappings[i];
+			n++;
+		}
 	}
+	target->c_numshootdown = n;
+	gen = target->c_shootdown_gen;
 
 	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
 	mainbus_send_ipi(target);
 
 	spinlock_release(&target->c_ipi_lock);
+
+	return gen;
+}
+
+void
+ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
+{
+	ipi_tlbshootdown_batch(target, mapping, 1);
+}
+
+void
+ipi_tlbshootdown_mask(uint32_t cpumask,
+		      const struct tlbshootdown *mappings, unsigned num)
+{
+	unsigned gens[MAXCPUS];
+	unsigned i, numcpus;
+	struct cpu *c;
+
+	/* We wait for the other cpus; they must be able to interrupt us. */
+	KASSERT(!curthread->t_in_interrupt);
+	KASSERT(curthread->t_curspl == 0);
+	KASSERT(curcpu->c_spinlocks == 0);
+
+	cpumask &= ~((uint32_t)1 << curcpu->c_number);
+	if (cpumask == 0) {
+		return;
+	}
+
+	/* Send everything first so the targets work in parallel... */
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (cpumask & ((uint32_t)1 << c->c_number)) {
+			gens[i] = ipi_tlbshootdown_batch(c, mappings, num);
+		}
+	}
+
+	/* ...then wait for each of them to finish. */
+	for (i=0; i<numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (cpumask & ((uint32_t)1 << c->c_number)) {
+			while (c->c_shootdown_gen == gens[i]) {
+				/* spin */
+			}
+		}
+	}
 }
 
 void
@@ -1216,8 +2068,10 @@ interprocessor_interrupt(void)
 	if (bits & (1U << IPI_UNIDLE)) {
 		/*
 		 * The cpu has already unidled itself to take the
-		 * interrupt; don't need to do anything else.
+		 * interrupt; all that's left is to restore its clock
+		 * tick if it was stretched.
 		 */
+		hardclock_restore();
 	}
 	if (bits & (1U << IPI_TLBSHOOTDOWN)) {
 		if (curcpu->c_numshootdown == TLBSHOOTDOWN_ALL) {
@@ -1229,6 +2083,7 @@ interprocessor_interrupt(void)
 			}
 		}
 		curcpu->c_numshootdown = 0;
+		curcpu->c_shootdown_gen++;
 	}
 
 	curcpu->c_ipi_pending = 0;
@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Work queues and their worker threads.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <thread.h>
+#include <current.h>
+#include <workqueue.h>
+
+struct workqueue {
+	struct spinlock wq_lock;
+	struct work *wq_head;		/* Queued work, oldest first */
+	struct work **wq_tailp;		/* Link to put new work on */
+	struct work *wq_running;	/* Work being run, if any */
+	struct thread *wq_worker;	/* Thread serving the queue */
+	struct wchan *wq_wchan;		/* Worker waits for work here */
+	struct wchan *wq_donewchan;	/* work_cancel waits here */
+};
+
+/*
+ * Create a queue for a cpu.
+ */
+struct workqueue *
+workqueue_create(void)
+{
+	struct workqueue *wq;
+
+	wq = kmalloc(sizeof(*wq));
+	if (wq == NULL) {
+		return NULL;
+	}
+	spinlock_init(&wq->wq_lock);
+	spinlock_setname(&wq->wq_lock, "workqueue");
+	wq->wq_head = NULL;
+	wq->wq_tailp = &wq->wq_head;
+	wq->wq_running = NULL;
+	wq->wq_worker = NULL;
+	wq->wq_wchan = wchan_create("workq");
+	if (wq->wq_wchan == NULL) {
+		kfree(wq);
+		return NULL;
+	}
+	wq->wq_donewchan = wchan_create("workq done");
+	if (wq->wq_donewchan == NULL) {
+		wchan_destroy(wq->wq_wchan);
+		kfree(wq);
+		return NULL;
+	}
+	return wq;
+}
+
+/*
+ * Take a work item off its queue.
+ */
+static
+void
+workqueue_remove(struct workqueue *wq, struct work *w)
+{
+	struct work **pp;
+
+	KASSERT(spinlock_do_i_hold(&wq->wq_lock));
+	KASSERT(w->w_pending);
+	KASSERT(w->w_queue == wq);
+
+	for (pp = &wq->wq_head; *pp != w; pp = &(*pp)->w_next) {
+		KASSERT(*pp != NULL);
+	}
+	*pp = w->w_next;
+	if (wq->wq_tailp == &w->w_next) {
+		wq->wq_tailp = pp;
+	}
+	w->w_next = NULL;
+	w->w_pending = false;
+}
+
+/*
+ * The worker thread: run work from the queue, in order, forever.
+ */
+static
+void
+workqueue_worker(void *vwq, unsigned long cpunum)
+{
+	struct workqueue *wq = vwq;
+	struct work *w;
+	int result;
+
+	/* Stay on our own cpu, where our work was queued. */
+	result = thread_setaffinity((uint32_t)1 << cpunum);
+	KASSERT(result == 0);
+
+	spinlock_acquire(&wq->wq_lock);
+	wq->wq_worker = curthread;
+	while (1) {
+		w = wq->wq_head;
+		if (w == NULL) {
+			wchan_sleep(wq->wq_wchan, &wq->wq_lock);
+			continue;
+		}
+		workqueue_remove(wq, w);
+		wq->wq_running = w;
+		spinlock_release(&wq->wq_lock);
+
+		/* W may be gone when this returns. */
+		w->w_func(w->w_arg);
+
+		spinlock_acquire(&wq->wq_lock);
+		wq->wq_running = NULL;
+		wchan_wakeall(wq->wq_donewchan, &wq->wq_lock);
+	}
+}
+
+/*
+ * Start the worker for a cpu's queue.
+ */
+void
+workqueue_start(struct workqueue *wq, unsigned cpunum)
+{
+	char name[16];
+	int result;
+
+	snprintf(name, sizeof(name), "workq/%u", cpunum);
+	result = thread_fork(name, NULL, workqueue_worker, wq, cpunum);
+	if (result) {
+		panic("workqueue_start: thread_fork: %s\n", strerror(result));
+	}
+}
+
+/*
+ * Callout function for work_schedule.
+ */
+static
+void
+work_timeout(void *vw)
+{
+	work_queue(vw);
+}
+
+void
+work_init(struct work *w, void (*func)(void *), void *arg)
+{
+	w->w_next = NULL;
+	w->w_queue = NULL;
+	w->w_pending = false;
+	callout_init(&w->w_callout, work_timeout, w);
+	w->w_func = func;
+	w->w_arg = arg;
+}
+
+bool
+work_queue(struct work *w)
+{
+	struct workqueue *wq;
+
+	wq = curcpu->c_workqueue;
+	spinlock_acquire(&wq->wq_lock);
+	if (w->w_pending) {
+		spinlock_release(&wq->wq_lock);
+		return false;
+	}
+	w->w_next = NULL;
+	*wq->wq_tailp = w;
+	wq->wq_tailp = &w->w_next;
+	w->w_queue = wq;
+	w->w_pending = true;
+	wchan_wakeone(wq->wq_wchan, &wq->wq_lock);
+	spinlock_release(&wq->wq_lock);
+	return true;
+}
+
+void
+work_schedule(struct work *w, unsigned ticks)
+{
+	callout_schedule(&w->w_callout, ticks);
+}
+
+bool
+work_cancel(struct work *w)
+{
+	struct workqueue *wq;
+
+	if (callout_stop(&w->w_callout)) {
+		return true;
+	}
+
+	while (1) {
+		wq = w->w_queue;
+		if (wq == NULL) {
+			return false;
+		}
+		spinlock_acquire(&wq->wq_lock);
+		if (w->w_queue != wq) {
+			/* Moved while we weren't looking */
+			spinlock_release(&wq->wq_lock);
+			continue;
+		}
+		if (w->w_pending) {
+			workqueue_remove(wq, w);
+			spinlock_release(&wq->wq_lock);
+			return true;
+		}
+		if (wq->wq_running == w && curthread != wq->wq_worker) {
+			/* Wait for it to finish. */
+			while (wq->wq_running == w) {
+				wchan_sleep(wq->wq_donewchan, &wq->wq_lock);
+			}
+		}
+		spinlock_release(&wq->wq_lock);
+		return false;
+	}
+}
@@ -30,15 +30,20 @@
 
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/mman.h>
 #include <lib.h>
 #include <spl.h>
 #include <spinlock.h>
+#include <synch.h>
 #include <proc.h>
+#include <cpu.h>
 #include <current.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <objcache.h>
 #include <elf.h>
+#include <workqueue.h>
 
 #define OFFSET_MASK 0x00000fff
 #define FIRST_TABLE_INDEX_MASK 0xffc00000
@@ -51,18 +56,28 @@
  */
 struct region* create_region(vaddr_t vbase, size_t npages,
 		int readable, int writeable, int executable);
+/*
+ * Page table entries and regions come and go on every fault and fork,
+ * so they get their own caches.
+ */
+static struct objcache pte_cache =
+	OBJCACHE_INITIALIZER("pte", sizeof(struct page_table_entry), NULL, NULL);
+static struct objcache region_cache =
+	OBJCACHE_INITIALIZER("region", sizeof(struct region), NULL, NULL);
+
 void add_region(struct addrspace* as, struct region* new_region);
 struct region* deep_copy_region(struct region* old);
 void destroy_regions(struct addrspace* as, struct region* region);
 struct region* retrieve_region(struct addrspace* as, vaddr_t faultaddress);
 
 struct region* create_region(vaddr_t vbase, size_t npages, int readable, int writeable, int executable) {
-	struct region* new_region = (struct region*) kmalloc(sizeof(struct region));
+	struct region* new_region = objcache_alloc(&region_cache);
 	new_region->vbase = vbase;
 	new_region->npages = npages;
 	new_region->readable = readable;
 	new_region->writeable = writeable;
 	new_region->executable = executable;
+	new_region->advice = MADV_NORMAL;
 	new_region->next = NULL;
 
 	return new_region;
@@ -82,12 +97,13 @@ void add_region(struct addrspace* as, struct region* new_region) {
 
 struct region* deep_copy_region(struct region* old) {
 	if (old != NULL) {
-		struct region* new = (struct region*) kmalloc(sizeof(struct region));
+		struct region* new = objcache_alloc(&region_cache);
 		new->vbase = old->vbase;
 		new->npages = old->npages;
 		new->readable = old->readable;
 		new->writeable = old->writeable;
 		new->executable = old->executable;
+		new->advice = old->advice;
 		new->next = deep_copy_region(old->next);
 		return new;
 	} else {
@@ -99,10 +115,14 @@ void destroy_regions(struct addrspace* as, struct region* region) {
 	if (region != NULL) {
 		as->num_regions--;
 		destroy_regions(as, region->next);
-		kfree(region);
+		objcache_free(&region_cache, region);
 	}
 }
 
+/*
+ * Find the region containing FAULTADDRESS. The caller holds
+ * as_regionlock, shared or exclusive.
+ */
 struct region* retrieve_region(struct addrspace* as, vaddr_t faultaddress) {
 	struct region* curr_region = as->first_region;
 	while (curr_region != NULL) {
@@ -122,10 +142,15 @@ struct region* retrieve_region(struct addrspace* as, vaddr_t faultaddress) {
  * Page table helper functions:
  */
 struct page_table_entry* create_page_table(paddr_t pbase, int is_dirty, int is_valid, int index, int offset) {
-	struct page_table_entry* new_pte = (struct page_table_entry*) kmalloc(sizeof(struct page_table_entry));
+	struct page_table_entry* new_pte = objcache_alloc(&pte_cache);
+	if (new_pte == NULL) {
+		return NULL;
+	}
 	new_pte->pbase = pbase;
 	new_pte->is_dirty = is_dirty;
 	new_pte->is_valid = is_valid;
+	new_pte->is_locked = 0;
+	new_pte->is_loaded = 0;
 	new_pte->index = index;
 	new_pte->offset = offset;
 	new_pte->next = NULL;
@@ -163,6 +188,7 @@ struct page_table_entry* deep_copy_page_table(struct page_table_entry* old) {
 		if (new_pte == NULL) {
 			return NULL;
 		}
+		new_pte->is_loaded = old->is_loaded;
 
 		memmove((void *)PADDR_TO_KVADDR(page_location), (const void *)PADDR_TO_KVADDR(old->pbase), PAGE_SIZE);
 
@@ -196,23 +222,33 @@ struct page_table_entry* destroy_page_table_entry(struct page_table_entry* head,
 
 		if (prev == NULL) {
 			struct page_table_entry* new_next = curr->next;
-			kfree(curr);
+			objcache_free(&pte_cache, curr);
 			return new_next;
 		}
 		prev->next = curr->next;
-		kfree(curr);
+		objcache_free(&pte_cache, curr);
 		return head;
 	}
 }
 
+/*
+ * Find (or with CREATE_FLAG, make) the entry for VADDR. The caller
+ * holds as_regionlock; shared is enough, because several threads of
+ * one process can fault at once and as_ptlock keeps them from both
+ * inserting. Entries are only removed with as_regionlock held
+ * exclusive, so the result stays valid until the caller lets go of
+ * as_regionlock.
+ */
 struct page_table_entry* page_walk(vaddr_t vaddr, struct addrspace* as, int create_flag) {
 	int first_index = (vaddr & FIRST_TABLE_INDEX_MASK) >> 22;
 	int second_index = ((vaddr & SECOND_TABLE_INDEX_MASK) >> 12);
 	size_t offset = vaddr & OFFSET_MASK;
 
+	lock_acquire(as->as_ptlock);
 	struct page_table_entry* current_table_entry = as->page_directory[first_index];
 	while (current_table_entry != NULL) {
 		if (current_table_entry->index == second_index) {
+			lock_release(as->as_ptlock);
 			return current_table_entry;
 		}
 
@@ -222,19 +258,317 @@ struct page_table_entry* page_walk(vaddr_t vaddr, struct addrspace* as, int crea
 	// We didn't find an existing page entry
 	if (create_flag) {
 		paddr_t page_location = getppages(1);
-		KASSERT(page_location != 0);
+		if (page_location == 0) {
+			lock_release(as->as_ptlock);
+			return NULL;
+		}
 		KASSERT((page_location & PAGE_FRAME) == page_location);
 
 		struct page_table_entry* new_pte = create_page_table(page_location, 1, 1, second_index, offset);
-		
+		if (new_pte == NULL) {
+			lock_release(as->as_ptlock);
+			free_kpages(PADDR_TO_KVADDR(page_location));
+			return NULL;
+		}
+
 		KASSERT((new_pte->pbase & PAGE_FRAME) == new_pte->pbase);
+		new_pte->is_loaded = as->as_loading;
 		as->page_directory[first_index] = add_page_table_entry(as->page_directory[first_index], new_pte);
+		lock_release(as->as_ptlock);
 		return new_pte;
 	}
 
+	lock_release(as->as_ptlock);
 	return NULL;
 }
 
+/*
+ * Memory hint helpers:
+ */
+
+/*
+ * Check that VADDR is page-aligned and that each of the NPAGES pages
+ * from there lies within a defined region of AS.
+ */
+static int as_checkrange(struct addrspace* as, vaddr_t vaddr, size_t npages) {
+	size_t i;
+
+	if ((vaddr & PAGE_FRAME) != vaddr) {
+		return EINVAL;
+	}
+	if (npages == 0 || npages > (USERSPACETOP - vaddr) / PAGE_SIZE) {
+		return ENOMEM;
+	}
+
+	for (i = 0; i < npages; i++) {
+		if (retrieve_region(as, vaddr + i * PAGE_SIZE) == NULL) {
+			return ENOMEM;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Unmap up to TLBSHOOTDOWN_MAX pages, shoot their translations out of
+ * every TLB in one round of IPIs, then free the frames. The frames
+ * must not be reused until no CPU can still reach them. The caller
+ * holds as_regionlock exclusive, so no other thread of the process
+ * can be faulting the pages back in meanwhile.
+ */
+static void as_dropframes(struct addrspace* as, const vaddr_t* vaddrs, unsigned num) {
+	paddr_t pbases[TLBSHOOTDOWN_MAX];
+	struct page_table_entry* pte;
+	unsigned i, n = 0;
+
+	KASSERT(num <= TLBSHOOTDOWN_MAX);
+	KASSERT(rwlock_do_i_hold_write(as->as_regionlock));
+
+	for (i = 0; i < num; i++) {
+		int first_index = (vaddrs[i] & FIRST_TABLE_INDEX_MASK) >> 22;
+		int second_index = ((vaddrs[i] & SECOND_TABLE_INDEX_MASK) >> 12);
+
+		pte = page_walk(vaddrs[i], as, 0);
+		KASSERT(pte != NULL && !pte->is_locked);
+		pbases[n++] = pte->pbase;
+		as->page_directory[first_index] = destroy_page_table_entry(as->page_directory[first_index], second_index);
+	}
+
+	vm_tlbshootdown_batch(as, vaddrs, num);
+
+	for (i = 0; i < n; i++) {
+		free_kpages(PADDR_TO_KVADDR(pbases[i]));
+	}
+}
+
+int as_prefault(struct addrspace* as, vaddr_t vaddr, size_t npages) {
+	struct region* region;
+	size_t i;
+	int result = 0;
+
+	rwlock_acquire_read(as->as_regionlock);
+	region = retrieve_region(as, vaddr);
+	if (region == NULL) {
+		rwlock_release_read(as->as_regionlock);
+		return EFAULT;
+	}
+
+	for (i = 0; i < npages; i++) {
+		vaddr_t va = vaddr + i * PAGE_SIZE;
+		if (va >= region->vbase + region->npages * PAGE_SIZE) {
+			break;
+		}
+		if (page_walk(va, as, 1) == NULL) {
+			result = ENOMEM;
+			break;
+		}
+	}
+	rwlock_release_read(as->as_regionlock);
+	return result;
+}
+
+/*
+ * The access-pattern hints (NORMAL, RANDOM, SEQUENTIAL) are recorded
+ * per region, so a hint covering part of a region applies to all of
+ * it. WILLNEED faults the pages in now; DONTNEED frees the frames of
+ * anonymous pages (stack, and BSS that the loader never touched).
+ * Pages holding data loaded from the executable can't be freed, since
+ * a fault can only bring them back zeroed, not reload them, so like
+ * locked pages they make DONTNEED fail with EINVAL.
+ */
+static int as_doadvise(struct addrspace* as, vaddr_t vaddr, size_t len, int advice) {
+	size_t npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+	vaddr_t batch[TLBSHOOTDOWN_MAX];
+	struct page_table_entry* pte;
+	struct region* region;
+	unsigned n;
+	size_t i;
+	int result;
+
+	if (len > USERSPACETOP) {
+		return ENOMEM;
+	}
+	result = as_checkrange(as, vaddr, npages);
+	if (result) {
+		return result;
+	}
+
+	switch (advice) {
+		case MADV_NORMAL:
+		case MADV_RANDOM:
+		case MADV_SEQUENTIAL:
+			for (i = 0; i < npages; i++) {
+				region = retrieve_region(as, vaddr + i * PAGE_SIZE);
+				KASSERT(region != NULL);
+				region->advice = advice;
+			}
+			return 0;
+		case MADV_WILLNEED:
+			for (i = 0; i < npages; i++) {
+				if (page_walk(vaddr + i * PAGE_SIZE, as, 1) == NULL) {
+					return EAGAIN;
+				}
+			}
+			return 0;
+		case MADV_DONTNEED:
+			/*
+			 * Locked and loaded pages stay put; refuse before
+			 * touching anything.
+			 */
+			for (i = 0; i < npages; i++) {
+				pte = page_walk(vaddr + i * PAGE_SIZE, as, 0);
+				if (pte != NULL && (pte->is_locked || pte->is_loaded)) {
+					return EINVAL;
+				}
+			}
+			n = 0;
+			for (i = 0; i < npages; i++) {
+				pte = page_walk(vaddr + i * PAGE_SIZE, as, 0);
+				if (pte == NULL) {
+					continue;
+				}
+				batch[n++] = vaddr + i * PAGE_SIZE;
+				if (n == TLBSHOOTDOWN_MAX) {
+					as_dropframes(as, batch, n);
+					n = 0;
+				}
+			}
+			if (n > 0) {
+				as_dropframes(as, batch, n);
+			}
+			return 0;
+		default:
+			return EINVAL;
+	}
+}
+
+/*
+ * The hints change the regions themselves, and DONTNEED removes page
+ * table entries that other threads' faults might be using; WILLNEED
+ * just looks things up.
+ */
+int as_advise(struct addrspace* as, vaddr_t vaddr, size_t len, int advice) {
+	int result;
+
+	if (advice != MADV_WILLNEED) {
+		rwlock_acquire_write(as->as_regionlock);
+		result = as_doadvise(as, vaddr, len, advice);
+		rwlock_release_write(as->as_regionlock);
+	}
+	else {
+		rwlock_acquire_read(as->as_regionlock);
+		result = as_doadvise(as, vaddr, len, advice);
+		rwlock_release_read(as->as_regionlock);
+	}
+	return result;
+}
+
+int as_mincore(struct addrspace* as, vaddr_t vaddr, size_t npages, unsigned char* vec) {
+	struct page_table_entry* pte;
+	size_t i;
+	int result;
+
+	/* Hold off DONTNEED from other threads while we look. */
+	rwlock_acquire_read(as->as_regionlock);
+	result = as_checkrange(as, vaddr, npages);
+	if (result) {
+		rwlock_release_read(as->as_regionlock);
+		return result;
+	}
+
+	for (i = 0; i < npages; i++) {
+		pte = page_walk(vaddr + i * PAGE_SIZE, as, 0);
+		vec[i] = 0;
+		if (pte != NULL) {
+			vec[i] |= MINCORE_INCORE;
+			if (pte->is_locked) {
+				vec[i] |= MINCORE_LOCKED;
+			}
+		}
+	}
+	rwlock_release_read(as->as_regionlock);
+	return 0;
+}
+
+/*
+ * Locking a page faults it in and keeps DONTNEED from freeing it
+ * (nothing else ever reclaims a frame). Locks don't nest: a single
+ * unlock releases the page however many times it was locked. As in
+ * POSIX, an empty range is fine and does nothing.
+ */
+int as_lock(struct addrspace* as, vaddr_t vaddr, size_t len, int lock) {
+	size_t npages;
+	struct page_table_entry* pte;
+	size_t i;
+	int result;
+
+	if (len == 0) {
+		return 0;
+	}
+
+	/* mlock takes any address; round out to whole pages. */
+	len += vaddr & ~(vaddr_t)PAGE_FRAME;
+	vaddr &= PAGE_FRAME;
+	if (len > USERSPACETOP) {
+		return ENOMEM;
+	}
+	npages = (len + PAGE_SIZE - 1) / PAGE_SIZE;
+
+	rwlock_acquire_read(as->as_regionlock);
+	result = as_checkrange(as, vaddr, npages);
+	if (result) {
+		rwlock_release_read(as->as_regionlock);
+		return result;
+	}
+
+	for (i = 0; i < npages; i++) {
+		pte = page_walk(vaddr + i * PAGE_SIZE, as, lock);
+		if (pte == NULL) {
+			if (lock) {
+				result = EAGAIN;
+				break;
+			}
+			continue;
+		}
+		/*
+		 * as_regionlock is only held shared, so other threads
+		 * may be locking, unlocking or faulting here too; change
+		 * the entry under as_ptlock like page_walk does.
+		 */
+		lock_acquire(as->as_ptlock);
+		pte->is_locked = lock;
+		lock_release(as->as_ptlock);
+	}
+	rwlock_release_read(as->as_regionlock);
+	return result;
+}
+
+/*
+ * Holding as_regionlock shared keeps DONTNEED (which takes it
+ * exclusive) from freeing the frame until as_putpaddr.
+ */
+int as_getpaddr(struct addrspace* as, vaddr_t vaddr, paddr_t* ret) {
+	struct region* region;
+	struct page_table_entry* pte;
+
+	rwlock_acquire_read(as->as_regionlock);
+	region = retrieve_region(as, vaddr);
+	if (region == NULL || !region->readable) {
+		rwlock_release_read(as->as_regionlock);
+		return EFAULT;
+	}
+	pte = page_walk(vaddr & PAGE_FRAME, as, 1);
+	if (pte == NULL) {
+		rwlock_release_read(as->as_regionlock);
+		return ENOMEM;
+	}
+	*ret = pte->pbase | (vaddr & ~(vaddr_t)PAGE_FRAME);
+	return 0;
+}
+
+void as_putpaddr(struct addrspace* as) {
+	rwlock_release_read(as->as_regionlock);
+}
+
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
  * assignment, this file is not compiled or linked or in any way
@@ -256,10 +590,25 @@ as_create(void)
 	}
 	struct page_table_entry** page_directory = (struct page_table_entry**)kmalloc(sizeof(struct page_table_entry*) * PAGE_TABLE_ONE_SIZE);
 	if (page_directory == NULL) {
+		kfree(as);
 		return NULL;
 	}
 	as->page_directory = page_directory;
 
+	as->as_regionlock = rwlock_create("as_regions");
+	if (as->as_regionlock == NULL) {
+		kfree(page_directory);
+		kfree(as);
+		return NULL;
+	}
+	as->as_ptlock = lock_create("as_pt");
+	if (as->as_ptlock == NULL) {
+		rwlock_destroy(as->as_regionlock);
+		kfree(page_directory);
+		kfree(as);
+		return NULL;
+	}
+
 	/*
 	 * Initialize as needed.
 	 */
@@ -271,6 +620,8 @@ as_create(void)
 
 	as->first_region = NULL;
 	as->num_regions = 0;
+	as->as_loading = 0;
+	as->as_cpus = 0;
 
 	return as;
 }
@@ -285,14 +636,22 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 		return ENOMEM;
 	}
 
+	/*
+	 * Other threads of the process may be faulting pages in while
+	 * we copy, so hold the page table still too.
+	 */
+	rwlock_acquire_read(old->as_regionlock);
 	newas->first_region = deep_copy_region(old->first_region);
 	newas->num_regions = old->num_regions;
 
+	lock_acquire(old->as_ptlock);
 	int i = 0;
 	while (i < PAGE_TABLE_ONE_SIZE) {
 		newas->page_directory[i] = deep_copy_page_table(old->page_directory[i]);
 		i++;
 	}
+	lock_release(old->as_ptlock);
+	rwlock_release_read(old->as_regionlock);
 
 	*ret = newas;
 	return 0;
@@ -301,6 +660,7 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 void
 as_destroy(struct addrspace *as)
 {
+	vm_tlbforget(as);
 
 	int i = 0;
 	while (i < PAGE_TABLE_ONE_SIZE) {
@@ -308,7 +668,7 @@ as_destroy(struct addrspace *as)
 			struct page_table_entry* pe = as->page_directory[i];
 			as->page_directory[i] = pe->next;
 			kfree((void*)PADDR_TO_KVADDR(pe->pbase));
-			kfree(pe);
+			objcache_free(&pte_cache, pe);
 		}
 		i++;
 	}
@@ -316,10 +676,64 @@ as_destroy(struct addrspace *as)
 	kfree(as->page_directory);
 
 	destroy_regions(as, as->first_region);
+	rwlock_destroy(as->as_regionlock);
+	lock_destroy(as->as_ptlock);
 
 	kfree(as);
 }
 
+/*
+ * Most address spaces that may be waiting on one cpu's work queue at
+ * once. Their frames stay allocated until the worker gets to them, and
+ * nothing else gives those back, so past this as_destroy_later does
+ * the work itself rather than let a burst of exits run the frame
+ * table dry.
+ *
+ * The count lives in the cpu (c_asbacklog). Only threads on that cpu
+ * touch it: the one queueing, and the queue's worker, which is pinned
+ * there. So turning interrupts off is enough to protect it.
+ */
+#define AS_DESTROY_BACKLOG 4
+
+static
+void
+as_destroy_work(void *vas)
+{
+	int spl;
+
+	as_destroy(vas);
+
+	spl = splhigh();
+	KASSERT(curcpu->c_asbacklog > 0);
+	curcpu->c_asbacklog--;
+	splx(spl);
+}
+
+/*
+ * Tearing down a big page table takes a while, and the exiting (or
+ * exec'ing) thread has better things to do, so hand it to this cpu's
+ * work queue, unless too many are already waiting there. as_destroy
+ * frees the work item along with AS, which is allowed.
+ */
+void
+as_destroy_later(struct addrspace *as)
+{
+	int spl;
+
+	/* Stay on this cpu until the work is on its queue. */
+	spl = splhigh();
+	if (curcpu->c_asbacklog >= AS_DESTROY_BACKLOG) {
+		splx(spl);
+		as_destroy(as);
+		return;
+	}
+	curcpu->c_asbacklog++;
+
+	work_init(&as->as_work, as_destroy_work, as);
+	work_queue(&as->as_work);
+	splx(spl);
+}
+
 void
 as_activate(void)
 {
@@ -337,7 +751,7 @@ as_activate(void)
 
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
-	vm_tlbshootdown_all();
+	vm_tlbactivate(as);
 	splx(spl);
 }
 
@@ -363,8 +777,7 @@ as_deactivate(void)
 
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
-	vm_tlbshootdown_all();
-
+	vm_tlbdeactivate(as);
 	splx(spl);
 }
 
@@ -398,8 +811,10 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	npages = sz / PAGE_SIZE;
 
 	struct region* new_region = create_region(vaddr, npages, readable, writeable, executable);
+	rwlock_acquire_write(as->as_regionlock);
 	add_region(as, new_region);
 	as->num_regions++;
+	rwlock_release_write(as->as_regionlock);
 
 	return 0;
 }
@@ -407,8 +822,10 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 int
 as_prepare_load(struct addrspace *as)
 {
+	rwlock_acquire_write(as->as_regionlock);
 	as->readonly_preparation = (struct region**)kmalloc(sizeof(struct region*) * as->num_regions);
 	if (as->readonly_preparation == NULL) {
+		rwlock_release_write(as->as_regionlock);
 		return ENOMEM;
 	}
 
@@ -426,6 +843,9 @@ as_prepare_load(struct addrspace *as)
 		as->readonly_preparation[i] = NULL;
 		i++;
 	}
+	/* Pages faulted in from here on get file data. */
+	as->as_loading = 1;
+	rwlock_release_write(as->as_regionlock);
 
 	return 0;
 }
@@ -434,6 +854,7 @@ int
 as_complete_load(struct addrspace *as)
 {
 	int i = 0;
+	rwlock_acquire_write(as->as_regionlock);
 	while (i < as->num_regions) {
 		if (as->readonly_preparation[i] != NULL) {
 			as->readonly_preparation[i]->writeable = 0;
@@ -442,6 +863,8 @@ as_complete_load(struct addrspace *as)
 			break;
 		}
 	}
+	as->as_loading = 0;
+	rwlock_release_write(as->as_regionlock);
 
 	kfree(as->readonly_preparation);
 	return 0;
@@ -24,7 +24,7 @@ struct frame_table_entry {
 	int fixed;
 };
 
-static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
+static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER_NAMED("stealmem");
 struct frame_table_entry* frame_table = UNSET;
 paddr_t free_addr;
 struct lock* frame_table_lock;
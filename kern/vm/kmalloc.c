@@ -30,7 +30,12 @@
 #include <types.h>
 #include <lib.h>
 #include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
 #include <vm.h>
+#include <clock.h>
+#include <platform/maxcpus.h>
 
 /*
  * Kernel malloc.
@@ -102,6 +107,14 @@ fill_deadbeef(void *vptr, size_t len)
  * LABELS records the allocation site and a generation number for each
  * allocation and is useful for tracking down memory leaks.
  *
+ * PROFILE keeps running totals for each allocation site and each
+ * block size: live and peak bytes, allocation counts, and the average
+ * lifetime of freed blocks. It implies LABELS, and adds a timestamp
+ * and the block type to the label. The khprof menu command prints
+ * the report. Whole-page allocations, and objcache slabs, have no
+ * room for a label, so they're remembered by address in a side
+ * table instead.
+ *
  * On top of these one can enable the following:
  *
  * CHECKBEEF checks that free blocks still contain 0xdeadbeef when
@@ -117,10 +130,15 @@ fill_deadbeef(void *vptr, size_t len)
 #undef SLOWER
 #undef GUARDS
 #undef LABELS
+#undef PROFILE
 
 #undef CHECKBEEF
 #undef CHECKGUARDS
 
+#if defined(PROFILE) && !defined(LABELS)
+#define LABELS
+#endif
+
 ////////////////////////////////////////
 
 #if PAGE_SIZE == 4096
@@ -160,13 +178,13 @@ struct pageref {
 ////////////////////////////////////////
 
 /*
- * Use one spinlock for the whole thing. Making parts of the kmalloc
- * logic per-cpu is worthwhile for scalability; however, for the time
- * being at least we won't, because it adds a lot of complexity and in
- * OS/161 performance and scalability aren't super-critical.
+ * Use one spinlock for the shared page lists. Most allocations and
+ * frees don't get this far, though; they're handled by the per-cpu
+ * caches below.
  */
 
-static struct spinlock kmalloc_spinlock = SPINLOCK_INITIALIZER;
+static struct spinlock kmalloc_spinlock =
+	SPINLOCK_INITIALIZER_NAMED("kmalloc_spinlock");
 
 ////////////////////////////////////////
 
@@ -198,19 +216,40 @@ struct kheap_root {
 };
 
 /*
- * It would be better to make this dynamically sizeable. However,
- * since we only actually run on System/161 and System/161 is
- * specifically limited to 16M of RAM, we'll just adopt that as a
- * static size limit.
+ * The roots are sized at boot from the amount of RAM: every subpage
+ * page needs one pageref, so one root per NPAGEREFS_PER_PAGE pages of
+ * RAM is always enough. The table of roots is small and is set up by
+ * kheap_bootstrap before the VM system is running; the pageref pages
+ * themselves are only allocated as the heap grows into them.
  *
- * FUTURE: it would be better to pick this number based on the RAM
- * size we find at boot time.
+ * kheaproots_avail has one bit per root, set if the root still has
+ * free pagerefs, so allocpageref can skip over full roots a word at a
+ * time. kheaproots_top is one past the highest root that has ever had
+ * its page allocated; freepageref doesn't need to look beyond it.
  */
 
-#define NUM_PAGEREFPAGES 16
-#define TOTAL_PAGEREFS (NUM_PAGEREFPAGES * NPAGEREFS_PER_PAGE)
+static struct kheap_root *kheaproots;
+static uint32_t *kheaproots_avail;
+static unsigned kheaproots_num;
+static unsigned kheaproots_top;
+
+#define TOTAL_PAGEREFS (kheaproots_num * NPAGEREFS_PER_PAGE)
+
+/*
+ * Return the index of the lowest set bit in a nonzero word.
+ */
+static
+unsigned
+lowbit(uint32_t word)
+{
+	unsigned j;
 
-static struct kheap_root kheaproots[NUM_PAGEREFPAGES];
+	KASSERT(word != 0);
+	for (j=0; (word & 1) == 0; j++) {
+		word >>= 1;
+	}
+	return j;
+}
 
 /*
  * Allocate a page to hold pagerefs.
@@ -248,6 +287,28 @@ allocpagerefpage(struct kheap_root *root)
 	}
 
 	root->page = (struct pagerefpage *)va;
+	if ((unsigned)(root - kheaproots) >= kheaproots_top) {
+		kheaproots_top = (root - kheaproots) + 1;
+	}
+}
+
+/*
+ * Mark a pageref slot free in its root.
+ */
+static
+void
+releaseslot(unsigned whichroot, unsigned slot)
+{
+	struct kheap_root *root;
+	uint32_t k;
+
+	root = &kheaproots[whichroot];
+	k = ((uint32_t)1) << (slot%32);
+	KASSERT((root->pagerefs_inuse[slot/32] & k) != 0);
+	root->pagerefs_inuse[slot/32] &= ~k;
+	KASSERT(root->numinuse > 0);
+	root->numinuse--;
+	kheaproots_avail[whichroot/32] |= ((uint32_t)1) << (whichroot%32);
 }
 
 /*
@@ -257,40 +318,41 @@ static
 struct pageref *
 allocpageref(void)
 {
-	unsigned i,j;
-	uint32_t k;
-	unsigned whichroot;
+	unsigned i, j, w;
+	unsigned whichroot, slot;
 	struct kheap_root *root;
 
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
-		root = &kheaproots[whichroot];
-		if (root->numinuse >= NPAGEREFS_PER_PAGE) {
+	KASSERT(kheaproots != NULL);
+
+	for (w=0; w < DIVROUNDUP(kheaproots_num, 32); w++) {
+		if (kheaproots_avail[w] == 0) {
 			continue;
 		}
+		whichroot = w*32 + lowbit(kheaproots_avail[w]);
+		KASSERT(whichroot < kheaproots_num);
+		root = &kheaproots[whichroot];
+		KASSERT(root->numinuse < NPAGEREFS_PER_PAGE);
 
-		/*
-		 * This should probably not be a linear search.
-		 */
-		for (i=0; i<INUSE_WORDS; i++) {
-			if (root->pagerefs_inuse[i]==0xffffffff) {
-				/* full */
-				continue;
-			}
-			for (k=1,j=0; k!=0; k<<=1,j++) {
-				if ((root->pagerefs_inuse[i] & k)==0) {
-					root->pagerefs_inuse[i] |= k;
-					root->numinuse++;
-					if (root->page == NULL) {
-						allocpagerefpage(root);
-					}
-					if (root->page == NULL) {
-						return NULL;
-					}
-					return &root->page->refs[i*32 + j];
-				}
-			}
-			KASSERT(0);
+		for (i=0; root->pagerefs_inuse[i] == 0xffffffff; i++) {
+			KASSERT(i < INUSE_WORDS - 1);
+		}
+		j = lowbit(~root->pagerefs_inuse[i]);
+		slot = i*32 + j;
+
+		root->pagerefs_inuse[i] |= ((uint32_t)1) << j;
+		root->numinuse++;
+		if (root->numinuse == NPAGEREFS_PER_PAGE) {
+			kheaproots_avail[w] &= ~(((uint32_t)1) << (whichroot%32));
 		}
+
+		if (root->page == NULL) {
+			allocpagerefpage(root);
+		}
+		if (root->page == NULL) {
+			releaseslot(whichroot, slot);
+			return NULL;
+		}
+		return &root->page->refs[slot];
 	}
 
 	/* ran out */
@@ -304,13 +366,12 @@ static
 void
 freepageref(struct pageref *p)
 {
-	size_t i, j;
-	uint32_t k;
+	size_t j;
 	unsigned whichroot;
 	struct kheap_root *root;
 	struct pagerefpage *page;
 
-	for (whichroot=0; whichroot < NUM_PAGEREFPAGES; whichroot++) {
+	for (whichroot=0; whichroot < kheaproots_top; whichroot++) {
 		root = &kheaproots[whichroot];
 
 		page = root->page;
@@ -323,12 +384,7 @@ freepageref(struct pageref *p)
 		/* note: j is unsigned, don't test < 0 */
 		if (j < NPAGEREFS_PER_PAGE) {
 			/* on this page */
-			i = j/32;
-			k = ((uint32_t)1) << (j%32);
-			KASSERT((root->pagerefs_inuse[i] & k) != 0);
-			root->pagerefs_inuse[i] &= ~k;
-			KASSERT(root->numinuse > 0);
-			root->numinuse--;
+			releaseslot(whichroot, j);
 			return;
 		}
 	}
@@ -615,22 +671,37 @@ checksubpages(void)
 struct malloclabel {
 	vaddr_t label;
 	unsigned generation;
+#ifdef PROFILE
+	uint32_t stamp;		/* clock_ticks at allocation */
+	uint32_t blktype;	/* index into sizes[] */
+#endif
 };
 
 static unsigned mallocgeneration;
 
+#ifdef PROFILE
+static void khprof_alloc(struct malloclabel *ml);
+#endif
+
 /*
  * Label a block of memory.
  */
 static
 void *
-establishlabel(void *block, vaddr_t label)
+establishlabel(void *block, vaddr_t label, unsigned blktype)
 {
 	struct malloclabel *ml;
 
 	ml = block;
 	ml->label = label;
 	ml->generation = mallocgeneration;
+#ifdef PROFILE
+	ml->stamp = clock_ticks;
+	ml->blktype = blktype;
+	khprof_alloc(ml);
+#else
+	(void)blktype;
+#endif
 	ml++;
 	return ml;
 }
@@ -697,6 +768,273 @@ dump_subpages(unsigned generation)
 
 #endif /* LABELS */
 
+#ifdef PROFILE
+
+/*
+ * Heap profile.
+ *
+ * Sites are kept in a small open-addressed hash table keyed by the
+ * allocation site; if it fills up, further sites are lumped together
+ * in the last entry, which is never hashed to and is printed as
+ * "(other)". Everything is protected by kmalloc_spinlock, which the
+ * allocation and free paths already hold.
+ */
+
+#define KHPROF_SITES 128
+
+struct khprof_stats {
+	unsigned ks_allocs;		/* blocks allocated */
+	unsigned ks_frees;		/* blocks freed */
+	size_t ks_live;			/* bytes currently allocated */
+	size_t ks_peak;			/* most bytes ever allocated at once */
+	uint64_t ks_lifetime;		/* total ticks lived by freed blocks */
+};
+
+struct khprof_site {
+	vaddr_t ksi_label;
+	struct khprof_stats ksi_stats;
+};
+
+static struct khprof_site khprof_sites[KHPROF_SITES];
+static struct khprof_stats khprof_sizes[NSIZES];
+
+/*
+ * Whole-page allocations. There aren't many of these live at once, so
+ * a table searched linearly does; if it fills up, further ones are
+ * only counted in khprof_untracked.
+ */
+
+#define KHPROF_BIGS 128
+
+struct khprof_big {
+	vaddr_t kb_va;			/* address, or 0 if slot unused */
+	vaddr_t kb_label;		/* allocation site */
+	unsigned kb_npages;
+	uint32_t kb_stamp;		/* clock_ticks at allocation */
+};
+
+static struct khprof_big khprof_bigs[KHPROF_BIGS];
+static struct khprof_stats khprof_pages;
+static unsigned khprof_untracked;
+
+/*
+ * Find the table entry for an allocation site, adding it if needed.
+ */
+static
+struct khprof_stats *
+khprof_site(vaddr_t label)
+{
+	unsigned i, n;
+	struct khprof_site *ksi;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	i = (label >> 2) % (KHPROF_SITES - 1);
+	for (n=0; n < KHPROF_SITES - 1; n++) {
+		ksi = &khprof_sites[i];
+		if (ksi->ksi_label == label) {
+			return &ksi->ksi_stats;
+		}
+		if (ksi->ksi_label == 0) {
+			ksi->ksi_label = label;
+			return &ksi->ksi_stats;
+		}
+		i = (i + 1) % (KHPROF_SITES - 1);
+	}
+	/* table full */
+	return &khprof_sites[KHPROF_SITES - 1].ksi_stats;
+}
+
+static
+void
+khprof_add(struct khprof_stats *ks, size_t size)
+{
+	ks->ks_allocs++;
+	ks->ks_live += size;
+	if (ks->ks_live > ks->ks_peak) {
+		ks->ks_peak = ks->ks_live;
+	}
+}
+
+static
+void
+khprof_sub(struct khprof_stats *ks, size_t size, uint32_t lifetime)
+{
+	KASSERT(ks->ks_live >= size);
+	ks->ks_frees++;
+	ks->ks_live -= size;
+	ks->ks_lifetime += lifetime;
+}
+
+/*
+ * Account for a block that was just labeled.
+ */
+static
+void
+khprof_alloc(struct malloclabel *ml)
+{
+	size_t size = sizes[ml->blktype];
+
+	khprof_add(khprof_site(ml->label), size);
+	khprof_add(&khprof_sizes[ml->blktype], size);
+}
+
+/*
+ * Account for a block that's being freed. ML is a copy of its label,
+ * taken before the block was released.
+ */
+static
+void
+khprof_free(const struct malloclabel *ml)
+{
+	size_t size = sizes[ml->blktype];
+	uint32_t lifetime;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	lifetime = clock_ticks - ml->stamp;
+	khprof_sub(khprof_site(ml->label), size, lifetime);
+	khprof_sub(&khprof_sizes[ml->blktype], size, lifetime);
+}
+
+/*
+ * Account for NPAGES whole pages at VA, allocated at LABEL.
+ */
+static
+void
+khprof_bigalloc(vaddr_t va, unsigned npages, vaddr_t label)
+{
+	struct khprof_big *kb;
+	size_t size = npages * PAGE_SIZE;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	for (i=0; i<KHPROF_BIGS; i++) {
+		kb = &khprof_bigs[i];
+		if (kb->kb_va == 0) {
+			kb->kb_va = va;
+			kb->kb_label = label;
+			kb->kb_npages = npages;
+			kb->kb_stamp = clock_ticks;
+			khprof_add(khprof_site(label), size);
+			khprof_add(&khprof_pages, size);
+			return;
+		}
+	}
+	khprof_untracked++;
+}
+
+/*
+ * Account for whole pages at VA being freed, if we were tracking them.
+ */
+static
+void
+khprof_bigfree(vaddr_t va)
+{
+	struct khprof_big *kb;
+	size_t size;
+	uint32_t lifetime;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	for (i=0; i<KHPROF_BIGS; i++) {
+		kb = &khprof_bigs[i];
+		if (kb->kb_va == va) {
+			size = kb->kb_npages * PAGE_SIZE;
+			lifetime = clock_ticks - kb->kb_stamp;
+			khprof_sub(khprof_site(kb->kb_label), size, lifetime);
+			khprof_sub(&khprof_pages, size, lifetime);
+			kb->kb_va = 0;
+			return;
+		}
+	}
+}
+
+/*
+ * Print one line of the report. The rate is allocations per second
+ * since boot; the lifetime is the mean over blocks freed so far, in
+ * milliseconds.
+ */
+static
+void
+khprof_printstats(const struct khprof_stats *ks, uint32_t elapsed)
+{
+	unsigned rate, avglife;
+
+	rate = elapsed == 0 ? 0 : (uint64_t)ks->ks_allocs * HZ / elapsed;
+	avglife = ks->ks_frees == 0 ? 0 :
+		ks->ks_lifetime * 1000 / HZ / ks->ks_frees;
+	kprintf("%9zu %9zu %8u %8u %7u %9u\n",
+		ks->ks_live, ks->ks_peak, ks->ks_allocs, ks->ks_frees,
+		rate, avglife);
+}
+
+static
+void
+khprof_report(void)
+{
+	uint32_t elapsed;
+	bool printed[KHPROF_SITES];
+	struct khprof_site *ksi, *best;
+	unsigned i;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	elapsed = clock_ticks;
+
+	kprintf("Kernel heap profile, %u.%02u seconds since boot\n",
+		elapsed / HZ, (elapsed % HZ) * 100 / HZ);
+	kprintf("%10s %9s %9s %8s %8s %7s %9s\n", "site", "live",
+		"peak", "allocs", "frees", "per-sec", "life(ms)");
+
+	/* Print sites by live bytes, largest first. */
+	for (i=0; i<KHPROF_SITES; i++) {
+		printed[i] = false;
+	}
+	while (1) {
+		best = NULL;
+		for (i=0; i<KHPROF_SITES; i++) {
+			ksi = &khprof_sites[i];
+			if (printed[i] || ksi->ksi_stats.ks_allocs == 0) {
+				continue;
+			}
+			if (best == NULL ||
+			    ksi->ksi_stats.ks_live > best->ksi_stats.ks_live) {
+				best = ksi;
+			}
+		}
+		if (best == NULL) {
+			break;
+		}
+		printed[best - khprof_sites] = true;
+		if (best == &khprof_sites[KHPROF_SITES - 1]) {
+			kprintf("%10s ", "(other)");
+		}
+		else {
+			kprintf("%10p ", (void *)best->ksi_label);
+		}
+		khprof_printstats(&best->ksi_stats, elapsed);
+	}
+
+	kprintf("%10s %9s %9s %8s %8s %7s %9s\n", "size", "live",
+		"peak", "allocs", "frees", "per-sec", "life(ms)");
+	for (i=0; i<NSIZES; i++) {
+		kprintf("%10zu ", sizes[i]);
+		khprof_printstats(&khprof_sizes[i], elapsed);
+	}
+	kprintf("%10s ", "pages");
+	khprof_printstats(&khprof_pages, elapsed);
+	if (khprof_untracked > 0) {
+		kprintf("%u whole-page allocations not tracked "
+			"(table full)\n", khprof_untracked);
+	}
+}
+
+#endif /* PROFILE */
+
+
 void
 kheap_nextgeneration(void)
 {
@@ -720,6 +1058,45 @@ kheap_dump(void)
 #endif
 }
 
+void
+kheap_profile(void)
+{
+#ifdef PROFILE
+	/* print the whole thing with interrupts off */
+	spinlock_acquire(&kmalloc_spinlock);
+	khprof_report();
+	spinlock_release(&kmalloc_spinlock);
+#else
+	kprintf("Enable PROFILE in kmalloc.c to use this functionality.\n");
+#endif
+}
+
+void
+kheap_profile_pages(vaddr_t va, unsigned npages, vaddr_t site)
+{
+#ifdef PROFILE
+	spinlock_acquire(&kmalloc_spinlock);
+	khprof_bigalloc(va, npages, site);
+	spinlock_release(&kmalloc_spinlock);
+#else
+	(void)va;
+	(void)npages;
+	(void)site;
+#endif
+}
+
+void
+kheap_profile_unpages(vaddr_t va)
+{
+#ifdef PROFILE
+	spinlock_acquire(&kmalloc_spinlock);
+	khprof_bigfree(va);
+	spinlock_release(&kmalloc_spinlock);
+#else
+	(void)va;
+#endif
+}
+
 void
 kheap_dumpall(void)
 {
@@ -816,6 +1193,234 @@ kheap_printstats(void)
 
 ////////////////////////////////////////
 
+/*
+ * Per-cpu caches.
+ *
+ * Each cpu keeps a short list of free blocks of each size, so most
+ * kmalloc and kfree calls never touch kmalloc_spinlock. A cpu that
+ * runs dry takes a batch of blocks off the shared pages in one go,
+ * and one that has accumulated too many gives a batch back. Cached
+ * blocks count as allocated as far as their pages are concerned.
+ *
+ * To free into the cache without searching the page list, kfree needs
+ * to get a block's size from its address. kheap_pagetypes[] holds
+ * the block type (plus one) of each subpage page, indexed by physical
+ * page number, and is updated under kmalloc_spinlock as subpage pages
+ * come and go. A freeing cpu can read its entry without the lock,
+ * because a page with a live block on it can't change type. Like the
+ * pageref roots, it's sized from the amount of RAM by kheap_bootstrap.
+ *
+ * The debugging modes want to see every block go through the shared
+ * code, so the caches are off when any of them are on.
+ */
+
+#if !defined(SLOW) && !defined(GUARDS) && !defined(LABELS)
+#define KCACHE
+#endif
+
+static uint8_t *kheap_pagetypes;
+static unsigned kheap_npages;
+
+static
+void
+kheap_settype(vaddr_t prpage, int blktype)
+{
+	paddr_t pn = (prpage - PADDR_TO_KVADDR(0)) / PAGE_SIZE;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+	if (pn < kheap_npages) {
+		kheap_pagetypes[pn] = blktype + 1;
+	}
+}
+
+#ifdef KCACHE
+
+#define KCACHE_BATCH 8
+#define KCACHE_MAX   (2*KCACHE_BATCH)
+
+struct kcache {
+	struct freelist *kc_blocks[NSIZES];
+	unsigned kc_count[NSIZES];
+};
+
+static struct kcache kcaches[MAXCPUS];
+
+/*
+ * Take up to N free blocks of type BLKTYPE off the existing pages and
+ * chain them onto *HEAD. Returns how many it got.
+ */
+static
+unsigned
+subpage_takeblocks(unsigned blktype, struct freelist **head, unsigned n)
+{
+	struct pageref *pr;
+	struct freelist *fl;
+	vaddr_t prpage;
+	unsigned got = 0;
+
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
+
+	for (pr = sizebases[blktype]; pr != NULL && got < n;
+	     pr = pr->next_samesize) {
+		KASSERT(PR_BLOCKTYPE(pr) == blktype);
+		prpage = PR_PAGEADDR(pr);
+
+		while (pr->nfree > 0 && got < n) {
+			KASSERT(pr->freelist_offset < PAGE_SIZE);
+			fl = (struct freelist *)(prpage + pr->freelist_offset);
+			if (fl->next != NULL) {
+				KASSERT((vaddr_t)fl->next - prpage < PAGE_SIZE);
+				pr->freelist_offset = (vaddr_t)fl->next - prpage;
+			}
+			else {
+				KASSERT(pr->nfree == 1);
+				pr->freelist_offset = INVALID_OFFSET;
+			}
+			pr->nfree--;
+
+			fl->next = *head;
+			*head = fl;
+			got++;
+		}
+	}
+	return got;
+}
+
+/*
+ * Get a block of type BLKTYPE from this cpu's cache, refilling it
+ * from the existing pages if it's empty. Returns NULL if there's
+ * nothing free anywhere and a new page is needed.
+ */
+static
+void *
+kcache_alloc(unsigned blktype)
+{
+	struct kcache *kc;
+	struct freelist *fl;
+	int spl;
+
+	if (!CURCPU_EXISTS()) {
+		return NULL;
+	}
+
+	/* Stay on this cpu, and keep interrupt handlers out. */
+	spl = splhigh();
+	kc = &kcaches[curcpu->c_number];
+	if (kc->kc_count[blktype] == 0) {
+		spinlock_acquire(&kmalloc_spinlock);
+		kc->kc_count[blktype] = subpage_takeblocks(blktype,
+					&kc->kc_blocks[blktype], KCACHE_BATCH);
+		spinlock_release(&kmalloc_spinlock);
+	}
+	fl = kc->kc_blocks[blktype];
+	if (fl != NULL) {
+		kc->kc_blocks[blktype] = fl->next;
+		kc->kc_count[blktype]--;
+	}
+	splx(spl);
+
+	return fl;
+}
+
+static int subpage_freeblock(void *ptr, vaddr_t ptraddr, vaddr_t *freepage);
+
+/*
+ * Give a chain of blocks back to their pages.
+ */
+static
+void
+kcache_drain(struct freelist *fl)
+{
+	vaddr_t freepages[KCACHE_BATCH];
+	struct freelist *next;
+	vaddr_t page;
+	unsigned i, n = 0;
+	int result;
+
+	spinlock_acquire(&kmalloc_spinlock);
+	while (fl != NULL) {
+		next = fl->next;
+		result = subpage_freeblock(fl, (vaddr_t)fl, &page);
+		KASSERT(result == 0);
+		if (page != 0) {
+			KASSERT(n < KCACHE_BATCH);
+			freepages[n++] = page;
+		}
+		fl = next;
+	}
+	spinlock_release(&kmalloc_spinlock);
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	for (i=0; i<n; i++) {
+		free_kpages(freepages[i]);
+	}
+}
+
+/*
+ * Put a block in this cpu's cache. Returns -1 if it's not a subpage
+ * block (or we can't tell) and the slow path should handle it.
+ */
+static
+int
+kcache_free(void *ptr, vaddr_t ptraddr)
+{
+	struct kcache *kc;
+	struct freelist *fl, *drain;
+	paddr_t pn;
+	unsigned blktype, i;
+	int spl;
+
+	if (!CURCPU_EXISTS() || ptraddr < PADDR_TO_KVADDR(0)) {
+		return -1;
+	}
+	pn = (ptraddr - PADDR_TO_KVADDR(0)) / PAGE_SIZE;
+	if (pn >= kheap_npages || kheap_pagetypes[pn] == 0) {
+		return -1;
+	}
+	blktype = kheap_pagetypes[pn] - 1;
+	KASSERT(blktype < NSIZES);
+
+	/* Check for proper positioning and alignment */
+	if ((ptraddr % PAGE_SIZE) % sizes[blktype] != 0) {
+		panic("kfree: subpage free of invalid addr %p\n", ptr);
+	}
+
+	/*
+	 * Clear the block to 0xdeadbeef to make it easier to detect
+	 * uses of dangling pointers.
+	 */
+	fill_deadbeef((void *)ptraddr, sizes[blktype]);
+
+	spl = splhigh();
+	kc = &kcaches[curcpu->c_number];
+
+	/* If the cache is full, split off a batch to give back. */
+	drain = NULL;
+	if (kc->kc_count[blktype] >= KCACHE_MAX) {
+		drain = kc->kc_blocks[blktype];
+		for (fl = drain, i = 1; i < KCACHE_BATCH; i++) {
+			fl = fl->next;
+		}
+		kc->kc_blocks[blktype] = fl->next;
+		fl->next = NULL;
+		kc->kc_count[blktype] -= KCACHE_BATCH;
+	}
+
+	fl = (struct freelist *)ptraddr;
+	KASSERT(fl != kc->kc_blocks[blktype]);
+	fl->next = kc->kc_blocks[blktype];
+	kc->kc_blocks[blktype] = fl;
+	kc->kc_count[blktype]++;
+	splx(spl);
+
+	if (drain != NULL) {
+		kcache_drain(drain);
+	}
+	return 0;
+}
+
+#endif /* KCACHE */
+
 /*
  * Remove a pageref from both lists that it's on.
  */
@@ -901,6 +1506,13 @@ subpage_kmalloc(size_t sz
 	blktype = blocktype(sz);
 	sz = sizes[blktype];
 
+#ifdef KCACHE
+	retptr = kcache_alloc(blktype);
+	if (retptr != NULL) {
+		return retptr;
+	}
+#endif
+
 	spinlock_acquire(&kmalloc_spinlock);
 
 	checksubpages();
@@ -938,7 +1550,7 @@ subpage_kmalloc(size_t sz
 			retptr = establishguardband(retptr, clientsz, sz);
 #endif
 #ifdef LABELS
-			retptr = establishlabel(retptr, label);
+			retptr = establishlabel(retptr, label, blktype);
 #endif
 
 			checksubpages();
@@ -982,6 +1594,7 @@ subpage_kmalloc(size_t sz
 
 	pr->pageaddr_and_blocktype = MKPAB(prpage, blktype);
 	pr->nfree = PAGE_SIZE / sizes[blktype];
+	kheap_settype(prpage, blktype);
 
 	/*
 	 * Note: fl is volatile because the MIPS toolchain we were
@@ -1012,15 +1625,17 @@ subpage_kmalloc(size_t sz
 }
 
 /*
- * Free a pointer previously returned from subpage_kmalloc. If the
- * pointer is not on any heap page we recognize, return -1.
+ * Put the block at PTRADDR back on its page's freelist. Returns -1 if
+ * it isn't on any heap page we recognize. If that leaves its page
+ * completely free, the page is taken off the lists and returned in
+ * *FREEPAGE for the caller to free_kpages once it has dropped the
+ * lock; otherwise *FREEPAGE is 0.
  */
 static
 int
-subpage_kfree(void *ptr)
+subpage_freeblock(void *ptr, vaddr_t ptraddr, vaddr_t *freepage)
 {
 	int blktype;		// index into sizes[] that we're using
-	vaddr_t ptraddr;	// same as ptr
 	struct pageref *pr;	// pageref for page we're freeing in
 	vaddr_t prpage;		// PR_PAGEADDR(pr)
 	vaddr_t fla;		// free list entry address
@@ -1030,34 +1645,9 @@ subpage_kfree(void *ptr)
 	size_t blocksize, smallerblocksize;
 #endif
 
-	ptraddr = (vaddr_t)ptr;
-#ifdef GUARDS
-	if (ptraddr % PAGE_SIZE == 0) {
-		/*
-		 * With guard bands, all client-facing subpage
-		 * pointers are offset by GUARD_PTROFFSET (which is 4)
-		 * from the underlying blocks and are therefore not
-		 * page-aligned. So a page-aligned pointer is not one
-		 * of ours. Catch this up front, as otherwise
-		 * subtracting GUARD_PTROFFSET could give a pointer on
-		 * a page we *do* own, and then we'll panic because
-		 * it's not a valid one.
-		 */
-		return -1;
-	}
-	ptraddr -= GUARD_PTROFFSET;
-#endif
-#ifdef LABELS
-	if (ptraddr % PAGE_SIZE == 0) {
-		/* ditto */
-		return -1;
-	}
-	ptraddr -= LABEL_PTROFFSET;
-#endif
-
-	spinlock_acquire(&kmalloc_spinlock);
+	KASSERT(spinlock_do_i_hold(&kmalloc_spinlock));
 
-	checksubpages();
+	*freepage = 0;
 
 	for (pr = allbase; pr; pr = pr->next_all) {
 		prpage = PR_PAGEADDR(pr);
@@ -1075,7 +1665,6 @@ subpage_kfree(void *ptr)
 
 	if (pr==NULL) {
 		/* Not on any of our pages - not a subpage allocation */
-		spinlock_release(&kmalloc_spinlock);
 		return -1;
 	}
 
@@ -1132,12 +1721,81 @@ subpage_kfree(void *ptr)
 		/* Whole page is free. */
 		remove_lists(pr, blktype);
 		freepageref(pr);
-		/* Call free_kpages without kmalloc_spinlock. */
-		spinlock_release(&kmalloc_spinlock);
-		free_kpages(prpage);
+		kheap_settype(prpage, -1);
+		*freepage = prpage;
 	}
-	else {
-		spinlock_release(&kmalloc_spinlock);
+
+	return 0;
+}
+
+/*
+ * Free a pointer previously returned from subpage_kmalloc. If the
+ * pointer is not on any heap page we recognize, return -1.
+ */
+static
+int
+subpage_kfree(void *ptr)
+{
+	vaddr_t ptraddr;	// same as ptr
+	vaddr_t freepage;	// page to release, if any
+	int result;
+#ifdef PROFILE
+	struct malloclabel ml;
+#endif
+
+	ptraddr = (vaddr_t)ptr;
+#ifdef GUARDS
+	if (ptraddr % PAGE_SIZE == 0) {
+		/*
+		 * With guard bands, all client-facing subpage
+		 * pointers are offset by GUARD_PTROFFSET (which is 4)
+		 * from the underlying blocks and are therefore not
+		 * page-aligned. So a page-aligned pointer is not one
+		 * of ours. Catch this up front, as otherwise
+		 * subtracting GUARD_PTROFFSET could give a pointer on
+		 * a page we *do* own, and then we'll panic because
+		 * it's not a valid one.
+		 */
+		return -1;
+	}
+	ptraddr -= GUARD_PTROFFSET;
+#endif
+#ifdef LABELS
+	if (ptraddr % PAGE_SIZE == 0) {
+		/* ditto */
+		return -1;
+	}
+	ptraddr -= LABEL_PTROFFSET;
+#endif
+
+#ifdef KCACHE
+	if (kcache_free(ptr, ptraddr) == 0) {
+		return 0;
+	}
+#endif
+
+	spinlock_acquire(&kmalloc_spinlock);
+
+	checksubpages();
+
+#ifdef PROFILE
+	/* The label gets overwritten when the block is freed. */
+	ml = ((struct malloclabel *)ptr)[-1];
+#endif
+
+	result = subpage_freeblock(ptr, ptraddr, &freepage);
+
+#ifdef PROFILE
+	if (result == 0) {
+		khprof_free(&ml);
+	}
+#endif
+
+	spinlock_release(&kmalloc_spinlock);
+
+	/* Call free_kpages without kmalloc_spinlock. */
+	if (freepage != 0) {
+		free_kpages(freepage);
 	}
 
 #ifdef SLOWER /* Don't get the lock unless checksubpages does something. */
@@ -1146,12 +1804,54 @@ subpage_kfree(void *ptr)
 	spinlock_release(&kmalloc_spinlock);
 #endif
 
-	return 0;
+	return result;
 }
 
 //
 ////////////////////////////////////////////////////////////
 
+/*
+ * Set up the kernel heap's bookkeeping tables, sized for the RAM we
+ * have. This must run after ram_bootstrap and before the first
+ * kmalloc, while multi-page allocations can still be had from
+ * ram_stealmem.
+ */
+void
+kheap_bootstrap(void)
+{
+	unsigned npages, nroots, nwords, i;
+	size_t rootbytes, availbytes, typebytes;
+	vaddr_t va;
+
+	KASSERT(kheaproots == NULL);
+
+	npages = ram_getlastpaddr() / PAGE_SIZE;
+	nroots = DIVROUNDUP(npages, NPAGEREFS_PER_PAGE);
+	nwords = DIVROUNDUP(nroots, 32);
+
+	rootbytes = nroots * sizeof(struct kheap_root);
+	availbytes = nwords * sizeof(uint32_t);
+	typebytes = ROUNDUP(npages, sizeof(uint32_t));
+
+	va = alloc_kpages(DIVROUNDUP(rootbytes + availbytes + typebytes,
+				     PAGE_SIZE));
+	if (va == 0) {
+		panic("kheap_bootstrap: Out of memory\n");
+	}
+	bzero((void *)va, rootbytes + availbytes + typebytes);
+
+	spinlock_acquire(&kmalloc_spinlock);
+	kheaproots = (struct kheap_root *)va;
+	kheaproots_avail = (uint32_t *)(va + rootbytes);
+	kheap_pagetypes = (uint8_t *)(va + rootbytes + availbytes);
+	for (i=0; i<nroots; i++) {
+		kheaproots_avail[i/32] |= ((uint32_t)1) << (i%32);
+	}
+	kheaproots_num = nroots;
+	kheap_npages = npages;
+	spinlock_release(&kmalloc_spinlock);
+}
+
 /*
  * Allocate a block of size SZ. Redirect either to subpage_kmalloc or
  * alloc_kpages depending on how big SZ is.
@@ -1184,6 +1884,9 @@ kmalloc(size_t sz)
 			return NULL;
 		}
 		KASSERT(address % PAGE_SIZE == 0);
+#ifdef PROFILE
+		kheap_profile_pages(address, npages, label);
+#endif
 
 		return (void *)address;
 	}
@@ -1208,6 +1911,9 @@ kfree(void *ptr)
 		return;
 	} else if (subpage_kfree(ptr)) {
 		KASSERT((vaddr_t)ptr%PAGE_SIZE==0);
+#ifdef PROFILE
+		kheap_profile_unpages((vaddr_t)ptr);
+#endif
 		free_kpages((vaddr_t)ptr);
 	}
 }
@@ -0,0 +1,327 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Typed object caches. See objcache.h.
+ *
+ * Each slab is one page. The slab header sits at the start of the page
+ * and the objects follow it, so the slab an object belongs to is found
+ * by rounding the object's address down to the page. Every object slot
+ * has a trailing link word for the slab's freelist. The object itself
+ * is never written while it's free, so it keeps its constructed state.
+ *
+ * Slabs with free objects are kept on a doubly linked list in the
+ * cache, and full slabs are off the list. One completely free slab is
+ * kept around so a cache that hovers at a slab boundary doesn't keep
+ * allocating and releasing pages. Further empty slabs are given back.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <vm.h>
+#include <objcache.h>
+
+struct objslab {
+	struct objcache *os_cache;	/* Cache we belong to */
+	struct objslab *os_next;	/* Neighbours on oc_slabs */
+	struct objslab *os_prev;
+	void *os_free;			/* First free object */
+	unsigned os_nfree;		/* Number of free objects */
+	unsigned os_nobjs;		/* Total objects in slab */
+};
+
+/* Alignment of objects within a slab. */
+#define OBJ_ALIGN 8
+
+/* List of all caches that have ever had a slab, for stats. */
+static struct spinlock objcache_listlock =
+	SPINLOCK_INITIALIZER_NAMED("objcache_listlock");
+static struct objcache *objcache_list;
+
+/*
+ * Size of one object slot, including the freelist link.
+ */
+static
+size_t
+objcache_stride(const struct objcache *oc)
+{
+	return ROUNDUP(oc->oc_size + sizeof(void *), OBJ_ALIGN);
+}
+
+/*
+ * Address of the freelist link for object OBJ.
+ */
+static
+void **
+objcache_link(const struct objcache *oc, void *obj)
+{
+	return (void **)((char *)obj + objcache_stride(oc) - sizeof(void *));
+}
+
+static
+struct objslab *
+objcache_slabof(void *obj)
+{
+	return (struct objslab *)((vaddr_t)obj & PAGE_FRAME);
+}
+
+static
+void
+slab_link(struct objcache *oc, struct objslab *slab)
+{
+	KASSERT(spinlock_do_i_hold(&oc->oc_lock));
+
+	slab->os_prev = NULL;
+	slab->os_next = oc->oc_slabs;
+	if (oc->oc_slabs != NULL) {
+		oc->oc_slabs->os_prev = slab;
+	}
+	oc->oc_slabs = slab;
+}
+
+static
+void
+slab_unlink(struct objcache *oc, struct objslab *slab)
+{
+	KASSERT(spinlock_do_i_hold(&oc->oc_lock));
+
+	if (slab->os_prev != NULL) {
+		slab->os_prev->os_next = slab->os_next;
+	}
+	else {
+		KASSERT(oc->oc_slabs == slab);
+		oc->oc_slabs = slab->os_next;
+	}
+	if (slab->os_next != NULL) {
+		slab->os_next->os_prev = slab->os_prev;
+	}
+	slab->os_next = slab->os_prev = NULL;
+}
+
+/*
+ * Run the destructor on every object in SLAB and give the page back.
+ * Called without the cache lock.
+ */
+static
+void
+slab_release(struct objcache *oc, struct objslab *slab)
+{
+	char *obj;
+	unsigned i;
+
+	if (oc->oc_dtor != NULL) {
+		obj = (char *)slab + ROUNDUP(sizeof(*slab), OBJ_ALIGN);
+		for (i=0; i<slab->os_nobjs; i++) {
+			oc->oc_dtor(obj);
+			obj += objcache_stride(oc);
+		}
+	}
+	kheap_profile_unpages((vaddr_t)slab);
+	free_kpages((vaddr_t)slab);
+}
+
+/*
+ * Make a new slab, with all its objects constructed. Called without
+ * the cache lock, since constructors may well allocate memory. SITE
+ * is where the allocation that needed it came from, for the heap
+ * profile.
+ */
+static
+struct objslab *
+slab_create(struct objcache *oc, vaddr_t site)
+{
+	struct objslab *slab;
+	size_t stride, first;
+	char *obj;
+	vaddr_t va;
+	unsigned i;
+
+	stride = objcache_stride(oc);
+	first = ROUNDUP(sizeof(*slab), OBJ_ALIGN);
+	KASSERT((PAGE_SIZE - first) / stride >= 4);
+
+	va = alloc_kpages(1);
+	if (va == 0) {
+		return NULL;
+	}
+	kheap_profile_pages(va, 1, site);
+	slab = (struct objslab *)va;
+	slab->os_cache = oc;
+	slab->os_next = slab->os_prev = NULL;
+	slab->os_nobjs = (PAGE_SIZE - first) / stride;
+	slab->os_nfree = slab->os_nobjs;
+	slab->os_free = NULL;
+
+	/* Build the freelist back to front so it starts at the bottom. */
+	for (i = slab->os_nobjs; i-- > 0; ) {
+		obj = (char *)va + first + i * stride;
+		if (oc->oc_ctor != NULL && oc->oc_ctor(obj) != 0) {
+			/* Undo the ones above us that did get built. */
+			if (oc->oc_dtor != NULL) {
+				for (i++; i < slab->os_nobjs; i++) {
+					oc->oc_dtor((char *)va + first +
+						    i * stride);
+				}
+			}
+			kheap_profile_unpages(va);
+			free_kpages(va);
+			return NULL;
+		}
+		*objcache_link(oc, obj) = slab->os_free;
+		slab->os_free = obj;
+	}
+
+	if (!oc->oc_listed) {
+		spinlock_acquire(&objcache_listlock);
+		if (!oc->oc_listed) {
+			oc->oc_next = objcache_list;
+			objcache_list = oc;
+			oc->oc_listed = true;
+		}
+		spinlock_release(&objcache_listlock);
+	}
+
+	return slab;
+}
+
+void *
+objcache_alloc(struct objcache *oc)
+{
+	struct objslab *slab;
+	void *obj;
+
+	spinlock_acquire(&oc->oc_lock);
+	while (oc->oc_slabs == NULL) {
+		spinlock_release(&oc->oc_lock);
+		slab = slab_create(oc,
+				   (vaddr_t)__builtin_return_address(0));
+		if (slab == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&oc->oc_lock);
+		slab_link(oc, slab);
+		oc->oc_nslabs++;
+		oc->oc_nempty++;
+		oc->oc_slaballocs++;
+	}
+
+	slab = oc->oc_slabs;
+	KASSERT(slab->os_nfree > 0);
+	if (slab->os_nfree == slab->os_nobjs) {
+		KASSERT(oc->oc_nempty > 0);
+		oc->oc_nempty--;
+	}
+
+	obj = slab->os_free;
+	slab->os_free = *objcache_link(oc, obj);
+	slab->os_nfree--;
+	if (slab->os_nfree == 0) {
+		/* Full; take it off the list. */
+		slab_unlink(oc, slab);
+	}
+
+	oc->oc_inuse++;
+	oc->oc_allocs++;
+	spinlock_release(&oc->oc_lock);
+
+	return obj;
+}
+
+void
+objcache_free(struct objcache *oc, void *obj)
+{
+	struct objslab *slab;
+
+	if (obj == NULL) {
+		return;
+	}
+
+	slab = objcache_slabof(obj);
+	if (slab->os_cache != oc) {
+		panic("objcache_free: %p is not from cache %s\n",
+		      obj, oc->oc_name);
+	}
+
+	spinlock_acquire(&oc->oc_lock);
+
+	KASSERT(obj != slab->os_free);
+	*objcache_link(oc, obj) = slab->os_free;
+	slab->os_free = obj;
+	slab->os_nfree++;
+	KASSERT(oc->oc_inuse > 0);
+	oc->oc_inuse--;
+	oc->oc_frees++;
+
+	if (slab->os_nfree == 1) {
+		/* Was full; it has room again. */
+		slab_link(oc, slab);
+	}
+
+	if (slab->os_nfree == slab->os_nobjs) {
+		if (oc->oc_nempty > 0) {
+			/* Already have a spare; give this one back. */
+			slab_unlink(oc, slab);
+			oc->oc_nslabs--;
+			spinlock_release(&oc->oc_lock);
+			slab_release(oc, slab);
+			return;
+		}
+		oc->oc_nempty++;
+	}
+
+	spinlock_release(&oc->oc_lock);
+}
+
+void
+objcache_printstats(void)
+{
+	struct objcache *oc;
+	unsigned nslabs, inuse;
+	unsigned long allocs, frees;
+
+	/* Caches are only ever added at the head, so we can walk unlocked. */
+	spinlock_acquire(&objcache_listlock);
+	oc = objcache_list;
+	spinlock_release(&objcache_listlock);
+
+	kprintf("%-12s %6s %6s %6s %10s %10s\n", "cache", "size", "slabs",
+		"inuse", "allocs", "frees");
+	for (; oc != NULL; oc = oc->oc_next) {
+		spinlock_acquire(&oc->oc_lock);
+		nslabs = oc->oc_nslabs;
+		inuse = oc->oc_inuse;
+		allocs = oc->oc_allocs;
+		frees = oc->oc_frees;
+		spinlock_release(&oc->oc_lock);
+
+		kprintf("%-12s %6u %6u %6u %10lu %10lu\n", oc->oc_name,
+			(unsigned)oc->oc_size, nslabs, inuse, allocs, frees);
+	}
+}
@@ -1,5 +1,6 @@
 #include <types.h>
 #include <kern/errno.h>
+#include <kern/mman.h>
 #include <lib.h>
 #include <thread.h>
 #include <addrspace.h>
@@ -8,11 +9,31 @@
 #include <proc.h>
 #include <current.h>
 #include <spl.h>
+#include <cpu.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <platform/maxcpus.h>
+
+/*
+ * Number of pages past the faulting one to map in regions the process
+ * has marked MADV_SEQUENTIAL.
+ */
+#define VM_READAHEAD_PAGES 8
 
 int clock_hand = 0;
 
+/*
+ * Which address space each CPU's TLB currently holds entries for, so
+ * switching back to the same one skips the flush and a shootdown only
+ * has to interrupt the CPUs named in as->as_cpus.
+ */
+static struct spinlock tlb_owner_lock = SPINLOCK_INITIALIZER_NAMED("tlb_owner");
+static struct addrspace* tlb_owner[MAXCPUS];
+
 int clock_hand_tlb_knockoff(void);
 void write_tlb_entry(vaddr_t faultaddress, paddr_t paddr, uint32_t dirty_bit);
+static int vm_dofault(struct addrspace *as, int faulttype, vaddr_t faultaddress);
+static void vm_readahead(struct addrspace* as, struct region* region, vaddr_t faultaddress, uint32_t dirty_bit);
 
 void vm_bootstrap(void)
 {
@@ -25,8 +46,8 @@ void vm_bootstrap(void)
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
-	paddr_t paddr;
 	struct addrspace *as;
+	int result;
 
 	if (curproc == NULL) {
 		 /*
@@ -49,6 +70,25 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	DEBUG(DB_VM, "vm: fault: 0x%x\n", faultaddress);
 
+	/*
+	 * Faults only look at the regions, so any number of them can
+	 * proceed together; hold the lock until we're done with REGION.
+	 */
+	rwlock_acquire_read(as->as_regionlock);
+	result = vm_dofault(as, faulttype, faultaddress);
+	rwlock_release_read(as->as_regionlock);
+	return result;
+}
+
+/*
+ * The body of vm_fault, called with as_regionlock held shared.
+ */
+static
+int
+vm_dofault(struct addrspace *as, int faulttype, vaddr_t faultaddress)
+{
+	paddr_t paddr;
+
 	struct region* region = retrieve_region(as, faultaddress);
 	if (region == NULL) {
 		return EFAULT;
@@ -95,15 +135,58 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	write_tlb_entry(faultaddress, paddr, dirty_bit);
 	splx(spl);
 
+	if (region->advice == MADV_SEQUENTIAL) {
+		vm_readahead(as, region, faultaddress, dirty_bit);
+	}
+
 	return 0;
 }
 
+/*
+ * Readahead for sequentially accessed regions: fault in the next few
+ * pages after FAULTADDRESS and load them into the TLB as well, so that
+ * a linear scan doesn't trap once per page. Stops quietly at the end
+ * of the region or if memory runs out; it's only a hint.
+ */
+static void vm_readahead(struct addrspace* as, struct region* region, vaddr_t faultaddress, uint32_t dirty_bit) {
+	vaddr_t end = region->vbase + region->npages * PAGE_SIZE;
+	vaddr_t va;
+	struct page_table_entry* page;
+	int i, spl;
+
+	for (i = 1; i <= VM_READAHEAD_PAGES; i++) {
+		va = faultaddress + i * PAGE_SIZE;
+		if (va >= end) {
+			break;
+		}
+		page = page_walk(va, as, 1);
+		if (page == NULL) {
+			break;
+		}
+
+		spl = splhigh();
+		/* Never load two TLB entries for the same page. */
+		if (tlb_probe(va, 0) < 0) {
+			write_tlb_entry(va, page->pbase, dirty_bit);
+		}
+		splx(spl);
+	}
+}
+
 void write_tlb_entry(vaddr_t faultaddress, paddr_t paddr, uint32_t dirty_bit) {	
 	int index;
 	uint32_t ehi = faultaddress;
 	uint32_t elo = paddr | dirty_bit | TLBLO_VALID;
 
-	index = clock_hand_tlb_knockoff();
+	/*
+	 * Another thread of the same process may have faulted this
+	 * page in on this cpu while we were getting here; the TLB
+	 * mustn't hold two entries for it.
+	 */
+	index = tlb_probe(ehi, 0);
+	if (index < 0) {
+		index = clock_hand_tlb_knockoff();
+	}
 
 	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
 	tlb_write(ehi, elo, index);
@@ -116,8 +199,7 @@ int clock_hand_tlb_knockoff(void) {
 }
 
 /*
- *
- * SMP-specific functions.  Unused in our configuration.
+ * TLB management.
  *        IMPORTANT NOTE: from tlb_probe :: An entry may be matching even if the valid bit
  *        is not set. To completely invalidate the TLB, load it with
  *        translations for addresses in one of the unmapped address
@@ -132,10 +214,132 @@ vm_tlbshootdown_all(void)
 	}
 }
 
+void
+vm_tlbinvalidate(vaddr_t vaddr)
+{
+	int i, spl;
+
+	spl = splhigh();
+	i = tlb_probe(vaddr & PAGE_FRAME, 0);
+	if (i >= 0) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	splx(spl);
+}
+
+/*
+ * Called from the shootdown IPI. The entry is only ours to drop if
+ * this CPU still holds the address space it was queued for; otherwise
+ * the TLB was already flushed when we switched away. Only this CPU
+ * sets its own tlb_owner slot, so no lock is needed to read it.
+ */
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-	(void)ts;
-	panic("vm tried to do tlb shootdown?!\n");
+	int i;
+
+	if (tlb_owner[curcpu->c_number] != ts->ts_as) {
+		return;
+	}
+	i = tlb_probe(ts->ts_vaddr & PAGE_FRAME, 0);
+	if (i >= 0) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+}
+
+/* Call with interrupts off. */
+void vm_tlbactivate(struct addrspace* as) {
+	unsigned me = curcpu->c_number;
+	struct addrspace* old;
+
+	spinlock_acquire(&tlb_owner_lock);
+	old = tlb_owner[me];
+	if (old == as) {
+		spinlock_release(&tlb_owner_lock);
+		return;
+	}
+	if (old != NULL) {
+		old->as_cpus &= ~((uint32_t)1 << me);
+	}
+	tlb_owner[me] = as;
+	as->as_cpus |= (uint32_t)1 << me;
+	spinlock_release(&tlb_owner_lock);
+
+	vm_tlbshootdown_all();
+}
+
+/* Call with interrupts off. */
+void vm_tlbdeactivate(struct addrspace* as) {
+	unsigned me = curcpu->c_number;
+
+	spinlock_acquire(&tlb_owner_lock);
+	if (tlb_owner[me] == as) {
+		tlb_owner[me] = NULL;
+	}
+	as->as_cpus &= ~((uint32_t)1 << me);
+	spinlock_release(&tlb_owner_lock);
+
+	vm_tlbshootdown_all();
+}
+
+/*
+ * AS is going away; make sure no CPU thinks it still owns it, or a new
+ * address space allocated at the same address would skip its flush.
+ * Other CPUs' stale entries are dropped on their next activate.
+ */
+void vm_tlbforget(struct addrspace* as) {
+	unsigned i;
+	int spl, mine = 0;
+
+	spl = splhigh();
+	spinlock_acquire(&tlb_owner_lock);
+	for (i = 0; i < MAXCPUS; i++) {
+		if (tlb_owner[i] == as) {
+			tlb_owner[i] = NULL;
+			if (i == curcpu->c_number) {
+				mine = 1;
+			}
+		}
+	}
+	as->as_cpus = 0;
+	spinlock_release(&tlb_owner_lock);
+	if (mine) {
+		vm_tlbshootdown_all();
+	}
+	splx(spl);
 }
 
+/*
+ * Drop NUM translations of AS from every TLB that may hold them: the
+ * local one directly, the others with one IPI per CPU. Returns once
+ * every target has done so, so the frames behind VADDRS can be freed.
+ */
+void vm_tlbshootdown_batch(struct addrspace* as, const vaddr_t* vaddrs, unsigned num) {
+	struct tlbshootdown ts[TLBSHOOTDOWN_MAX];
+	uint32_t mask, mybit;
+	unsigned i;
+	int spl;
+
+	KASSERT(num <= TLBSHOOTDOWN_MAX);
+
+	for (i = 0; i < num; i++) {
+		ts[i].ts_as = as;
+		ts[i].ts_vaddr = vaddrs[i];
+	}
+
+	spl = splhigh();
+	mybit = (uint32_t)1 << curcpu->c_number;
+	spinlock_acquire(&tlb_owner_lock);
+	mask = as->as_cpus;
+	spinlock_release(&tlb_owner_lock);
+	if (mask & mybit) {
+		for (i = 0; i < num; i++) {
+			vm_tlbshootdown(&ts[i]);
+		}
+	}
+	splx(spl);
+
+	if (mask & ~mybit) {
+		ipi_tlbshootdown_mask(mask & ~mybit, ts, num);
+	}
+}
@@ -38,9 +38,13 @@
  * about the kern/ headers.
  */
 #include <kern/fcntl.h>
+#include <kern/futex.h>
 #include <kern/ioctl.h>
+#include <kern/mman.h>
 #include <kern/reboot.h>
+#include <kern/schedstat.h>
 #include <kern/seek.h>
+#include <kern/spawn.h>
 #include <kern/time.h>
 #include <kern/unistd.h>
 #include <kern/wait.h>
@@ -118,6 +122,9 @@
 __DEAD void _exit(int code);
 int execv(const char *prog, char *const *args);
 pid_t fork(void);
+pid_t vfork(void);
+pid_t spawn(const char *prog, char *const *args,
+	    const struct spawn_fdaction *actions, int nactions);
 pid_t waitpid(pid_t pid, int *returncode, int flags);
 /*
  * Open actually takes either two or three args: the optional third
@@ -153,6 +160,14 @@ ssize_t readlink(const char *path, char *buf, size_t buflen);
 int dup2(int filehandle, int newhandle);
 int pipe(int filehandles[2]);
 int __time(time_t *seconds, unsigned long *nanoseconds);
+int nanosleep(const struct timespec *req, struct timespec *rem);
+int setaffinity(unsigned mask);
+int getaffinity(unsigned *mask);
+int schedstat(int which, struct schedstat *ss);
+int __thread_create(void (*entry)(void *), void *arg, void *stack);
+__DEAD void thread_exit(int status);
+int thread_join(int tid, int *status);
+int futex(int *addr, int op, int val);
 ssize_t __getcwd(char *buf, size_t buflen);
 /* stat - see sys/stat.h */
 /* lstat - see sys/stat.h */
@@ -164,6 +179,8 @@ ssize_t __getcwd(char *buf, size_t buflen);
 int execvp(const char *prog, char *const *args); /* calls execv */
 char *getcwd(char *buf, size_t buflen);		/* calls __getcwd */
 time_t time(time_t *seconds);			/* calls __time */
+int thread_create(void (*func)(void *), void *arg,
+		  void *stack, size_t stacksize); /* calls __thread_create */
 
 /* UNSW versions of mmap() and munmap()
  * This are simplified compared to the standard version on UNIX
@@ -176,4 +193,16 @@ time_t time(time_t *seconds);			/* calls __time */
 void *mmap(size_t length, int prot, int fd, off_t offset);
 int munmap(void *addr);
 
+/*
+ * Memory hints. madvise() takes one of the MADV_* codes; mincore()
+ * stores one byte of MINCORE_* bits per page of the range into VEC.
+ * MADV_DONTNEED fails with EINVAL, freeing nothing, if the range has
+ * locked pages or pages loaded from the program file (see
+ * <kern/mman.h>). mlock() and munlock() of a zero length do nothing.
+ */
+int madvise(void *addr, size_t len, int advice);
+int mincore(void *addr, size_t len, unsigned char *vec);
+int mlock(const void *addr, size_t len);
+int munlock(const void *addr, size_t len);
+
 #endif /* _UNISTD_H_ */
@@ -0,0 +1,81 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+
+/*
+ * Start a new thread running FUNC(ARG) on the caller-supplied stack
+ * STACK of STACKSIZE bytes. Returns the new thread's id, for
+ * thread_join. If FUNC returns, the thread exits with status 0.
+ *
+ * The __thread_create system call only passes one argument to the
+ * new thread, so FUNC and ARG are parked at the top of the new stack
+ * and a trampoline unpacks them.
+ */
+
+struct thread_start {
+	void (*ts_func)(void *);
+	void *ts_arg;
+};
+
+static
+void
+__thread_start(void *data)
+{
+	struct thread_start *ts = data;
+
+	ts->ts_func(ts->ts_arg);
+	thread_exit(0);
+}
+
+int
+thread_create(void (*func)(void *), void *arg, void *stack, size_t stacksize)
+{
+	struct thread_start *ts;
+	uintptr_t top;
+
+	if (func == NULL || stack == NULL ||
+	    stacksize < sizeof(*ts) + 64) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	top = ((uintptr_t)stack + stacksize) & ~(uintptr_t)7;
+	ts = (struct thread_start *)(top - sizeof(*ts));
+	ts->ts_func = func;
+	ts->ts_arg = arg;
+
+	/*
+	 * Leave room below the start record for the 16-byte argument
+	 * save area the MIPS calling convention gives every callee.
+	 */
+	return __thread_create(__thread_start, ts, (char *)ts - 16);
+}
@@ -0,0 +1,99 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Condition variables.
+ *
+ * c_seq changes on every signal, so a waiter that samples it before
+ * letting go of the mutex and then sleeps on it in futex() can't
+ * miss a signal sent in between: the futex wait fails at once. The
+ * count of waiters lets signal and broadcast skip the system call
+ * when nobody's waiting.
+ *
+ * As usual, waiters can wake spuriously and should recheck their
+ * condition in a loop.
+ */
+
+#include <unistd.h>
+#include <sync.h>
+#include "atomic.h"
+
+/* As many as there are, for FUTEX_WAKE. */
+#define WAKE_ALL	0x7fffffff
+
+void
+cond_init(struct cond *c)
+{
+	c->c_seq = 0;
+	c->c_waiters = 0;
+}
+
+void
+cond_wait(struct cond *c, struct mutex *m)
+{
+	int seq;
+
+	/* count ourselves before sampling c_seq (see cond_signal) */
+	atomic_add(&c->c_waiters, 1);
+	seq = c->c_seq;
+
+	mutex_unlock(m);
+	futex((int *)&c->c_seq, FUTEX_WAIT, seq);
+	atomic_add(&c->c_waiters, -1);
+
+	/*
+	 * Others may be asleep on the mutex too, so take it in the
+	 * contended state to make sure our unlock wakes them.
+	 */
+	while (atomic_xchg(&m->m_state, 2) != 0) {
+		futex((int *)&m->m_state, FUTEX_WAIT, 2);
+	}
+}
+
+/*
+ * A waiter that isn't counted yet by the time we look at c_waiters
+ * will see the new c_seq, so it's fine not to wake it.
+ */
+void
+cond_signal(struct cond *c)
+{
+	atomic_add(&c->c_seq, 1);
+	if (c->c_waiters > 0) {
+		futex((int *)&c->c_seq, FUTEX_WAKE, 1);
+	}
+}
+
+void
+cond_broadcast(struct cond *c)
+{
+	atomic_add(&c->c_seq, 1);
+	if (c->c_waiters > 0) {
+		futex((int *)&c->c_seq, FUTEX_WAKE, WAKE_ALL);
+	}
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Mutexes.
+ *
+ * This is the three-state futex mutex: 0 is free, 1 is held, and 2
+ * is held with (possibly) someone sleeping. Taking a free mutex is a
+ * single compare-and-swap, and releasing one in state 1 is a single
+ * decrement; neither enters the kernel. A thread that finds the
+ * mutex held sets it to 2 and sleeps in futex() until it can take it
+ * in state 2 itself, so that its own unlock will wake the next one.
+ */
+
+#include <unistd.h>
+#include <sync.h>
+#include "atomic.h"
+
+void
+mutex_init(struct mutex *m)
+{
+	m->m_state = 0;
+}
+
+int
+mutex_trylock(struct mutex *m)
+{
+	return atomic_cas(&m->m_state, 0, 1) == 0;
+}
+
+void
+mutex_lock(struct mutex *m)
+{
+	int c;
+
+	c = atomic_cas(&m->m_state, 0, 1);
+	if (c == 0) {
+		/* fast path */
+		return;
+	}
+
+	if (c != 2) {
+		c = atomic_xchg(&m->m_state, 2);
+	}
+	while (c != 0) {
+		/* fails at once (EAGAIN) if it was released meanwhile */
+		futex((int *)&m->m_state, FUTEX_WAIT, 2);
+		c = atomic_xchg(&m->m_state, 2);
+	}
+}
+
+void
+mutex_unlock(struct mutex *m)
+{
+	if (atomic_add(&m->m_state, -1) != 1) {
+		/* there were waiters; let one of them have it */
+		m->m_state = 0;
+		futex((int *)&m->m_state, FUTEX_WAKE, 1);
+	}
+}
@@ -42,17 +42,9 @@ static
 pid_t
 spawnv(const char *prog, char **argv)
 {
-	pid_t pid = fork();
-	switch (pid) {
-	    case -1:
-		err(1, "fork");
-	    case 0:
-		/* child */
-		execv(prog, argv);
-		err(1, "%s: execv", prog);
-	    default:
-		/* parent */
-		break;
+	pid_t pid = spawn(prog, argv, NULL, 0);
+	if (pid < 0) {
+		err(1, "%s: spawn", prog);
 	}
 	return pid;
 }
@@ -0,0 +1,184 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * madvtest - exercise madvise(), mincore(), mlock() and munlock().
+ *
+ * Works on a chunk of BSS: checks that touched pages show up as
+ * resident, that MADV_DONTNEED throws the contents away (the pages
+ * come back zeroed), that MADV_WILLNEED faults pages in, and that
+ * locked pages are reported as such and refuse MADV_DONTNEED.
+ * Pages of initialized data, which came from the executable, refuse
+ * it too, and locking or unlocking nothing succeeds.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#define PAGE_SIZE 4096
+#define NPAGES 16
+
+/* One extra page so we can find NPAGES whole pages inside it. */
+static char bss_stuff[(NPAGES + 1) * PAGE_SIZE];
+
+/* Initialized, so it's loaded from the file; two pages hold one whole. */
+static char data_stuff[2 * PAGE_SIZE] = { 1 };
+
+static unsigned char vec[NPAGES];
+
+static
+char *
+pagealign(char *p)
+{
+	uintptr_t x = (uintptr_t)p;
+
+	x = (x + PAGE_SIZE - 1) & ~(uintptr_t)(PAGE_SIZE - 1);
+	return (char *)x;
+}
+
+static
+void
+check_vec(const char *what, unsigned first, unsigned n, unsigned char want)
+{
+	unsigned i;
+
+	for (i=first; i<first+n; i++) {
+		if ((vec[i] & want) != want) {
+			errx(1, "%s: page %u has flags 0x%x, expected 0x%x",
+			     what, i, vec[i], want);
+		}
+	}
+}
+
+int
+main(void)
+{
+	char *base;
+	unsigned i;
+
+	base = pagealign(bss_stuff);
+
+	printf("madvtest: phase 1: mincore\n");
+	for (i=0; i<NPAGES; i++) {
+		base[i * PAGE_SIZE] = 'a' + i;
+	}
+	if (mincore(base, NPAGES * PAGE_SIZE, vec) < 0) {
+		err(1, "mincore");
+	}
+	check_vec("after touch", 0, NPAGES, MINCORE_INCORE);
+
+	printf("madvtest: phase 2: MADV_DONTNEED\n");
+	if (madvise(base, NPAGES * PAGE_SIZE, MADV_DONTNEED) < 0) {
+		err(1, "madvise DONTNEED");
+	}
+	if (mincore(base, NPAGES * PAGE_SIZE, vec) < 0) {
+		err(1, "mincore");
+	}
+	for (i=0; i<NPAGES; i++) {
+		if (vec[i] & MINCORE_INCORE) {
+			errx(1, "page %u still resident after DONTNEED", i);
+		}
+	}
+	for (i=0; i<NPAGES; i++) {
+		if (base[i * PAGE_SIZE] != 0) {
+			errx(1, "page %u not zero after DONTNEED", i);
+		}
+	}
+
+	printf("madvtest: phase 3: MADV_WILLNEED\n");
+	if (madvise(base, NPAGES * PAGE_SIZE, MADV_DONTNEED) < 0) {
+		err(1, "madvise DONTNEED");
+	}
+	if (madvise(base, NPAGES * PAGE_SIZE, MADV_WILLNEED) < 0) {
+		err(1, "madvise WILLNEED");
+	}
+	if (mincore(base, NPAGES * PAGE_SIZE, vec) < 0) {
+		err(1, "mincore");
+	}
+	check_vec("after WILLNEED", 0, NPAGES, MINCORE_INCORE);
+
+	printf("madvtest: phase 4: mlock\n");
+	if (mlock(base, 4 * PAGE_SIZE) < 0) {
+		err(1, "mlock");
+	}
+	if (mincore(base, NPAGES * PAGE_SIZE, vec) < 0) {
+		err(1, "mincore");
+	}
+	check_vec("after mlock", 0, 4, MINCORE_INCORE | MINCORE_LOCKED);
+	if (madvise(base, NPAGES * PAGE_SIZE, MADV_DONTNEED) == 0) {
+		errx(1, "MADV_DONTNEED of locked pages succeeded");
+	}
+	if (errno != EINVAL) {
+		err(1, "MADV_DONTNEED of locked pages: unexpected error");
+	}
+	if (munlock(base, 4 * PAGE_SIZE) < 0) {
+		err(1, "munlock");
+	}
+	if (madvise(base, NPAGES * PAGE_SIZE, MADV_DONTNEED) < 0) {
+		err(1, "madvise DONTNEED after munlock");
+	}
+
+	printf("madvtest: phase 5: MADV_SEQUENTIAL\n");
+	if (madvise(base, NPAGES * PAGE_SIZE, MADV_SEQUENTIAL) < 0) {
+		err(1, "madvise SEQUENTIAL");
+	}
+	for (i=0; i<NPAGES * PAGE_SIZE; i++) {
+		if (base[i] != 0) {
+			errx(1, "byte %u not zero", i);
+		}
+	}
+	if (madvise(base, NPAGES * PAGE_SIZE, MADV_NORMAL) < 0) {
+		err(1, "madvise NORMAL");
+	}
+
+	printf("madvtest: phase 6: loaded pages\n");
+	if (madvise(pagealign(data_stuff), PAGE_SIZE, MADV_DONTNEED) == 0) {
+		errx(1, "MADV_DONTNEED of loaded data succeeded");
+	}
+	if (errno != EINVAL) {
+		err(1, "MADV_DONTNEED of loaded data: unexpected error");
+	}
+	if (data_stuff[0] != 1) {
+		errx(1, "initialized data changed");
+	}
+
+	printf("madvtest: phase 7: empty mlock\n");
+	if (mlock(base, 0) < 0) {
+		err(1, "mlock of zero length");
+	}
+	if (munlock(base, 0) < 0) {
+		err(1, "munlock of zero length");
+	}
+
+	printf("madvtest: passed\n");
+	return 0;
+}
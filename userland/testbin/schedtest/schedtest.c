@@ -0,0 +1,309 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * schedtest - check the scheduler-facing system calls from userland.
+ *
+ * nanosleep must sleep at least as long as asked (less at most one
+ * hardclock, since sleeps are rounded to whole hardclocks and the
+ * first one may be partly gone) and not wildly longer, and must
+ * reject malformed times.
+ *
+ * setaffinity must reject a mask with no usable cpus, and once it
+ * returns the caller must be running on a cpu in the new mask; hopping
+ * through every cpu in turn has to show up as migrations.
+ *
+ * schedstat counters, per cpu and per thread, must never go down, and
+ * sleeping has to count as a voluntary switch.
+ */
+
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+#include <kern/schedstat.h>
+
+/* One hardclock, at the kernel's HZ of 100. */
+#define TICK_NS 10000000UL
+
+/* How late a sleep may wake on a quiet system. */
+#define SLACK_NS 200000000UL
+
+/* Most cpus we look at stats for. */
+#define MAXCPUS 32
+
+static struct schedstat before[MAXCPUS + 1], after[MAXCPUS + 1];
+
+static
+unsigned long long
+now_ns(void)
+{
+	time_t secs;
+	unsigned long nsecs;
+
+	if (__time(&secs, &nsecs) < 0) {
+		err(1, "__time");
+	}
+	return (unsigned long long)secs * 1000000000ULL + nsecs;
+}
+
+static
+void
+sleepfor(unsigned long ns)
+{
+	struct timespec ts;
+	unsigned long long start, elapsed;
+
+	ts.tv_sec = ns / 1000000000UL;
+	ts.tv_nsec = ns % 1000000000UL;
+	start = now_ns();
+	if (nanosleep(&ts, NULL) < 0) {
+		err(1, "nanosleep %lu ns", ns);
+	}
+	elapsed = now_ns() - start;
+
+	if (elapsed + TICK_NS < ns) {
+		errx(1, "nanosleep for %lu ns returned after %llu",
+		     ns, elapsed);
+	}
+	if (elapsed > ns + TICK_NS + SLACK_NS) {
+		errx(1, "nanosleep for %lu ns took %llu", ns, elapsed);
+	}
+}
+
+static
+void
+test_nanosleep(void)
+{
+	struct timespec ts;
+
+	printf("schedtest: phase 1: nanosleep\n");
+
+	sleepfor(0);
+	sleepfor(1);
+	sleepfor(TICK_NS);
+	sleepfor(25000000UL);
+	sleepfor(300000000UL);
+	sleepfor(1200000000UL);
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = 1000000000;
+	if (nanosleep(&ts, NULL) == 0) {
+		errx(1, "nanosleep accepted tv_nsec of a whole second");
+	}
+	if (errno != EINVAL) {
+		err(1, "nanosleep with bad tv_nsec: unexpected error");
+	}
+	ts.tv_sec = -1;
+	ts.tv_nsec = 0;
+	if (nanosleep(&ts, NULL) == 0) {
+		errx(1, "nanosleep accepted a negative time");
+	}
+	if (errno != EINVAL) {
+		err(1, "nanosleep with negative time: unexpected error");
+	}
+}
+
+static
+unsigned
+migrations(void)
+{
+	struct schedstat ss;
+
+	if (schedstat(SCHEDSTAT_SELF, &ss) < 0) {
+		err(1, "schedstat");
+	}
+	return ss.ss_migrations;
+}
+
+static
+void
+test_affinity(void)
+{
+	unsigned origmask, mask, ncpus, i, before, after;
+	volatile unsigned spin;
+
+	printf("schedtest: phase 2: affinity\n");
+
+	if (getaffinity(&origmask) < 0) {
+		err(1, "getaffinity");
+	}
+
+	if (setaffinity(0) == 0) {
+		errx(1, "setaffinity accepted an empty mask");
+	}
+	if (errno != EINVAL) {
+		err(1, "setaffinity of an empty mask: unexpected error");
+	}
+
+	/* Count the cpus: the first that doesn't exist gives EINVAL. */
+	for (ncpus = 0; ncpus < 32; ncpus++) {
+		if (setaffinity(1U << ncpus) < 0) {
+			if (errno != EINVAL) {
+				err(1, "setaffinity to cpu %u", ncpus);
+			}
+			break;
+		}
+	}
+	if (ncpus == 0) {
+		errx(1, "setaffinity refused cpu 0");
+	}
+	printf("schedtest: %u cpus\n", ncpus);
+
+	/* Hop through each cpu in turn. */
+	before = migrations();
+	for (i=0; i<ncpus; i++) {
+		if (setaffinity(1U << i) < 0) {
+			err(1, "setaffinity to cpu %u", i);
+		}
+		if (getaffinity(&mask) < 0) {
+			err(1, "getaffinity");
+		}
+		if (mask != 1U << i) {
+			errx(1, "mask is 0x%x after setting 0x%x",
+			     mask, 1U << i);
+		}
+		for (spin = 0; spin < 100000; spin++) {
+			/* run there a while */
+		}
+	}
+	after = migrations();
+	if (ncpus > 1 && after - before < ncpus - 1) {
+		errx(1, "%u migrations hopping across %u cpus",
+		     after - before, ncpus);
+	}
+
+	if (setaffinity(origmask) < 0) {
+		err(1, "setaffinity back to 0x%x", origmask);
+	}
+}
+
+/*
+ * Fetch stats for the first NCPUS cpus into SS[0..NCPUS-1] and our
+ * own into SS[NCPUS].
+ */
+static
+void
+getstats(struct schedstat *ss, unsigned ncpus)
+{
+	unsigned i;
+
+	for (i=0; i<ncpus; i++) {
+		if (schedstat(i, &ss[i]) < 0) {
+			err(1, "schedstat for cpu %u", i);
+		}
+	}
+	if (schedstat(SCHEDSTAT_SELF, &ss[ncpus]) < 0) {
+		err(1, "schedstat for self");
+	}
+}
+
+/*
+ * Complain if counter WHAT went down for cpu WHICH (or for us, if
+ * WHICH is NCPUS).
+ */
+static
+void
+checkup(const char *what, unsigned which, unsigned ncpus,
+	unsigned old, unsigned new)
+{
+	if (new >= old) {
+		return;
+	}
+	if (which == ncpus) {
+		errx(1, "%s for self went from %u to %u", what, old, new);
+	}
+	errx(1, "%s for cpu %u went from %u to %u", what, which, old, new);
+}
+
+static
+void
+test_schedstat(void)
+{
+	struct schedstat ss;
+	unsigned ncpus, i, j;
+	volatile unsigned spin;
+
+	printf("schedtest: phase 3: schedstat\n");
+
+	for (ncpus = 0; ncpus < MAXCPUS; ncpus++) {
+		if (schedstat(ncpus, &ss) < 0) {
+			if (errno != EINVAL) {
+				err(1, "schedstat for cpu %u", ncpus);
+			}
+			break;
+		}
+	}
+	if (ncpus == 0) {
+		errx(1, "schedstat refused cpu 0");
+	}
+	if (schedstat(-2, &ss) == 0) {
+		errx(1, "schedstat accepted cpu -2");
+	}
+
+	getstats(before, ncpus);
+	for (i=0; i<10; i++) {
+		sleepfor(TICK_NS);
+		for (spin = 0; spin < 100000; spin++) {
+			/* keep the cpu busy for a bit */
+		}
+	}
+	getstats(after, ncpus);
+
+	for (i=0; i<=ncpus; i++) {
+		checkup("vswitches", i, ncpus,
+			before[i].ss_vswitches, after[i].ss_vswitches);
+		checkup("ivswitches", i, ncpus,
+			before[i].ss_ivswitches, after[i].ss_ivswitches);
+		checkup("migrations", i, ncpus,
+			before[i].ss_migrations, after[i].ss_migrations);
+		checkup("idleticks", i, ncpus,
+			before[i].ss_idleticks, after[i].ss_idleticks);
+		for (j=0; j<SCHEDSTAT_BUCKETS; j++) {
+			checkup("latency bucket", i, ncpus,
+				before[i].ss_latency[j],
+				after[i].ss_latency[j]);
+		}
+	}
+	if (after[ncpus].ss_vswitches < before[ncpus].ss_vswitches + 10) {
+		errx(1, "10 sleeps made only %u voluntary switches",
+		     after[ncpus].ss_vswitches - before[ncpus].ss_vswitches);
+	}
+}
+
+int
+main(void)
+{
+	test_nanosleep();
+	test_affinity();
+	test_schedstat();
+
+	printf("schedtest: passed\n");
+	return 0;
+}
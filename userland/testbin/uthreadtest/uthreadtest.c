@@ -0,0 +1,416 @@
+/*
+ * Copyright (c) 2013
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * uthreadtest - exercise user threads, futexes, and libsync.
+ *
+ * Creates and joins threads, checks futex WAIT/WAKE and the EAGAIN
+ * case, hammers a mutex and bounces a condition variable between two
+ * threads, and then, in child processes, makes sure that _exit and
+ * execv get rid of threads that are asleep in futex() (directly or
+ * in mutex_lock) or spinning in userland. (Those threads see EINTR, or nothing at all, on
+ * their way out; if they didn't go, the child would never finish.)
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+#include <sync.h>
+#include <sys/wait.h>
+
+#define NTHREADS 6
+#define STACKSIZE 8192
+#define NITERS 2000
+#define NROUNDS 500
+
+#define EXIT_STATUS 3
+#define EXEC_STATUS 7
+
+static char stacks[NTHREADS][STACKSIZE];
+static int tids[NTHREADS];
+
+static volatile int fx_word;
+static volatile int never;
+static volatile int ready[NTHREADS];
+
+static struct mutex mtx = MUTEX_INITIALIZER;
+static struct cond cnd = COND_INITIALIZER;
+static volatile unsigned counter;
+static volatile unsigned turn;
+static struct mutex held = MUTEX_INITIALIZER;
+
+static const char *progname;
+
+static
+void
+start(unsigned i, void (*func)(void *))
+{
+	tids[i] = thread_create(func, (void *)i, stacks[i], STACKSIZE);
+	if (tids[i] < 0) {
+		err(1, "thread_create");
+	}
+}
+
+static
+void
+waitready(unsigned n)
+{
+	unsigned i;
+
+	for (i=0; i<n; i++) {
+		while (!ready[i]) {
+			/* spin */
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+static
+void
+exiter(void *arg)
+{
+	unsigned i = (unsigned)arg;
+
+	thread_exit(100 + i);
+}
+
+static
+void
+test_join(void)
+{
+	unsigned i;
+	int status;
+
+	printf("uthreadtest: phase 1: create and join\n");
+	for (i=0; i<NTHREADS; i++) {
+		start(i, exiter);
+	}
+	for (i=0; i<NTHREADS; i++) {
+		if (thread_join(tids[i], &status) < 0) {
+			err(1, "thread_join");
+		}
+		if (status != (int)(100 + i)) {
+			errx(1, "thread %u exited with %d, expected %u",
+			     i, status, 100 + i);
+		}
+	}
+	if (thread_join(tids[0], &status) == 0) {
+		errx(1, "joined the same thread twice");
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+static
+void
+fx_waiter(void *arg)
+{
+	unsigned i = (unsigned)arg;
+
+	ready[i] = 1;
+	while (fx_word == 0) {
+		/* EAGAIN just means it changed already */
+		futex((int *)&fx_word, FUTEX_WAIT, 0);
+	}
+	thread_exit(0);
+}
+
+static
+void
+test_futex(void)
+{
+	unsigned i;
+	int result;
+
+	printf("uthreadtest: phase 2: futex\n");
+
+	fx_word = 1;
+	result = futex((int *)&fx_word, FUTEX_WAIT, 0);
+	if (result == 0) {
+		errx(1, "FUTEX_WAIT on a changed value slept");
+	}
+	if (errno != EAGAIN) {
+		err(1, "FUTEX_WAIT on a changed value: unexpected error");
+	}
+	result = futex((int *)&fx_word, FUTEX_WAKE, 1);
+	if (result != 0) {
+		errx(1, "FUTEX_WAKE with no waiters woke %d", result);
+	}
+
+	fx_word = 0;
+	for (i=0; i<NTHREADS; i++) {
+		ready[i] = 0;
+		start(i, fx_waiter);
+	}
+	waitready(NTHREADS);
+	fx_word = 1;
+	if (futex((int *)&fx_word, FUTEX_WAKE, NTHREADS) < 0) {
+		err(1, "FUTEX_WAKE");
+	}
+	for (i=0; i<NTHREADS; i++) {
+		if (thread_join(tids[i], NULL) < 0) {
+			err(1, "thread_join");
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+static
+void
+incrementer(void *arg)
+{
+	unsigned i, j, val;
+
+	(void)arg;
+	for (i=0; i<NITERS; i++) {
+		mutex_lock(&mtx);
+		val = counter;
+		/* widen the window so a broken lock would show */
+		for (j=0; j<10; j++) {
+			counter = val + j;
+		}
+		counter = val + 1;
+		mutex_unlock(&mtx);
+	}
+}
+
+static
+void
+test_mutex(void)
+{
+	unsigned i;
+
+	printf("uthreadtest: phase 3: contended mutex\n");
+	counter = 0;
+	for (i=0; i<NTHREADS; i++) {
+		start(i, incrementer);
+	}
+	for (i=0; i<NTHREADS; i++) {
+		if (thread_join(tids[i], NULL) < 0) {
+			err(1, "thread_join");
+		}
+	}
+	if (counter != NTHREADS * NITERS) {
+		errx(1, "counter is %u, expected %u",
+		     counter, NTHREADS * NITERS);
+	}
+	if (!mutex_trylock(&mtx)) {
+		errx(1, "mutex still held after all threads are done");
+	}
+	if (mutex_trylock(&mtx)) {
+		errx(1, "mutex_trylock took a held mutex");
+	}
+	mutex_unlock(&mtx);
+}
+
+/*
+ * Two threads take turns: each waits for its turn, passes it to the
+ * other, and signals.
+ */
+static
+void
+pingpong(void *arg)
+{
+	unsigned me = (unsigned)arg;
+	unsigned i;
+
+	mutex_lock(&mtx);
+	for (i=0; i<NROUNDS; i++) {
+		while (turn != me) {
+			cond_wait(&cnd, &mtx);
+		}
+		counter++;
+		turn = !me;
+		cond_signal(&cnd);
+	}
+	mutex_unlock(&mtx);
+}
+
+static
+void
+test_cond(void)
+{
+	unsigned i;
+
+	printf("uthreadtest: phase 4: condition variable ping-pong\n");
+	counter = 0;
+	turn = 0;
+	for (i=0; i<2; i++) {
+		start(i, pingpong);
+	}
+	for (i=0; i<2; i++) {
+		if (thread_join(tids[i], NULL) < 0) {
+			err(1, "thread_join");
+		}
+	}
+	if (counter != 2 * NROUNDS) {
+		errx(1, "%u turns taken, expected %u", counter, 2 * NROUNDS);
+	}
+}
+
+////////////////////////////////////////////////////////////
+
+/*
+ * Thread bodies for the exit and exec tests: a third sleep in
+ * futex() on a word nobody changes, a third block in mutex_lock on
+ * a mutex the main thread holds, and a third spin.
+ */
+static
+void
+sleeper(void *arg)
+{
+	unsigned i = (unsigned)arg;
+
+	ready[i] = 1;
+	while (1) {
+		futex((int *)&never, FUTEX_WAIT, 0);
+	}
+}
+
+static
+void
+spinner(void *arg)
+{
+	unsigned i = (unsigned)arg;
+
+	ready[i] = 1;
+	while (1) {
+		/* spin */
+	}
+}
+
+static
+void
+locker(void *arg)
+{
+	unsigned i = (unsigned)arg;
+
+	ready[i] = 1;
+	mutex_lock(&held);
+	errx(1, "thread %u got a mutex that was never released", i);
+}
+
+static
+void
+startall(void)
+{
+	static void (*const funcs[3])(void *) = {
+		sleeper, locker, spinner,
+	};
+	unsigned i;
+
+	mutex_lock(&held);
+	for (i=0; i<NTHREADS; i++) {
+		ready[i] = 0;
+		start(i, funcs[i % 3]);
+	}
+	waitready(NTHREADS);
+}
+
+static
+void
+checkchild(pid_t pid, int want, const char *what)
+{
+	int status;
+
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != want) {
+		errx(1, "%s: child status 0x%x, expected exit %d",
+		     what, status, want);
+	}
+}
+
+static
+void
+test_exit(void)
+{
+	pid_t pid;
+
+	printf("uthreadtest: phase 5: _exit with threads\n");
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		startall();
+		_exit(EXIT_STATUS);
+	}
+	checkchild(pid, EXIT_STATUS, "_exit");
+}
+
+static
+void
+test_exec(void)
+{
+	char *args[3];
+	pid_t pid;
+
+	printf("uthreadtest: phase 6: execv with threads\n");
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		startall();
+		args[0] = (char *)progname;
+		args[1] = (char *)"execed";
+		args[2] = NULL;
+		execv(progname, args);
+		warn("execv");
+		_exit(1);
+	}
+	checkchild(pid, EXEC_STATUS, "execv");
+}
+
+int
+main(int argc, char *argv[])
+{
+	if (argc > 1 && !strcmp(argv[1], "execed")) {
+		/* the new image from test_exec */
+		_exit(EXEC_STATUS);
+	}
+	progname = argc > 0 && argv[0][0] == '/' ?
+		argv[0] : "/testbin/uthreadtest";
+
+	test_join();
+	test_futex();
+	test_mutex();
+	test_cond();
+	test_exit();
+	test_exec();
+
+	printf("uthreadtest: passed\n");
+	return 0;
+}